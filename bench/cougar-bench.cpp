@@ -0,0 +1,302 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Benchmarks the Cougar helpers against SimulatedCougar, no hardware required.
+// Run from the repository root via "make bench".
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "cougardevice.h"
+#include "mappedfile.h"
+#include "remap.h"
+#include "simcougar.h"
+#include "usbdevice.h"
+#include "usbrecord.h"
+
+using Clock = std::chrono::steady_clock;
+
+static const std::string cProfileOn = "config/rdr-cursor-on.tmc";
+static const std::string cProfileOff = "config/rdr-cursor-off.tmc";
+static const std::string cTMJBinary = "config/dunc_dx.bin";
+
+//////////////////////////////////////////////////////////////////////
+
+struct Simulated
+{
+    SimulatedCougar *sim;
+    std::unique_ptr<USBDevice> dev;
+};
+
+static Simulated OpenSimulated(const SimulatedCougarConfig &config)
+{
+    Simulated s;
+    s.sim = new SimulatedCougar(config);
+    s.dev.reset(new USBDevice(std::unique_ptr<USBTransport>(s.sim)));
+
+    s.dev->Open();
+    s.dev->ClaimInterface(CougarDevice::cCougarInterfaceBulkOut);
+    s.dev->ClaimInterface(CougarDevice::cCougarInterfaceBulkIn);
+
+    return s;
+}
+
+static void Report(const std::string &name, int iterations, Clock::duration elapsed,
+                   size_t commands, size_t bytes)
+{
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    double meanMs = seconds * 1000 / iterations;
+
+    std::printf("%-24s %6d %10.3f ms %10.0f cmd/s %10.1f KiB/s\n", name.c_str(), iterations, meanMs,
+                commands / seconds, bytes / seconds / 1024);
+}
+
+// Time iterations calls of op against a fresh simulated device
+static void Bench(const std::string &name, const SimulatedCougarConfig &config, int iterations,
+                  const std::function<void(USBDevice &dev, int iteration)> &op)
+{
+    auto s = OpenSimulated(config);
+
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; i++)
+        op(*s.dev, i);
+    auto elapsed = Clock::now() - start;
+
+    Report(name, iterations, elapsed, s.sim->CommandCount(), s.sim->BytesWritten());
+}
+
+// Discards output, isolates the pipeline's own cost
+struct NullSink : public CougarDevice::JoystickSink
+{
+    void Setup(const std::vector<uint16_t>&, size_t) override {}
+    void Publish(const int32_t*, uint64_t) override {}
+};
+
+static void PrintUsage(const char* appName)
+{
+    std::cout << "Usage: " << appName << " [-n N] [-l USEC] [-b BYTES] [-r MSEC] [-f FILE]\n";
+    std::cout << "Options:\n";
+    std::cout << "  -n N\tIterations per benchmark (default 200)\n";
+    std::cout << "  -l USEC\tSimulated round trip latency (default 1000)\n";
+    std::cout << "  -b BYTES\tSimulated bulk throughput per second, 0 unlimited (default 1000000)\n";
+    std::cout << "  -r MSEC\tSimulated re-enumeration delay (default 100)\n";
+    std::cout << "  -f FILE\tHOTASUpdate.exe to include the firmware upload benchmark\n";
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 200;
+    std::string firmware_filename;
+
+    SimulatedCougarConfig config;
+    config.latency = std::chrono::microseconds(1000);
+    config.bytesPerSecond = 1000000;
+    config.reenumerationDelay = std::chrono::milliseconds(100);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:b:r:f:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': iterations = std::atoi(optarg); break;
+            case 'l': config.latency = std::chrono::microseconds(std::atoi(optarg)); break;
+            case 'b': config.bytesPerSecond = std::strtoul(optarg, nullptr, 10); break;
+            case 'r': config.reenumerationDelay = std::chrono::milliseconds(std::atoi(optarg)); break;
+            case 'f': firmware_filename = optarg; break;
+            default:
+                PrintUsage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (iterations <= 0)
+    {
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Resets are orders of magnitude slower, keep their run time reasonable
+    int reset_iterations = std::max(1, iterations / 20);
+
+    std::printf("latency %lld us, throughput %zu B/s, re-enumeration %lld ms\n\n",
+                static_cast<long long>(config.latency.count()), config.bytesPerSecond,
+                static_cast<long long>(config.reenumerationDelay.count()));
+    std::printf("%-24s %6s %13s %16s %16s\n", "benchmark", "iters", "mean", "commands", "throughput");
+
+    try
+    {
+        Bench("SetCougarOptions", config, iterations, [](USBDevice &dev, int i)
+        {
+            CougarDevice::SetCougarOptions(dev, static_cast<CougarDevice::CougarOptions>(i % 8));
+        });
+
+        Bench("UploadProfile", config, iterations, [](USBDevice &dev, int)
+        {
+            CougarDevice::UploadProfile(dev, cProfileOn);
+        });
+
+        // Profiles differ in Windows axis state, every upload resets the device
+        Bench("UploadProfile+reset", config, reset_iterations, [](USBDevice &dev, int i)
+        {
+            CougarDevice::UploadProfile(dev, i % 2 ? cProfileOff : cProfileOn);
+        });
+
+        Bench("UploadTMJBinary", config, iterations, [](USBDevice &dev, int)
+        {
+            CougarDevice::UploadTMJBinary(dev, cTMJBinary);
+        });
+
+        // Profile readback per call, against a session snapshot kept current by our writes
+        Bench("OptionsIfChanged", config, iterations, [](USBDevice &dev, int i)
+        {
+            CougarDevice::SetCougarOptionsIfChanged(dev, static_cast<CougarDevice::CougarOptions>(i % 2));
+        });
+
+        CougarDevice::CougarState state;
+        Bench("OptionsIfChanged+state", config, iterations, [&](USBDevice &dev, int i)
+        {
+            CougarDevice::SetCougarOptionsIfChanged(dev, static_cast<CougarDevice::CougarOptions>(i % 2), &state);
+        });
+
+        // Equivalent of "-p -t -u -e", sequential helpers against a single transaction
+        static const auto cChainOptions = CougarDevice::CougarOptions::UserProfile | CougarDevice::CougarOptions::ButtonAxisEmulation;
+
+        Bench("Chained -p -t -u -e", config, iterations, [](USBDevice &dev, int)
+        {
+            CougarDevice::UploadProfile(dev, cProfileOn);
+            CougarDevice::UploadTMJBinary(dev, cTMJBinary);
+            CougarDevice::SetCougarOptions(dev, cChainOptions);
+        });
+
+        CougarDevice::CougarTransaction transaction;
+        transaction.UploadProfile(cProfileOn);
+        transaction.UploadTMJBinary(cTMJBinary);
+        transaction.SetOptions(cChainOptions);
+
+        Bench("CougarTransaction", config, iterations, [&](USBDevice &dev, int)
+        {
+            transaction.Commit(dev);
+        });
+
+        // The transaction recorded once then replayed from the trace, the protocol code's own cost
+        {
+            std::string recording = "/tmp/cougar-bench-" + std::to_string(getpid()) + ".cgr";
+            {
+                auto s = OpenSimulated(config);
+                s.dev->Record(recording);
+                transaction.Commit(*s.dev);
+            }
+
+            size_t records = 0;
+            size_t trace_size = MappedFile(recording).Size();
+
+            auto start = Clock::now();
+            for (int i = 0; i < iterations * 10; i++)
+            {
+                auto replay = new ReplayTransport(recording);
+                USBDevice dev{std::unique_ptr<USBTransport>(replay)};
+
+                dev.Open();
+                transaction.Commit(dev);
+
+                records += replay->Replayed();
+            }
+            auto elapsed = Clock::now() - start;
+
+            std::remove(recording.c_str());
+            Report("Replay transaction", iterations * 10, elapsed, records, trace_size * iterations * 10);
+        }
+
+        if (! firmware_filename.empty())
+        {
+            Bench("UploadFirmware", config, reset_iterations, [&](USBDevice &dev, int)
+            {
+                CougarDevice::UploadFirmware(dev, firmware_filename);
+            });
+        }
+
+        // Reset to ready, excludes the reset command itself
+        {
+            auto s = OpenSimulated(config);
+            Clock::duration elapsed{};
+
+            for (int i = 0; i < reset_iterations; i++)
+            {
+                CougarDevice::SendCommand(*s.dev, CougarDevice::cResetCommand);
+
+                auto start = Clock::now();
+                s.dev->Reconnect();
+                elapsed += Clock::now() - start;
+            }
+
+            Report("Reconnect", reset_iterations, elapsed, 0, 0);
+        }
+
+        // Simulated HID reports at 4 kHz through curves on every axis, latency is added per report
+        {
+            SimulatedCougarConfig hid_config = config;
+            hid_config.reportInterval = std::chrono::microseconds(250);
+
+            auto s = OpenSimulated(hid_config);
+            s.dev->ClaimInterface(CougarDevice::cCougarInterfaceHID);
+
+            HIDReportLayout layout(s.dev->ReadHIDReportDescriptor(CougarDevice::cCougarInterfaceHID));
+            NullSink sink;
+            CougarDevice::RemapPipeline pipeline(layout, sink);
+
+            std::vector<CougarDevice::AxisResponse> responses;
+            for (const auto &axis : layout.Axes())
+                responses.push_back({axis.usage, axis.usage, 0.05, 0.3, false});
+            responses[0].output = layout.Axes()[1].usage;
+            responses[1].output = layout.Axes()[0].usage;
+            pipeline.SetResponses(responses);
+
+            s.dev->StartInterruptIn(CougarDevice::cCougarEndpointInterruptIn, SimulatedCougar::cHIDReportSize,
+                                    [&](const unsigned char *report, size_t size)
+            {
+                if (report)
+                    pipeline.Process(report, size);
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(iterations * 5));
+            s.dev->StopInterruptIn();
+
+            const auto &latency = pipeline.Latency();
+            std::printf("%-24s %6llu %10.3f us %10s p99 < %llu us\n", "RemapPipeline",
+                        static_cast<unsigned long long>(latency.Count()),
+                        latency.Count() ? static_cast<double>(latency.SumMicros()) / latency.Count() : 0.0, "",
+                        static_cast<unsigned long long>(latency.QuantileMicros(0.99)));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "Error: " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,265 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "calibration.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+
+#include "cougardevice.h"
+#include "trace.h"
+
+namespace CougarDevice {
+
+// Capture thread poll interval, the ring holds far longer than this
+static const std::chrono::milliseconds cDrainInterval{2};
+
+static int64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//////////////////////////////////////////////////////////////////////
+// HIDSampleRing
+//////////////////////////////////////////////////////////////////////
+
+bool HIDSampleRing::Push(const unsigned char *report, size_t size, int64_t timeNs) noexcept
+{
+    size_t h = head.load(std::memory_order_relaxed);
+
+    if (h - tail.load(std::memory_order_acquire) == cCapacity)
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    HIDSample &sample = samples[h & (cCapacity - 1)];
+    sample.timeNs = timeNs;
+    sample.size = static_cast<uint32_t>(std::min(size, cMaxHIDReportSize));
+    std::copy(report, report + sample.size, sample.data);
+
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+size_t HIDSampleRing::Pop(HIDSample *out, size_t max) noexcept
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t count = std::min(max, head.load(std::memory_order_acquire) - t);
+
+    for (size_t i = 0; i < count; i++)
+        out[i] = samples[(t + i) & (cCapacity - 1)];
+
+    tail.store(t + count, std::memory_order_release);
+    return count;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CalibrationTracker
+//////////////////////////////////////////////////////////////////////
+
+const size_t CalibrationTracker::cBatchSize;
+
+CalibrationTracker::CalibrationTracker(const HIDReportLayout &layout)
+    : axes(layout.Axes()),
+      values(axes.size() * cBatchSize),
+      mins(axes.size(), std::numeric_limits<int32_t>::max()),
+      maxs(axes.size(), std::numeric_limits<int32_t>::min()),
+      centreSums(axes.size(), 0)
+{
+    if (axes.empty())
+        throw std::runtime_error("HID report descriptor declares no axes");
+}
+
+void CalibrationTracker::Add(const HIDSample *batch, size_t count)
+{
+    Phase current = phase.load(std::memory_order_relaxed);
+
+    for (size_t start = 0; start < count; start += cBatchSize)
+    {
+        size_t n = std::min(cBatchSize, count - start);
+        const HIDSample *block = batch + start;
+
+        if (samples == 0 && n != 0)
+            firstTimeNs = block[0].timeNs;
+        if (n != 0)
+            lastTimeNs = block[n - 1].timeNs;
+        samples += n;
+
+        if (current == PhaseIdle)
+            continue;
+
+        // Decode, dropping reports that do not carry every axis (e.g other report IDs)
+        size_t used = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            const HIDSample &sample = block[i];
+
+            bool complete = true;
+            for (const auto &axis : axes)
+                complete = complete && HIDReportLayout::Contains(axis, sample.data, sample.size);
+            if (! complete)
+                continue;
+
+            for (size_t a = 0; a < axes.size(); a++)
+                values[a * cBatchSize + used] = axes[a].Extract(sample.data);
+            used++;
+        }
+
+        // Branch free reductions over each axis
+        for (size_t a = 0; a < axes.size(); a++)
+        {
+            const int32_t *v = &values[a * cBatchSize];
+
+            if (current == PhaseCentre)
+            {
+                int64_t sum = 0;
+                for (size_t i = 0; i < used; i++)
+                    sum += v[i];
+                centreSums[a] += sum;
+            }
+            else
+            {
+                int32_t lo = mins[a];
+                int32_t hi = maxs[a];
+                for (size_t i = 0; i < used; i++)
+                {
+                    lo = std::min(lo, v[i]);
+                    hi = std::max(hi, v[i]);
+                }
+                mins[a] = lo;
+                maxs[a] = hi;
+            }
+        }
+
+        if (current == PhaseCentre)
+            centreSamples += used;
+        else
+            rangeSamples += used;
+    }
+}
+
+double CalibrationTracker::ReportRate() const
+{
+    if (samples < 2 || lastTimeNs == firstTimeNs)
+        return 0.0;
+
+    return (samples - 1) * 1e9 / (lastTimeNs - firstTimeNs);
+}
+
+std::vector<AxisCalibration> CalibrationTracker::Result() const
+{
+    if (centreSamples == 0)
+        throw std::runtime_error("No reports captured while axes were centred");
+    if (rangeSamples == 0)
+        throw std::runtime_error("No reports captured while axes were moved through their range");
+
+    std::vector<AxisCalibration> result;
+
+    for (size_t a = 0; a < axes.size(); a++)
+    {
+        auto centre = static_cast<int32_t>(centreSums[a] / static_cast<int64_t>(centreSamples));
+        result.push_back({axes[a].usage, mins[a], std::min(std::max(centre, mins[a]), maxs[a]), maxs[a]});
+    }
+
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// HIDCapture
+//////////////////////////////////////////////////////////////////////
+
+HIDCapture::HIDCapture(USBDevice &dev, CalibrationTracker &tracker) : dev(dev), tracker(tracker)
+{
+}
+
+HIDCapture::~HIDCapture()
+{
+    try
+    {
+        if (consumer.joinable())
+            Stop();
+    }
+    catch (const std::exception &)
+    {
+    }
+}
+
+void HIDCapture::Start()
+{
+    TraceSpan span("HIDCapture::Start", "capture");
+
+    stopping = false;
+    streamEnded = false;
+
+    // Only the timestamp and a copy happen on the event thread
+    dev.StartInterruptIn(cCougarEndpointInterruptIn, dev.MaxPacketSize(cCougarEndpointInterruptIn),
+                         [this](const unsigned char *report, size_t size)
+    {
+        if (report == nullptr)
+            streamEnded = true;
+        else
+            ring.Push(report, size, NowNs());
+    });
+
+    consumer = std::thread([this]()
+    {
+        TraceLog::Global().NameThread("hid capture");
+
+        while (! stopping)
+        {
+            Drain();
+            std::this_thread::sleep_for(cDrainInterval);
+        }
+    });
+}
+
+void HIDCapture::Stop()
+{
+    dev.StopInterruptIn();
+
+    stopping = true;
+    consumer.join();
+
+    // Anything queued after the consumer's last pass
+    Drain();
+
+    if (streamEnded)
+        throw std::runtime_error("HID capture ended early, the Cougar may have been disconnected");
+    if (ring.Dropped() != 0)
+        throw std::runtime_error("HID capture dropped " + std::to_string(ring.Dropped()) + " reports");
+}
+
+void HIDCapture::Drain()
+{
+    static const size_t cDrainBatch = 256;
+    HIDSample batch[cDrainBatch];
+
+    while (size_t count = ring.Pop(batch, cDrainBatch))
+        tracker.Add(batch, count);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,178 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hidreport.h"
+#include "usbdevice.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// HIDSampleRing
+//////////////////////////////////////////////////////////////////////
+
+const size_t cMaxHIDReportSize = 64;
+
+struct HIDSample
+{
+    int64_t timeNs;     // steady_clock, taken on arrival
+    uint32_t size;
+    unsigned char data[cMaxHIDReportSize];
+};
+
+// Lock free single producer, single consumer queue of reports. Pushed from
+// the USB event thread and drained by the capture thread.
+class HIDSampleRing
+{
+public:
+    // 16 seconds at a 1 kHz report rate
+    static const size_t cCapacity = 16384;
+
+    HIDSampleRing() : samples(new HIDSample[cCapacity]) {}
+
+    // Counts a drop and returns false if full
+    bool Push(const unsigned char *report, size_t size, int64_t timeNs) noexcept;
+
+    // Up to max samples, oldest first
+    size_t Pop(HIDSample *out, size_t max) noexcept;
+
+    uint64_t Dropped() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    static_assert((cCapacity & (cCapacity - 1)) == 0, "Ring capacity must be a power of two");
+
+    std::unique_ptr<HIDSample[]> samples;
+
+    // Free running, each written by one side only and kept on separate cache lines
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) std::atomic<uint64_t> dropped{0};
+};
+
+//////////////////////////////////////////////////////////////////////
+// CalibrationTracker
+//////////////////////////////////////////////////////////////////////
+
+struct AxisCalibration
+{
+    uint16_t usage;     // HID generic desktop usage, X = 0x30
+    int32_t min;
+    int32_t centre;
+    int32_t max;
+};
+
+// Per axis limits and centre from batches of reports. Values are decoded into
+// one contiguous array per axis so the reductions vectorise.
+class CalibrationTracker
+{
+public:
+    enum Phase
+    {
+        PhaseIdle,      // Samples ignored
+        PhaseCentre,    // Axes released, averaged for the centre
+        PhaseRange      // Axes moved to their limits
+    };
+
+    explicit CalibrationTracker(const HIDReportLayout &layout);
+
+    // May be called from any thread, applies from the next batch
+    void SetPhase(Phase newPhase) { phase.store(newPhase, std::memory_order_relaxed); }
+
+    // Capture thread only
+    void Add(const HIDSample *batch, size_t count);
+
+    size_t AxisCount() const { return axes.size(); }
+    uint64_t Samples() const { return samples; }
+
+    // Reports per second over the capture
+    double ReportRate() const;
+
+    // Throws unless both centre and range samples were seen
+    std::vector<AxisCalibration> Result() const;
+
+private:
+    static const size_t cBatchSize = 256;
+
+    std::vector<HIDField> axes;
+    std::atomic<Phase> phase{PhaseIdle};
+
+    // Axis major, cBatchSize values per axis
+    std::vector<int32_t> values;
+
+    std::vector<int32_t> mins;
+    std::vector<int32_t> maxs;
+    std::vector<int64_t> centreSums;
+    uint64_t centreSamples = 0;
+    uint64_t rangeSamples = 0;
+
+    uint64_t samples = 0;
+    int64_t firstTimeNs = 0;
+    int64_t lastTimeNs = 0;
+};
+
+//////////////////////////////////////////////////////////////////////
+// HIDCapture
+//////////////////////////////////////////////////////////////////////
+
+// Streams the Cougar's HID reports into tracker until stopped. The HID
+// interface must already be claimed, the joystick is invisible to other
+// applications meanwhile.
+class HIDCapture
+{
+public:
+    HIDCapture(USBDevice &dev, CalibrationTracker &tracker);
+    ~HIDCapture();
+
+    HIDCapture(const HIDCapture&) = delete;
+    HIDCapture& operator=(const HIDCapture&) = delete;
+
+    void Start();
+
+    // Throws if any report was dropped or the device went away
+    void Stop();
+
+private:
+    void Drain();
+
+    USBDevice &dev;
+    CalibrationTracker &tracker;
+
+    HIDSampleRing ring;
+    std::thread consumer;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> streamEnded{false};
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // CALIBRATION_H
@@ -0,0 +1,60 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMMANDFRAME_H
+#define COMMANDFRAME_H
+
+#include <cstddef>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////
+// CommandFrame
+//////////////////////////////////////////////////////////////////////
+
+// Single allocation holding "opcode, payload, trailer". The payload can be
+// filled in place (e.g read straight from file) and the whole frame sent
+// without shifting or copying it to prepend the opcode.
+class CommandFrame
+{
+public:
+    static const size_t cHeadroom = 1;
+
+    CommandFrame(unsigned char opcode, size_t payloadSize, size_t trailerSize = 0)
+        : buffer(cHeadroom + payloadSize + trailerSize), payloadSize(payloadSize)
+    {
+        buffer[0] = opcode;
+    }
+
+    unsigned char* Payload() { return buffer.data() + cHeadroom; }
+    const unsigned char* Payload() const { return buffer.data() + cHeadroom; }
+    size_t PayloadSize() const { return payloadSize; }
+
+    unsigned char* Trailer() { return Payload() + payloadSize; }
+
+    const unsigned char* Data() const { return buffer.data(); }
+    size_t Size() const { return buffer.size(); }
+
+private:
+    std::vector<unsigned char> buffer;
+    size_t payloadSize;
+};
+
+#endif // COMMANDFRAME_H
@@ -0,0 +1,394 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "controlserver.h"
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cougardevice.h"
+#include "trace.h"
+
+namespace CougarDevice {
+
+// Longer lines are rejected and the client dropped
+static const size_t cMaxRequestLength = 4096;
+
+static std::atomic<bool> sStopRequested{false};
+
+static void StopHandler(int)
+{
+    sStopRequested = true;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+struct Client
+{
+    int fd;
+    std::string input;
+    bool closing;
+    bool overlong;      // Sent a line over cMaxRequestLength, its requests are dropped
+};
+
+struct Request
+{
+    size_t client;
+    std::string verb;
+    std::string argument;
+    std::string reply;
+};
+
+static std::runtime_error SocketError(const std::string &what)
+{
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+static int Listen(const std::string &socketPath)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Socket path too long: " + socketPath);
+    std::strcpy(address.sun_path, socketPath.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        throw SocketError("Unable to create socket");
+
+    // Replace a socket left behind by an earlier server, but nothing else and
+    // never one another server is still accepting on
+    struct stat info;
+    if (lstat(socketPath.c_str(), &info) == 0)
+    {
+        if (! S_ISSOCK(info.st_mode))
+        {
+            close(fd);
+            throw std::runtime_error(socketPath + " exists and is not a socket");
+        }
+
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        int error = errno;
+        if (probe >= 0)
+            close(probe);
+
+        if (live || error != ECONNREFUSED)
+        {
+            close(fd);
+            throw std::runtime_error(live ? socketPath + " is in use by another server"
+                                          : socketPath + ": " + std::strerror(error));
+        }
+
+        unlink(socketPath.c_str());
+    }
+
+    // Created owner and group only, with no window where others could connect
+    mode_t mask = umask(0117);
+    bool bound = bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    umask(mask);
+
+    if (! bound || chmod(socketPath.c_str(), 0660) != 0 || listen(fd, 16) != 0)
+    {
+        auto error = SocketError("Unable to listen on " + socketPath);
+        close(fd);
+        throw error;
+    }
+
+    return fd;
+}
+
+static std::string OptionNames(CougarOptions options)
+{
+    std::string names;
+
+    if ((options & CougarOptions::UserProfile) == CougarOptions::UserProfile)
+        names += ",user";
+    if ((options & CougarOptions::ButtonAxisEmulation) == CougarOptions::ButtonAxisEmulation)
+        names += ",emulation";
+    if ((options & CougarOptions::ManualCalibration) == CougarOptions::ManualCalibration)
+        names += ",manual";
+
+    return names.empty() ? "defaults" : names.substr(1);
+}
+
+static CougarOptions ParseOptions(const std::string &argument)
+{
+    CougarOptions options = CougarOptions::Defaults;
+
+    std::istringstream words(argument);
+    std::string word;
+    while (words >> word)
+    {
+        if (word == "user")
+            options = options | CougarOptions::UserProfile;
+        else if (word == "emulation")
+            options = options | CougarOptions::ButtonAxisEmulation;
+        else if (word == "manual")
+            options = options | CougarOptions::ManualCalibration;
+        else if (word != "defaults")
+            throw std::runtime_error("Unknown option " + word);
+    }
+
+    return options;
+}
+
+static std::string RealPath(const std::string &path)
+{
+    char resolved[PATH_MAX];
+    if (! realpath(path.c_str(), resolved))
+        throw std::runtime_error("Unable to open " + path + ": " + std::strerror(errno));
+    return resolved;
+}
+
+// Resolve a tmc/tmj argument, relative to root, refusing anything outside it
+static std::string ServedFile(const std::string &root, const std::string &name)
+{
+    std::string path = RealPath(name[0] == '/' ? name : root + "/" + name);
+    if (path.compare(0, root.size() + 1, root + "/") != 0)
+        throw std::runtime_error(name + " is outside " + root);
+    return path;
+}
+
+static void OpenDevice(USBDevice &dev)
+{
+    dev.Open();
+    dev.ClaimInterface(cCougarInterfaceBulkOut);
+    dev.ClaimInterface(cCougarInterfaceBulkIn);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+// Merge every request into one transaction, commit it then answer them all
+static void RunBatch(USBDevice &dev, DeviceStateStore &store, const std::string &root, CougarState &state,
+                     std::vector<Request> &requests)
+{
+    TraceSpan span("control batch", "cougar");
+    span.Arg("requests", requests.size());
+
+    CougarTransaction transaction(&store, true);
+    std::vector<Request*> writes;
+    std::vector<Request*> reads;
+
+    for (auto &request : requests)
+    {
+        try
+        {
+            if (request.verb == "options")
+                transaction.SetOptions(ParseOptions(request.argument));
+            else if (request.verb == "tmc" && ! request.argument.empty())
+                transaction.UploadProfile(ServedFile(root, request.argument));
+            else if (request.verb == "tmj" && ! request.argument.empty())
+                transaction.UploadTMJBinary(ServedFile(root, request.argument));
+            else if (request.verb == "state")
+            {
+                reads.push_back(&request);
+                continue;
+            }
+            else
+                throw std::runtime_error("Unknown request " + request.verb);
+
+            writes.push_back(&request);
+        }
+        catch (const std::exception &e)
+        {
+            request.reply = std::string("error ") + e.what();
+        }
+    }
+
+    if (writes.empty() && reads.empty())
+        return;
+
+    try
+    {
+        if (! dev.IsOpen())
+            OpenDevice(dev);
+
+        bool written = ! writes.empty() && transaction.Commit(dev, &state);
+        for (auto request : writes)
+            request->reply = written ? "ok" : "ok unchanged";
+
+        for (auto request : reads)
+            request->reply = "ok port=" + dev.PortPath() + " options=" + OptionNames(state.Options(dev));
+    }
+    catch (const std::exception &e)
+    {
+        for (auto request : writes)
+            request->reply = std::string("error ") + e.what();
+        for (auto request : reads)
+            request->reply = std::string("error ") + e.what();
+
+        // Most likely unplugged, reopened by the next batch
+        if (dev.IsOpen())
+            dev.Close();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void RunControlServer(USBDevice &dev, const std::string &socketPath, DeviceStateStore &store,
+                      const std::string &fileDirectory)
+{
+    std::string root = RealPath(fileDirectory);
+
+    OpenDevice(dev);
+
+    int listener = Listen(socketPath);
+
+    std::signal(SIGINT, StopHandler);
+    std::signal(SIGTERM, StopHandler);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "Serving " << dev.PortPath() << " on " << socketPath << "\n" << std::flush;
+
+    // Profile snapshot shared by every batch until the device reconnects
+    CougarState state;
+    std::vector<Client> clients;
+    std::vector<pollfd> fds;
+    std::vector<Request> requests;
+    size_t served = 0;
+
+    while (! sStopRequested)
+    {
+        fds.assign(1, {listener, POLLIN, 0});
+        for (const auto &client : clients)
+            fds.push_back({client.fd, POLLIN, 0});
+
+        // Timed as the signal handler cannot wake us
+        if (poll(fds.data(), fds.size(), 200) <= 0)
+            continue;
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd;
+            while ((fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+                clients.push_back({fd, {}, false, false});
+        }
+
+        // Everything already sent by any client forms the next batch
+        for (size_t i = 1; i < fds.size(); i++)
+        {
+            if (fds[i].revents == 0)
+                continue;
+
+            Client &client = clients[i - 1];
+            char buffer[4096];
+            ssize_t received = 0;
+
+            // Lines are split off as they arrive, so input never holds more than
+            // one partial line and a client streaming without newlines is cut off
+            while (! client.overlong && (received = recv(client.fd, buffer, sizeof(buffer), 0)) > 0)
+            {
+                client.input.append(buffer, received);
+
+                size_t end;
+                while ((end = client.input.find('\n')) != std::string::npos)
+                {
+                    std::string line = client.input.substr(0, end);
+                    client.input.erase(0, end + 1);
+
+                    if (line.size() > cMaxRequestLength)
+                    {
+                        client.overlong = true;
+                        break;
+                    }
+
+                    if (! line.empty() && line.back() == '\r')
+                        line.pop_back();
+                    if (line.empty())
+                        continue;
+
+                    size_t space = line.find(' ');
+                    requests.push_back({i - 1, line.substr(0, space),
+                                        space == std::string::npos ? "" : line.substr(space + 1), {}});
+                }
+
+                if (client.input.size() > cMaxRequestLength)
+                    client.overlong = true;
+            }
+
+            if (client.overlong || received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                client.closing = true;
+
+            // Nothing from a misbehaving client reaches the device
+            if (client.overlong)
+            {
+                for (size_t r = requests.size(); r-- > 0; )
+                    if (requests[r].client == i - 1)
+                        requests.erase(requests.begin() + r);
+
+                static const char cTooLong[] = "error request too long\n";
+                send(client.fd, cTooLong, sizeof(cTooLong) - 1, MSG_NOSIGNAL);
+            }
+        }
+
+        if (! requests.empty())
+        {
+            RunBatch(dev, store, root, state, requests);
+
+            // Replies are a single short line, never expected to block
+            for (const auto &request : requests)
+            {
+                std::string reply = request.reply + "\n";
+                if (send(clients[request.client].fd, reply.data(), reply.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(reply.size()))
+                    clients[request.client].closing = true;
+            }
+
+            served += requests.size();
+            requests.clear();
+        }
+
+        for (size_t i = clients.size(); i-- > 0; )
+        {
+            if (clients[i].closing)
+            {
+                close(clients[i].fd);
+                clients.erase(clients.begin() + i);
+            }
+        }
+    }
+
+    for (const auto &client : clients)
+        close(client.fd);
+    close(listener);
+    unlink(socketPath.c_str());
+
+    std::cout << "Served " << served << " request(s)\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,60 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONTROLSERVER_H
+#define CONTROLSERVER_H
+
+#include <string>
+
+#include "statestore.h"
+#include "usbdevice.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// Control Server
+//////////////////////////////////////////////////////////////////////
+
+// Keep dev open with its bulk interfaces claimed and serve requests on a
+// Unix domain socket at socketPath until SIGINT/SIGTERM. Each request is a
+// line of text answered by one line, "ok ..." or "error <reason>":
+//
+//   options [user] [emulation] [manual]   Set the Cougar options, none for defaults
+//   tmc FILE                              Upload a TMC profile from fileDirectory
+//   tmj FILE                              Upload a TMJ binary from fileDirectory
+//   state                                 Report the port and current options
+//
+// Every request that is waiting when the device becomes free is merged into
+// a single CougarTransaction, later requests of the same kind replacing
+// earlier ones. Unchanged options and TMJ binaries recorded in store are not
+// rewritten. If the Cougar is unplugged it is reopened on the next request.
+//
+// FILE is relative to fileDirectory, and an absolute FILE or one reached
+// through a symlink must still resolve inside it. The socket is created mode
+// 0660, and one another server is still accepting on is never replaced.
+void RunControlServer(USBDevice &dev, const std::string &socketPath, DeviceStateStore &store,
+                      const std::string &fileDirectory);
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // CONTROLSERVER_H
@@ -0,0 +1,129 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+libcougar C API. Configures a Cougar from within a host application's own
+event loop: nothing blocks on the device and no threads are started. Add the
+descriptors from cougar_get_pollfds to the host's poll/epoll set and call
+cougar_handle_events whenever one is ready or cougar_next_timeout expires.
+
+Opening a device and loading staged files are ordinary, short syscalls.
+Functions are not thread safe, use a context from a single thread.
+*/
+
+#ifndef COUGAR_H
+#define COUGAR_H
+
+#include <poll.h>
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#define COUGAR_API __attribute__((visibility("default")))
+#else
+#define COUGAR_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Incremented only by incompatible changes */
+#define COUGAR_API_VERSION 1
+
+typedef struct cougar_context cougar_context;
+typedef struct cougar_device cougar_device;
+
+/* Return codes */
+enum
+{
+    COUGAR_OK      = 0,
+    COUGAR_PENDING = 1,     /* Commit in progress */
+    COUGAR_ERROR   = -1,    /* See cougar_error / cougar_device_error */
+    COUGAR_BUSY    = -2     /* A commit is already in progress */
+};
+
+/* cougar_stage_options flags */
+enum
+{
+    COUGAR_OPTION_USER_PROFILE          = 1,
+    COUGAR_OPTION_BUTTON_AXIS_EMULATION = 2,
+    COUGAR_OPTION_MANUAL_CALIBRATION    = 4
+};
+
+typedef void (*cougar_pollfd_added_cb)(int fd, short events, void *user_data);
+typedef void (*cougar_pollfd_removed_cb)(int fd, void *user_data);
+
+/* status is COUGAR_OK or COUGAR_ERROR. written is non-zero if the device was changed. */
+typedef void (*cougar_commit_cb)(cougar_device *device, int status, int written, void *user_data);
+
+COUGAR_API int cougar_api_version(void);
+
+/* Context, NULL on failure */
+COUGAR_API cougar_context* cougar_context_new(void);
+COUGAR_API void cougar_context_free(cougar_context *ctx);
+
+/* Reason for the most recent failure on the context, e.g of cougar_device_open */
+COUGAR_API const char* cougar_error(const cougar_context *ctx);
+
+/* Fills up to max_fds entries, returning the total number of descriptors or
+   COUGAR_ERROR. The set may change, register notifiers to track it. */
+COUGAR_API int cougar_get_pollfds(cougar_context *ctx, struct pollfd *fds, size_t max_fds);
+COUGAR_API void cougar_set_pollfd_notifiers(cougar_context *ctx, cougar_pollfd_added_cb added,
+                                            cougar_pollfd_removed_cb removed, void *user_data);
+
+/* Milliseconds until cougar_handle_events must be called even without fd
+   activity, -1 if not needed */
+COUGAR_API int cougar_next_timeout(cougar_context *ctx);
+
+/* Never blocks. Completes transfers and advances commits, invoking their callbacks. */
+COUGAR_API int cougar_handle_events(cougar_context *ctx);
+
+/* Opens and claims a Cougar. device is NULL for the first found, otherwise
+   "bus:address", a /dev/bus/usb node or a /sys/bus/usb/devices directory.
+   NULL on failure. */
+COUGAR_API cougar_device* cougar_device_open(cougar_context *ctx, const char *device);
+
+/* Abandons any commit in progress without calling its callback. Safe from within one. */
+COUGAR_API void cougar_device_close(cougar_device *dev);
+
+/* Physical port, "bus-port.port..." */
+COUGAR_API const char* cougar_device_port(const cougar_device *dev);
+COUGAR_API const char* cougar_device_error(const cougar_device *dev);
+
+/* Changes applied together by the next commit. Files are loaded and validated immediately. */
+COUGAR_API int cougar_stage_profile(cougar_device *dev, const char *tmc_filename);
+COUGAR_API int cougar_stage_tmj(cougar_device *dev, const char *tmj_filename);
+COUGAR_API int cougar_stage_options(cougar_device *dev, unsigned int options);
+
+/* Starts applying the staged changes, returning COUGAR_PENDING or, should
+   nothing need the device, the result with the callback already invoked.
+   After a failed commit the device is reopened by cougar_handle_events, a
+   failure to reopen being reported through the callback. callback may be NULL. */
+COUGAR_API int cougar_commit(cougar_device *dev, cougar_commit_cb callback, void *user_data);
+
+/* COUGAR_PENDING while committing, else the result of the last commit */
+COUGAR_API int cougar_commit_status(const cougar_device *dev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COUGAR_H */
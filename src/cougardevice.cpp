@@ -20,47 +20,64 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <deque>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <type_traits>
 
-#include <crypto++/sha.h>
-
+#include "commandframe.h"
 #include "cougardevice.h"
+#include "firmware.h"
+#include "mappedfile.h"
+#include "profilelibrary.h"
+#include "statestore.h"
+#include "tmcview.h"
+#include "trace.h"
 #include "usbdevice.h"
 
 namespace CougarDevice {
 
+// Firmware is streamed in chunks of whole packets, several in flight at once
+static const size_t cFirmwarePacketsPerChunk = 16;
+static const size_t cFirmwareChunksInFlight = 4;
 
-// Firmware extraction supports only one version currently
-static const size_t cHOTASUpdateFirmwareSizeBytes = 25030;
-unsigned char cHOTASUpdateFirmwareDigest[CryptoPP::SHA::DIGESTSIZE] = {
-    0x79,0x38,0x9f,0x7f,0xfb,0x27,0x65,0xa4,0x5a,0x7a,0xb2,0xf1,0x21,0x97,0x81,0x47,0xd4,0xc2,0xe5,0xb0
-};
+// A chunk not accepted within this time means the device has stopped taking data
+static const std::chrono::milliseconds cFirmwareChunkTimeout(2000);
 
 // TCM Profiles
-static const size_t cTMCFileSizeBytes = 171;
-
 static const std::vector<unsigned char> cDefaultTCMProfile = {
     0x02,0x00,0x01,0x08,0x09,0x02,0x03,0x04,0x05,0x06,0x07,0x00,0x00,0x9e,0x38,0x90,0x46,0x90,0x80,0x77,0x80,0x81,0x10,0x88,0x00,0x88,0x80,0x00,0x00,0x00,0x00,0x00,0x00,0x17,0x9d,0x10,0x19,0x14,0x78,0x15,0x8e,0x25,0x76,0x31,0x74,0x29,0x26,0x24,0xbe,0x16,0xca,0x16,0xcb,0x19,0xca,0x10,0x3e,0x19,0xf2,0x10,0x2e,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x06,0x00,0x08,0x00,0x08,0x00,0x10,0xcc,0x10,0xcc,0x00,0x00,0x08,0x00,0x08,0x00,0x08,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xef,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x03,0xff,0xff,0xff,0xff,0xff,0xff,0x00
 };
 
 // TMJ Binaries
-static const size_t cTMJBINFileSizeBytes = 1425;
 static std::vector<unsigned char> cTCMBINFileMagic = {0x02, 0xff};
 
-// Profile data indexes (returned by 04 01)
-static const int cProfileDataWindowsAxisIDX = 168;
-static const int cProfileDataOptionsIDX = 0;
+//////////////////////////////////////////////////////////////////////
+// Commands
+//////////////////////////////////////////////////////////////////////
+
+// No-op when empty
+void CommandBatch::Send(USBDevice &dev)
+{
+    if (count == 0)
+        return;
+
+    dev.PipelineWriteBulkEP(buffers, count, cCougarEndpointBulkOut);
+    count = 0;
+}
 
 //////////////////////////////////////////////////////////////////////
 // File I/O
 //////////////////////////////////////////////////////////////////////
 
-// Pass requiredSize > 0 to throw if file is not of expected size
-std::vector<unsigned char> LoadBinaryFile(const std::string& filename, size_t requiredSize = 0)
+// Pass requiredSize > 0 to throw if file is not of expected size. Returns file size.
+static size_t OpenBinaryFile(std::ifstream &file, const std::string& filename, size_t requiredSize)
 {
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    file.open(filename, std::ios::binary | std::ios::ate);
     if (! file.is_open())
         throw std::runtime_error("Unable to open file " + filename);
 
@@ -75,81 +92,224 @@ std::vector<unsigned char> LoadBinaryFile(const std::string& filename, size_t re
         throw std::runtime_error("Loaded file is " + std::to_string(file_size) + " bytes." +
                                  "Required " + std::to_string(requiredSize) + " bytes.");
 
-    // Read in the entire file
-    std::vector<unsigned char> newData;
-    newData.resize(file_size);
+    return file_size;
+}
 
+static void ReadBinaryFile(std::ifstream &file, const std::string& filename, unsigned char *data, size_t size)
+{
     file.seekg(0, std::ios::beg);
-    file.read(reinterpret_cast<char *>(newData.data()), newData.size());
+    file.read(reinterpret_cast<char *>(data), size);
 
     if (! file.good())
         throw std::runtime_error("Unable to read file data from " + filename);
+}
+
+// Pass requiredSize > 0 to throw if file is not of expected size
+std::vector<unsigned char> LoadBinaryFile(const std::string& filename, size_t requiredSize = 0)
+{
+    TraceSpan span("LoadBinaryFile", "file");
+    span.Arg("file", filename);
+
+    std::ifstream file;
+    size_t file_size = OpenBinaryFile(file, filename, requiredSize);
+
+    // Read in the entire file
+    std::vector<unsigned char> newData(file_size);
+    ReadBinaryFile(file, filename, newData.data(), newData.size());
 
     return newData;
 }
 
+// As LoadBinaryFile, reading directly into the payload of a frame for opcode
+CommandFrame LoadBinaryFrame(const std::string& filename, unsigned char opcode, size_t requiredSize = 0)
+{
+    TraceSpan span("LoadBinaryFile", "file");
+    span.Arg("file", filename);
+
+    std::ifstream file;
+    size_t file_size = OpenBinaryFile(file, filename, requiredSize);
+
+    CommandFrame frame(opcode, file_size);
+    ReadBinaryFile(file, filename, frame.Payload(), frame.PayloadSize());
+
+    return frame;
+}
+
 //////////////////////////////////////////////////////////////////////
 // Cougar Helpers
 //////////////////////////////////////////////////////////////////////
 
+const std::vector<unsigned char>& DefaultProfileData()
+{
+    return cDefaultTCMProfile;
+}
+
+TransferPolicy CougarTransferPolicy()
+{
+    TransferPolicy policy;
+
+    // Uploads (01 TMJ, 02 TMC) are written to flash before being accepted,
+    // everything else is acknowledged within a few frames
+    policy.writeTimeout = [](unsigned char opcode, size_t size)
+    {
+        switch (static_cast<Opcode>(opcode))
+        {
+            case Opcode::UploadTMJ:
+            case Opcode::UploadProfile:
+                return TransferPolicy::Timeout(2000 + size / 16);
+            case Opcode::UploadFirmware:
+                return cFirmwareChunkTimeout;
+            default:
+                return TransferPolicy::Timeout(500);
+        }
+    };
+    policy.readTimeout = TransferPolicy::Timeout(1000);
+
+    return policy;
+}
+
 void WaitResetDevice(USBDevice &dev)
 {
-    // Reset device
-    dev.WriteBulkEP({9,5}, cCougarEndpointBulkOut);
+    SendCommand(dev, cResetCommand);
 
     // Blocking call, may take several seconds
     dev.Reconnect(); 
 }
 
-void UploadProfileData(USBDevice &dev, const std::vector<unsigned char> &data)
+static ProfileData ReadProfileData(USBDevice &dev)
 {
-    // Read current profile data to determine current options setting
-    dev.WriteBulkEP({4,1}, cCougarEndpointBulkOut);
-    auto old_data = dev.ReadBulkEP(256, cCougarEndpointBulkIn);
+    TraceSpan span("ReadProfileData", "cougar");
+
+    ProfileData data;
+    size_t read = TransactCommand(dev, cReadProfileCommand, data);
+
+    if (read < cTmcSizeBytes)
+        throw std::runtime_error("Profile data read returned only " + std::to_string(read) + " bytes");
+
+    return data;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CougarState
+//////////////////////////////////////////////////////////////////////
+
+const ProfileData& CougarState::Profile(USBDevice &dev)
+{
+    if (! Valid(dev))
+    {
+        profile = ReadProfileData(dev);
+        valid = true;
+        connection = dev.Connection();
+    }
+
+    return profile;
+}
+
+void CougarState::Update(const USBDevice &dev, const unsigned char *data, size_t size)
+{
+    if (size < cTmcSizeBytes)
+        throw std::runtime_error("Profile data read returned only " + std::to_string(size) + " bytes");
+
+    size = std::min(size, profile.size());
+    std::copy(data, data + size, profile.begin());
+    std::fill(profile.begin() + size, profile.end(), 0);
+
+    valid = true;
+    connection = dev.Connection();
+}
+
+void CougarState::ProfileWritten(const unsigned char *data, size_t size)
+{
+    // Byte 0 holds the options rather than the upload opcode
+    size = std::min(size, cTmcSizeBytes);
+    std::copy(data + 1, data + size, profile.begin() + 1);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+std::string ProfileIdentity(const unsigned char *data, size_t size)
+{
+    // Byte 0 holds the options, or the upload opcode, and changes without the device changing
+    size = std::min(size, cTmcSizeBytes);
+    return size > 1 ? ContentHash(data + 1, size - 1).substr(0, 16) : std::string();
+}
+
+// Should any region not round trip exactly the profile is simply re-uploaded
+static bool ProfileMatches(const std::vector<unsigned char> &data, const ProfileData &old_data)
+{
+    return DiffTmc(TmcView(data), TmcView(old_data.data(), old_data.size())).empty();
+}
+
+// Returns true if the device was reset, restoring its default options
+static bool WriteProfileData(USBDevice &dev, const unsigned char *data, size_t size, CougarState &state)
+{
+    unsigned char old_flag = TmcView(state.Profile(dev).data(), cProfileDataSizeBytes).WindowsAxisFlag();
 
     // Upload to Cougar
-    dev.WriteBulkEP(data, cCougarEndpointBulkOut);
+    dev.WriteBulkEP(data, size, cCougarEndpointBulkOut);
+    state.ProfileWritten(data, size);
 
     // Has "Window axis" flag changed in new profile? Device reconnect required to apply.
-    if (old_data.at(cProfileDataWindowsAxisIDX) != data.at(cProfileDataWindowsAxisIDX))
-        WaitResetDevice(dev);
+    if (old_flag == TmcView(data, size).WindowsAxisFlag())
+        return false;
+
+    WaitResetDevice(dev);
+
+    return true;
 }
 
-void UploadProfile(USBDevice &dev, const std::string& filename)
+std::vector<unsigned char> LoadTmcFile(const std::string& filename)
+{
+    auto data = LoadBinaryFile(filename, cTmcSizeBytes);
+    TmcView(data).Validate();
+
+    return data;
+}
+
+void UploadProfileData(USBDevice &dev, const std::vector<unsigned char> &data, CougarState *state = nullptr)
+{
+    CougarState local;
+    WriteProfileData(dev, data.data(), data.size(), state ? *state : local);
+}
+
+void UploadProfile(USBDevice &dev, const std::string& filename, CougarState *state)
 {   
-    auto new_data = LoadBinaryFile(filename, cTMCFileSizeBytes);
+    auto new_data = LoadTmcFile(filename);
 
-    UploadProfileData(dev, new_data);
+    UploadProfileData(dev, new_data, state);
 }
 
-void UploadTMJBinary(USBDevice &dev, const std::string& filename)
+bool UploadProfileIfChanged(USBDevice &dev, const std::string& filename, DeviceStateStore &store, CougarState *state)
 {
-    // Read current profile data to determine if the "Windows Axis" state has changed
-    dev.WriteBulkEP({4,1}, cCougarEndpointBulkOut);
-    auto oldData = dev.ReadBulkEP(256, cCougarEndpointBulkIn);
-    
-    // Cache users current options and reset to defaults
-    CougarOptions oldOptions = static_cast<CougarOptions>(oldData.at(cProfileDataOptionsIDX));
-    SetCougarOptions(dev, CougarOptions::Defaults);
+    CougarState local;
+    CougarState &session = state ? *state : local;
 
-    auto newData = LoadBinaryFile(filename);
-    
-    // File size is variable for TJM BIN. Using "02 ff" magic for sanity instead.
-    // How stable this is as a magic remains to be seen.
-    if ( newData.size() < cTCMBINFileMagic.size() || 
-         ! std::equal(newData.end() - cTCMBINFileMagic.size(), newData.end(), cTCMBINFileMagic.begin()))
-        throw std::runtime_error("Loaded binary file does not appear to be a compiled tjm. Expected file ending in 02ff0a");
+    auto new_data = LoadTmcFile(filename);
 
-    // Upload to Cougar. Unlike tcm, cmd is not present in the file and needs sending as first byte of
-    // TJM data. This cannot be sent as a command on its own.
-    newData.insert(newData.begin(), 1);
-    dev.WriteBulkEP(newData, cCougarEndpointBulkOut);
+    // Recorded either way so --switch knows what is in flash
+    auto hash = ContentHash(new_data.data(), new_data.size());
+    auto identity = ProfileIdentity(new_data.data(), new_data.size());
 
-    // Restore options
-    SetCougarOptions(dev, oldOptions);
+    const auto &old_data = session.Profile(dev);
+    if (ProfileMatches(new_data, old_data))
+    {
+        store.Set(dev.PortPath(), "tmc", hash, identity);
+        return false;
+    }
+
+    // Forgotten first, a failed write leaves the flash contents unknown
+    auto old_identity = ProfileIdentity(old_data.data(), old_data.size());
+    store.Clear(dev.PortPath(), "tmc");
+    WriteProfileData(dev, new_data.data(), new_data.size(), session);
+
+    store.Reidentify(dev.PortPath(), old_identity, identity);
+    store.Set(dev.PortPath(), "tmc", hash, identity);
+
+    return true;
 }
 
-void SetCougarOptions(USBDevice &dev, CougarOptions options)
+// Add the 07/03 option writes to batch
+static void AddCougarOptions(CommandBatch &batch, CougarOptions options)
 {
     static_assert(std::is_same<std::underlying_type<CougarOptions>::type, unsigned char>::value && "CougarOptions type mismatch");
     
@@ -157,36 +317,550 @@ void SetCougarOptions(USBDevice &dev, CougarOptions options)
     // to always send an extra 07 anytime emulation is not active. Not sure
     // why, but replicated anyway.
     if ( (options & CougarOptions::ButtonAxisEmulation) != CougarOptions::ButtonAxisEmulation )
-        dev.WriteBulkEP({7}, cCougarEndpointBulkOut);
+        batch.Add(cEmulationOffCommand);
 
     unsigned char options_bm = static_cast<unsigned char>(options);
-    dev.WriteBulkEP({3, options_bm}, cCougarEndpointBulkOut);    
+    if (options_bm >= cSetOptionsCommands.size())
+        throw std::runtime_error("Unsupported Cougar options " + std::to_string(options_bm));
+
+    batch.Add(cSetOptionsCommands[options_bm]);
 }
 
-void UploadFirmware(USBDevice &dev, const std::string& filename)
+// Unlike tcm, cmd is not present in the file and needs sending as first byte of
+// TJM data. This cannot be sent as a command on its own.
+CommandFrame LoadTMJBinary(const std::string& filename)
 {
-    std::ifstream file(filename, std::ios::binary);
-    if (! file.is_open())
-        throw std::runtime_error("Unable to open file " + filename);
-    file.seekg( -cHOTASUpdateFirmwareSizeBytes, file.end );
+    auto frame = LoadBinaryFrame(filename, static_cast<unsigned char>(Opcode::UploadTMJ));
+    auto data_end = frame.Payload() + frame.PayloadSize();
     
-    // "0x05" firmware update command followed by firmware itself and "0xff"
-    std::vector<unsigned char> firmware{5};
-    firmware.reserve(cHOTASUpdateFirmwareSizeBytes+2);
-    firmware.resize(cHOTASUpdateFirmwareSizeBytes+1);
-    file.read(reinterpret_cast<char *>(firmware.data()+1), cHOTASUpdateFirmwareSizeBytes);
-    firmware.emplace_back(0xff);
+    // File size is variable for TJM BIN. Using "02 ff" magic for sanity instead.
+    // How stable this is as a magic remains to be seen.
+    if ( frame.PayloadSize() < cTCMBINFileMagic.size() || 
+         ! std::equal(data_end - cTCMBINFileMagic.size(), data_end, cTCMBINFileMagic.begin()))
+        throw std::runtime_error("Loaded binary file does not appear to be a compiled tjm. Expected file ending in 02ff0a");
 
-    if (! file.good())
-        throw std::runtime_error("Unable to extract firmware data from " + filename);
+    return frame;
+}
+
+// Frame is the 01 opcode followed by the TMJ binary
+static void WriteTMJBinary(USBDevice &dev, const unsigned char *frame, size_t size, CougarOptions oldOptions)
+{
+    // Writes are order dependent but need not wait on each other, the
+    // endpoint completes them in submission order.
+    CommandBatch batch;
+    AddCougarOptions(batch, CougarOptions::Defaults);
+
+    // Upload to Cougar
+    batch.Add(frame, size);
+
+    // Restore options
+    AddCougarOptions(batch, oldOptions);
+
+    batch.Send(dev);
+}
+
+void UploadTMJBinary(USBDevice &dev, const std::string& filename, CougarState *state)
+{
+    CougarState local;
+    CougarState &session = state ? *state : local;
+
+    // Validated before anything is sent, a bad file must not leave a read in flight
+    auto frame = LoadTMJBinary(filename);
+
+    // Cache users current options, reset to defaults for the upload
+    WriteTMJBinary(dev, frame.Data(), frame.Size(), session.Options(dev));
+}
+
+bool UploadTMJBinaryIfChanged(USBDevice &dev, const std::string& filename, DeviceStateStore &store, CougarState *state)
+{
+    auto frame = LoadTMJBinary(filename);
+
+    CougarState local;
+    CougarState &session = state ? *state : local;
+
+    // TMJ cannot be read back, rely on the hash recorded when last flashed to this device
+    const auto &old_data = session.Profile(dev);
+    auto identity = ProfileIdentity(old_data.data(), old_data.size());
+    auto hash = ContentHash(frame.Payload(), frame.PayloadSize());
+    if (store.Get(dev.PortPath(), "tmj", identity) == hash)
+        return false;
+
+    store.Clear(dev.PortPath(), "tmj");
+    WriteTMJBinary(dev, frame.Data(), frame.Size(), session.Options(dev));
 
-    // Verify hash of extracted firmware matches tested version
-    if (! CryptoPP::SHA().VerifyDigest(cHOTASUpdateFirmwareDigest, firmware.data()+1, cHOTASUpdateFirmwareSizeBytes))
-        throw std::runtime_error("Firmware hash mismatch. Aborting firmware upload.");
+    store.Set(dev.PortPath(), "tmj", hash, identity);
 
-    dev.WriteBulkEP(firmware, cCougarEndpointBulkOut);
+    return true;
+}
+
+bool SwitchProfile(USBDevice &dev, const ProfileLibrary &library, const std::string& name, DeviceStateStore &store,
+                   CougarState *state)
+{
+    TraceSpan span("SwitchProfile", "cougar");
+    span.Arg("name", name);
+
+    const auto &entry = library.Find(name);
+    const auto &device = dev.PortPath();
+
+    // Single readback for the TMC comparison, current Windows axis flag and options
+    CougarState local;
+    CougarState &session = state ? *state : local;
+
+    // The store may be stale (e.g flashed from another host), so the TMC is always
+    // confirmed against the device. TMJ cannot be read back, the store is all we have.
+    const auto &old_data = session.Profile(dev);
+    auto identity = ProfileIdentity(old_data.data(), old_data.size());
+
+    std::unique_ptr<MappedFile> tmc;
+    bool write_tmc = false;
+    if (! entry.tmc.empty())
+    {
+        tmc.reset(new MappedFile(library.BlobFilename(entry.tmc)));
+        TmcView view(tmc->Data(), tmc->Size());
+        view.Validate();
+
+        write_tmc = ! DiffTmc(view, TmcView(old_data.data(), old_data.size())).empty();
+    }
+
+    bool write_tmj = ! entry.tmj.empty() && store.Get(device, "tmj", identity) != entry.tmj;
+
+    if (write_tmc)
+    {
+        // Forgotten first, a failed write leaves the flash contents unknown
+        store.Clear(device, "tmc");
+        WriteProfileData(dev, tmc->Data(), tmc->Size(), session);
+
+        auto new_identity = ProfileIdentity(tmc->Data(), tmc->Size());
+        store.Reidentify(device, identity, new_identity);
+        identity = new_identity;
+    }
+
+    if (tmc)
+        store.Set(device, "tmc", entry.tmc, identity);
+
+    if (write_tmj)
+    {
+        MappedFile tmj(library.BlobFilename(entry.tmj));
+
+        store.Clear(device, "tmj");
+        WriteTMJBinary(dev, tmj.Data(), tmj.Size(), session.Options(dev));
+
+        store.Set(device, "tmj", entry.tmj, identity);
+    }
+
+    return write_tmc || write_tmj;
+}
+
+void SetCougarOptions(USBDevice &dev, CougarOptions options, CougarState *state)
+{
+    CommandBatch batch;
+    AddCougarOptions(batch, options);
+    batch.Send(dev);
+
+    if (state)
+        state->OptionsWritten(options);
+}
+
+bool SetCougarOptionsIfChanged(USBDevice &dev, CougarOptions options, CougarState *state)
+{
+    CougarState local;
+    CougarState &session = state ? *state : local;
+
+    if (session.Options(dev) == options)
+        return false;
+
+    SetCougarOptions(dev, options, &session);
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CougarTransaction
+//////////////////////////////////////////////////////////////////////
+
+CougarTransaction::CougarTransaction(DeviceStateStore *store, bool skipUnchanged)
+    : store(store), skipUnchanged(skipUnchanged)
+{
+    if (skipUnchanged && ! store)
+        throw std::invalid_argument("Skipping unchanged uploads requires a state store");
+}
+
+void CougarTransaction::UploadProfile(const std::string& filename)
+{
+    profile = LoadTmcFile(filename);
+    profileHash = ContentHash(profile.data(), profile.size());
+}
+
+void CougarTransaction::UploadTMJBinary(const std::string& filename)
+{
+    tmj.reset(new CommandFrame(LoadTMJBinary(filename)));
+    tmjHash = ContentHash(tmj->Payload(), tmj->PayloadSize());
+}
+
+void CougarTransaction::SetOptions(CougarOptions newOptions)
+{
+    options = newOptions;
+    hasOptions = true;
+}
+
+bool CougarTransaction::NeedsProfile() const
+{
+    // A single read serves the Windows axis comparison, the device identity
+    // TMJ uploads are recorded under, the options a TMJ upload must restore
+    // and skipping unchanged options
+    return ! profile.empty() || (tmj && (store || ! hasOptions)) || (skipUnchanged && hasOptions);
+}
+
+bool CougarTransaction::WritesTMJ(const std::string &device, const std::string &identity) const
+{
+    // TMJ cannot be read back, rely on the hash recorded when last flashed to this device
+    return tmj && (! skipUnchanged || store->Get(device, "tmj", identity) != tmjHash);
+}
+
+CommitPlan CougarTransaction::Plan(const std::string &device, const ProfileData &oldData) const
+{
+    CommitPlan plan;
+
+    bool read = NeedsProfile();
+    plan.identity = read ? ProfileIdentity(oldData.data(), oldData.size()) : std::string();
+    plan.writeTmj = WritesTMJ(device, plan.identity);
+    plan.writeProfile = ! profile.empty();
+
+    if (plan.writeProfile && skipUnchanged && ProfileMatches(profile, oldData))
+    {
+        plan.writeProfile = false;
+        plan.profileMatched = true;
+    }
+
+    TmcView old_view(oldData.data(), oldData.size());
+    plan.reset = plan.writeProfile && old_view.WindowsAxisFlag() != TmcView(profile).WindowsAxisFlag();
+
+    // Device options as they will be once uploads (and any reset) complete
+    CougarOptions current = old_view.Options();
+    plan.options = hasOptions ? options : current;
+
+    if (plan.writeProfile)
+        plan.writes.Add(profile.data(), profile.size());
+
+    if (plan.writeTmj)
+    {
+        AddCougarOptions(plan.writes, CougarOptions::Defaults);
+        plan.writes.Add(tmj->Data(), tmj->Size());
+        current = CougarOptions::Defaults;
+    }
+
+    // Options do not survive a reset, so are only written once it completes
+    if (plan.reset)
+        current = CougarOptions::Defaults;
+
+    plan.writeOptions = hasOptions ? (! skipUnchanged || current != plan.options)
+                                   : (read && current != plan.options);
+    if (plan.writeOptions)
+        AddCougarOptions(plan.reset ? plan.afterReset : plan.writes, plan.options);
+
+    return plan;
+}
+
+void CougarTransaction::Begin(const CommitPlan &plan, const std::string &device) const
+{
+    // Forgotten until Finish, a failed or partial write leaves the flash contents unknown
+    if (plan.writeProfile && store)
+        store->Clear(device, "tmc");
+    if (plan.writeTmj && store)
+        store->Clear(device, "tmj");
+}
+
+void CougarTransaction::Finish(const CommitPlan &plan, const std::string &device, CougarState &session) const
+{
+    if (plan.writeProfile)
+        session.ProfileWritten(profile.data(), profile.size());
+
+    // Snapshot is already stale after a reset
+    if (plan.writeOptions || plan.writeTmj)
+        session.OptionsWritten(plan.options);
+
+    if (! store)
+        return;
+
+    // A TMJ already in flash survives the new profile
+    std::string identity = plan.identity;
+    if (plan.writeProfile)
+    {
+        identity = ProfileIdentity(profile.data(), profile.size());
+        store->Reidentify(device, plan.identity, identity);
+    }
+
+    if (plan.writeProfile || plan.profileMatched)
+        store->Set(device, "tmc", profileHash, identity);
+    if (plan.writeTmj)
+        store->Set(device, "tmj", tmjHash, identity);
+}
+
+bool CougarTransaction::Commit(USBDevice &dev, CougarState *state) const
+{
+    TraceSpan span("CougarTransaction::Commit", "cougar");
+
+    CougarState local;
+    CougarState &session = state ? *state : local;
+
+    const auto &device = dev.PortPath();
+
+    ProfileData old_data{};
+    if (NeedsProfile())
+        old_data = session.Profile(dev);
+
+    CommitPlan plan = Plan(device, old_data);
+    Begin(plan, device);
+
+    plan.writes.Send(dev);
+
+    if (plan.reset)
+    {
+        WaitResetDevice(dev);
+        plan.afterReset.Send(dev);
+    }
+
+    Finish(plan, device, session);
+
+    return plan.Written();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+AsyncCommit::AsyncCommit(USBDevice &dev, const CougarTransaction &transaction, CougarState &state,
+                         std::chrono::milliseconds reconnectTimeout)
+    : dev(dev), transaction(transaction), state(state), reconnectTimeout(reconnectTimeout)
+{
+}
+
+bool AsyncCommit::Poll()
+{
+    const auto &device = dev.PortPath();
+
+    while (Completed())
+    {
+        switch (step)
+        {
+        case Step::Open:
+            if (! dev.IsOpen())
+            {
+                dev.Open();
+                dev.ClaimInterface(cCougarInterfaceBulkOut);
+                dev.ClaimInterface(cCougarInterfaceBulkIn);
+            }
+            step = Step::ReadProfile;
+            break;
+
+        case Step::ReadProfile:
+            if (transaction.NeedsProfile() && ! state.Valid(dev))
+            {
+                pending.push_back(SubmitCommand(dev, cReadProfileCommand));
+                read = dev.SubmitReadBulkEP(readback.data(), readback.size(), cCougarEndpointBulkIn);
+            }
+            step = Step::Plan;
+            break;
+
+        case Step::Plan:
+        {
+            if (read.valid())
+                state.Update(dev, readback.data(), read.get());
+
+            ProfileData old_data{};
+            if (transaction.NeedsProfile())
+                old_data = state.Profile(dev);
+
+            plan = transaction.Plan(device, old_data);
+            transaction.Begin(plan, device);
+            Submit(plan.writes);
+
+            step = plan.reset ? Step::Reset : Step::Finish;
+            break;
+        }
+
+        case Step::Reset:
+            pending.push_back(SubmitCommand(dev, cResetCommand));
+
+            reconnectDeadline = std::chrono::steady_clock::now() + reconnectTimeout;
+            step = Step::Reconnect;
+            break;
+
+        case Step::Reconnect:
+            if (! dev.TryReconnect())
+            {
+                if (std::chrono::steady_clock::now() >= reconnectDeadline)
+                    throw std::runtime_error("Device did not reconnect on " + device + " within " +
+                                             std::to_string(reconnectTimeout.count()) + " ms");
+                return false;
+            }
+
+            Submit(plan.afterReset);
+            step = Step::Finish;
+            break;
+
+        case Step::Finish:
+            transaction.Finish(plan, device, state);
+            step = Step::Done;
+            break;
+
+        case Step::Done:
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void AsyncCommit::Submit(const CommandBatch &batch)
+{
+    // Queued on one endpoint, so sent in order as a pipelined write would be
+    for (size_t i = 0; i < batch.Count(); i++)
+    {
+        const auto &buffer = batch.Buffers()[i];
+        pending.push_back(dev.SubmitWriteBulkEP(buffer.data, buffer.size, cCougarEndpointBulkOut,
+                                                dev.Policy().writeTimeout(buffer.data[0], buffer.size)));
+    }
+}
+
+bool AsyncCommit::Completed()
+{
+    auto ready = [](const std::future<size_t> &transfer)
+    {
+        return transfer.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    };
+
+    if (read.valid() && ! ready(read))
+        return false;
+
+    for (const auto &transfer : pending)
+        if (! ready(transfer))
+            return false;
+
+    for (auto &transfer : pending)
+        transfer.get();
+    pending.clear();
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+// "0x05" firmware update command followed by firmware itself and "0xff". Split into
+// chunks of whole packets so the device sees the same packet stream as a single
+// transfer. Only the first and last chunks are copied, the rest are sent directly
+// from the image.
+static std::vector<USBDevice::ConstBuffer> ChunkFirmwareImage(const FirmwareImage &image, size_t packetSize,
+                                                              std::vector<unsigned char> &head,
+                                                              std::vector<unsigned char> &tail)
+{
+    size_t chunk_size = packetSize * cFirmwarePacketsPerChunk;
+    if (image.size < chunk_size)
+        throw std::runtime_error("Firmware image too small");
+
+    head.resize(chunk_size);
+    head[0] = static_cast<unsigned char>(Opcode::UploadFirmware);
+    std::copy(image.data, image.data + chunk_size - 1, head.begin() + 1);
+
+    std::vector<USBDevice::ConstBuffer> chunks;
+    chunks.push_back({head.data(), head.size()});
+
+    const unsigned char *body = image.data + chunk_size - 1;
+    size_t remaining = image.size - (chunk_size - 1);
+    size_t body_size = remaining - remaining % packetSize;
+
+    for (size_t offset = 0; offset < body_size; offset += chunk_size)
+        chunks.push_back({body + offset, std::min(chunk_size, body_size - offset)});
+
+    tail.assign(body + body_size, body + remaining);
+    tail.push_back(cFirmwareTrailer);
+    chunks.push_back({tail.data(), tail.size()});
+
+    return chunks;
+}
+
+static void StreamFirmwareImage(USBDevice &dev, const FirmwareImage &image, const ProgressCallback &progress)
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Chunk
+    {
+        std::future<size_t> written;
+        size_t offset;
+        size_t size;
+        Clock::time_point submitted;
+    };
+
+    std::vector<unsigned char> head, tail;
+    auto buffers = ChunkFirmwareImage(image, dev.MaxPacketSize(cCougarEndpointBulkOut), head, tail);
+
+    TraceSpan span("StreamFirmwareImage", "firmware");
+    span.Arg("chunks", buffers.size());
+
+    TransferProgress status{0, image.size + 2, {}, {}};
+    std::deque<Chunk> window;
+    size_t next = 0;
+    size_t offset = 0;
+
+    auto start = Clock::now();
+
+    try
+    {
+        while (next < buffers.size() || ! window.empty())
+        {
+            while (next < buffers.size() && window.size() < cFirmwareChunksInFlight)
+            {
+                const auto &buffer = buffers[next++];
+                window.push_back({dev.SubmitWriteBulkEP(buffer.data, buffer.size, cCougarEndpointBulkOut,
+                                                        cFirmwareChunkTimeout),
+                                  offset, buffer.size, Clock::now()});
+                offset += buffer.size;
+            }
+
+            Chunk &chunk = window.front();
+            chunk.written.get();
+
+            auto now = Clock::now();
+            if (TraceLog::Global().Enabled())
+                TraceLog::Global().Async("firmware chunk", "transfer", chunk.submitted, now,
+                                         "\"offset\":" + std::to_string(chunk.offset) + ",\"bytes\":" + std::to_string(chunk.size));
+
+            status.bytesSent += chunk.size;
+            status.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - start);
+            status.chunkLatency = std::chrono::duration_cast<std::chrono::microseconds>(now - chunk.submitted);
+            window.pop_front();
+
+            if (progress)
+                progress(status);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        // Nothing further may reach the device once a chunk has failed
+        dev.CancelTransfers();
+
+        size_t failed_at = window.empty() ? offset : window.front().offset;
+        if (auto error = dynamic_cast<const USBTransferError*>(&e))
+            failed_at += error->Transferred();
+
+        throw std::runtime_error("Firmware upload failed at byte " + std::to_string(failed_at) + " of " +
+                                 std::to_string(status.totalBytes) + ": " + e.what());
+    }
+}
+
+void UploadFirmware(USBDevice &dev, const std::string& filename, const ProgressCallback &progress)
+{
+    // Image is only accepted if it matches a known-good digest
+    MappedFile installer(filename);
+    UploadFirmware(dev, ExtractFirmware(installer), progress);
+}
+
+void UploadFirmware(USBDevice &dev, const FirmwareImage &image, const ProgressCallback &progress)
+{
+    TraceSpan span("UploadFirmware", "firmware");
 
     // Firmware upload causes a device reset
+    dev.ExpectReconnect();
+    StreamFirmwareImage(dev, image, progress);
+
     dev.Reconnect();
 
     // New device has no profile loaded, flash a default one
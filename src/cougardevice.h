@@ -21,13 +21,28 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef COUGARDEVICE_H
 #define COUGARDEVICE_H
 
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
 #include <type_traits>
+#include <vector>
 
+#include "commandframe.h"
+#include "cougarprotocol.h"
+#include "statestore.h"
 #include "usbdevice.h"
 
 namespace CougarDevice {
 
+class ProfileLibrary;
+struct FirmwareImage;
+
 //////////////////////////////////////////////////////////////////////
 
 const uint16_t cCougarVID = 0x044f;
@@ -39,8 +54,50 @@ const int cCougarInterfaceBulkIn  = 4;
 const int cCougarEndpointBulkOut = 4;
 const int cCougarEndpointBulkIn  = 5 | 0x80;
 
-// Util only supports extracting and updating a single fw version at this time.
-const std::string cSupportedFirmwareVersion{ "3.00.6 revB" };
+// Joystick HID reports, bound to usbhid unless claimed
+const int cCougarInterfaceHID        = 0;
+const int cCougarEndpointInterruptIn = 1 | 0x80;
+
+//////////////////////////////////////////////////////////////////////
+// Command Senders
+//////////////////////////////////////////////////////////////////////
+
+// Reply of a command with a fixed size response
+template <Opcode op>
+using CommandResponse = std::array<unsigned char, Command(op).responseSize>;
+
+using ProfileData = CommandResponse<Opcode::ReadProfile>;
+
+// A command that re-enumerates the device is first noted with ExpectReconnect
+template <Opcode op>
+void SendCommand(USBDevice &dev, const FixedCommand<op> &command)
+{
+    if (Command(op).reenumerates)
+        dev.ExpectReconnect();
+
+    dev.WriteBulkEP(command.Data(), command.Size(), cCougarEndpointBulkOut);
+}
+
+// Command must remain valid until the future is ready
+template <Opcode op>
+std::future<size_t> SubmitCommand(USBDevice &dev, const FixedCommand<op> &command)
+{
+    if (Command(op).reenumerates)
+        dev.ExpectReconnect();
+
+    return dev.SubmitWriteBulkEP(command.Data(), command.Size(), cCougarEndpointBulkOut,
+                                 dev.Policy().writeTimeout(static_cast<unsigned char>(op), command.Size()));
+}
+
+// Returns the number of response bytes read
+template <Opcode op>
+size_t TransactCommand(USBDevice &dev, const FixedCommand<op> &command, CommandResponse<op> &response)
+{
+    static_assert(Command(op).responseSize != 0, "Command has no response");
+
+    SendCommand(dev, command);
+    return dev.ReadBulkEP(response.data(), response.size(), cCougarEndpointBulkIn);
+}
 
 //////////////////////////////////////////////////////////////////////
 // Cougar Options bitflags
@@ -82,14 +139,245 @@ constexpr CougarOptions& operator&=(CougarOptions &a, CougarOptions b)
     return a;
 }
 
+//////////////////////////////////////////////////////////////////////
+// Upload Progress
+//////////////////////////////////////////////////////////////////////
+
+struct TransferProgress
+{
+    size_t bytesSent;
+    size_t totalBytes;
+    std::chrono::microseconds elapsed;
+
+    // Submission to completion of the most recent chunk
+    std::chrono::microseconds chunkLatency;
+
+    double BytesPerSecond() const { return elapsed.count() ? bytesSent * 1e6 / elapsed.count() : 0.0; }
+    double Percent() const { return totalBytes ? bytesSent * 100.0 / totalBytes : 100.0; }
+};
+
+// Called from the uploading thread after each chunk completes
+using ProgressCallback = std::function<void(const TransferProgress&)>;
+
+//////////////////////////////////////////////////////////////////////
+// CougarState
+//////////////////////////////////////////////////////////////////////
+
+// Session snapshot of the Cougar's profile data. Filled by a single 04 01
+// read and kept current from our own writes, so consecutive helpers on the
+// same device need not read it back again. Stale once the device resets or
+// reconnects. Not thread safe, use one per device.
+class CougarState
+{
+public:
+    // True if a snapshot is held for the device's current connection
+    bool Valid(const USBDevice &dev) const { return valid && connection == dev.Connection(); }
+
+    // Reads from the device only if not valid
+    const ProfileData& Profile(USBDevice &dev);
+    CougarOptions Options(USBDevice &dev) { return static_cast<CougarOptions>(Profile(dev)[0]); }
+
+    // Readback performed by the caller, throws if too short to hold a profile
+    void Update(const USBDevice &dev, const unsigned char *data, size_t size);
+
+    // Record our own writes
+    void OptionsWritten(CougarOptions options) { profile[0] = static_cast<unsigned char>(options); }
+    void ProfileWritten(const unsigned char *data, size_t size);
+
+    void Invalidate() { valid = false; }
+
+private:
+    ProfileData profile{};
+    bool valid = false;
+    uint64_t connection = 0;
+};
+
+// Identity of a Cougar recorded with DeviceStateStore values: a digest of the
+// TMC region of its profile data, read back or as written, without the options
+std::string ProfileIdentity(const unsigned char *data, size_t size);
+
 //////////////////////////////////////////////////////////////////////
 // Cougar Helpers
 //////////////////////////////////////////////////////////////////////
 
-void UploadFirmware(USBDevice &usb_device, const std::string& firmware_filename);
-void UploadProfile(USBDevice &dev, const std::string& filename);
-void UploadTMJBinary(USBDevice &dev, const std::string& filename);
-void SetCougarOptions(USBDevice &dev, CougarOptions options);
+// Helpers taking a CougarState share its snapshot, reading the profile only
+// when it is not already held. Without one each helper reads afresh.
+
+// Streamed in chunks, throws giving the failing byte offset if the device stops accepting data
+void UploadFirmware(USBDevice &usb_device, const std::string& firmware_filename,
+                    const ProgressCallback &progress = nullptr);
+
+// Image already extracted and verified, e.g shared by several devices
+void UploadFirmware(USBDevice &usb_device, const FirmwareImage &image,
+                    const ProgressCallback &progress = nullptr);
+void UploadProfile(USBDevice &dev, const std::string& filename, CougarState *state = nullptr);
+void UploadTMJBinary(USBDevice &dev, const std::string& filename, CougarState *state = nullptr);
+void SetCougarOptions(USBDevice &dev, CougarOptions options, CougarState *state = nullptr);
+
+// Differential variants. Skip the upload (and any reset) when the device
+// already holds the requested data. Return true if the device was written.
+bool UploadProfileIfChanged(USBDevice &dev, const std::string& filename, DeviceStateStore &store,
+                            CougarState *state = nullptr);
+bool UploadTMJBinaryIfChanged(USBDevice &dev, const std::string& filename, DeviceStateStore &store,
+                              CougarState *state = nullptr);
+bool SetCougarOptionsIfChanged(USBDevice &dev, CougarOptions options, CougarState *state = nullptr);
+
+// Uploads the library entry's TMC unless the device's profile already matches it,
+// and its TMJ unless the store records it as already in flash. Options are not
+// applied. Return true if the device was written.
+bool SwitchProfile(USBDevice &dev, const ProfileLibrary &library, const std::string& name, DeviceStateStore &store,
+                   CougarState *state = nullptr);
+
+// Validated TMC profile, ready to upload
+std::vector<unsigned char> LoadTmcFile(const std::string& filename);
+
+// Validated TMJ binary framed with its 01 upload opcode
+CommandFrame LoadTMJBinary(const std::string& filename);
+
+//////////////////////////////////////////////////////////////////////
+// CommandBatch
+//////////////////////////////////////////////////////////////////////
+
+// Fixed capacity list of writes sent back to back with a single wait
+class CommandBatch
+{
+public:
+    void Add(const unsigned char *data, size_t size)
+    {
+        assert(count < cMaxCommands && "CommandBatch capacity exceeded");
+        buffers[count++] = {data, size};
+    }
+
+    template <Opcode op>
+    void Add(const FixedCommand<op> &command) { Add(command.Data(), command.Size()); }
+
+    void Send(USBDevice &dev);
+
+    const USBDevice::ConstBuffer* Buffers() const { return buffers; }
+    size_t Count() const { return count; }
+
+private:
+    static const size_t cMaxCommands = 8;
+
+    USBDevice::ConstBuffer buffers[cMaxCommands];
+    size_t count = 0;
+};
+
+//////////////////////////////////////////////////////////////////////
+// CougarTransaction
+//////////////////////////////////////////////////////////////////////
+
+// Writes planned by a CougarTransaction against the profile last read
+struct CommitPlan
+{
+    CommandBatch writes;
+
+    // Device is reset once writes are sent, then afterReset is sent
+    bool reset = false;
+    CommandBatch afterReset;
+
+    bool writeProfile = false;
+    bool profileMatched = false;    // Profile skipped as already on the device
+    bool writeTmj = false;
+    bool writeOptions = false;
+    CougarOptions options = CougarOptions::Defaults;
+
+    std::string identity;           // ProfileIdentity of the profile planned against
+
+    bool Written() const { return writeProfile || writeTmj || writeOptions; }
+};
+
+// Collects profile, TMJ and option changes and applies them in a single
+// planned pass: at most one profile read, every write pipelined, redundant
+// option writes dropped and any device reset deferred until all uploads are
+// complete. Files are loaded when added so one transaction may be committed
+// to many devices, concurrently if the store is shared.
+class CougarTransaction
+{
+public:
+    // A store records every TMC/TMJ written. With skipUnchanged anything already
+    // on the device is skipped as with the IfChanged helpers, which needs a store.
+    explicit CougarTransaction(DeviceStateStore *store = nullptr, bool skipUnchanged = false);
+
+    void UploadProfile(const std::string& filename);
+    void UploadTMJBinary(const std::string& filename);
+    void SetOptions(CougarOptions options);
+
+    // Returns true if the device was written
+    bool Commit(USBDevice &dev, CougarState *state = nullptr) const;
+
+    // Commit split into steps for callers doing their own I/O, e.g AsyncCommit.
+    // Plan against the current profile if NeedsProfile (zeros otherwise), Begin,
+    // send the plan's writes with any reset between then Finish.
+    bool NeedsProfile() const;
+    CommitPlan Plan(const std::string &device, const ProfileData &oldData) const;
+    void Begin(const CommitPlan &plan, const std::string &device) const;
+    void Finish(const CommitPlan &plan, const std::string &device, CougarState &session) const;
+
+private:
+    bool WritesTMJ(const std::string &device, const std::string &identity) const;
+
+    DeviceStateStore *store;
+    bool skipUnchanged;
+
+    std::vector<unsigned char> profile;
+    std::string profileHash;
+
+    std::unique_ptr<CommandFrame> tmj;
+    std::string tmjHash;
+
+    bool hasOptions = false;
+    CougarOptions options = CougarOptions::Defaults;
+};
+
+//////////////////////////////////////////////////////////////////////
+// AsyncCommit
+//////////////////////////////////////////////////////////////////////
+
+// CougarTransaction::Commit without blocking, for devices opened from a polled
+// USBContext. Each Poll submits the next step's transfers and returns, events
+// handled by the context's owner complete them. A device closed after an
+// earlier failure is reopened, and its interfaces claimed, by the first Poll.
+// The device, transaction and state must outlive it.
+class AsyncCommit
+{
+public:
+    AsyncCommit(USBDevice &dev, const CougarTransaction &transaction, CougarState &state,
+                std::chrono::milliseconds reconnectTimeout = std::chrono::seconds(10));
+
+    // True once complete. Throws on failure, leaving the device to be closed.
+    bool Poll();
+
+    // Valid once complete
+    bool Written() const { return plan.Written(); }
+
+private:
+    enum class Step { Open, ReadProfile, Plan, Reset, Reconnect, Finish, Done };
+
+    void Submit(const CommandBatch &batch);
+
+    // True once every submitted transfer has finished, throws the first failure
+    bool Completed();
+
+    USBDevice &dev;
+    const CougarTransaction &transaction;
+    CougarState &state;
+    std::chrono::milliseconds reconnectTimeout;
+
+    Step step = Step::Open;
+    CommitPlan plan;
+
+    ProfileData readback;
+    std::future<size_t> read;
+    std::vector<std::future<size_t>> pending;
+    std::chrono::steady_clock::time_point reconnectDeadline;
+};
+
+// Built in profile flashed after a firmware upload
+const std::vector<unsigned char>& DefaultProfileData();
+
+// Timeouts by opcode class, so a wedged Cougar fails within seconds
+TransferPolicy CougarTransferPolicy();
 
 //////////////////////////////////////////////////////////////////////
 
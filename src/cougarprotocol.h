@@ -0,0 +1,141 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COUGARPROTOCOL_H
+#define COUGARPROTOCOL_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// Command Table
+//////////////////////////////////////////////////////////////////////
+
+// First byte of every bulk OUT command
+enum class Opcode : unsigned char
+{
+    UploadTMJ      = 0x01,
+    UploadProfile  = 0x02,
+    SetOptions     = 0x03,
+    ReadProfile    = 0x04,
+    UploadFirmware = 0x05,
+    EmulationOff   = 0x07,
+    Reset          = 0x09
+};
+
+// TMC file, uploaded as is since it begins with the 02 opcode
+const size_t cTmcSizeBytes = 171;
+
+// 04 01 profile data readback, TMC layout with the active options in byte 0
+const size_t cProfileDataSizeBytes = 256;
+
+// Ends the 05 firmware image
+const unsigned char cFirmwareTrailer = 0xff;
+
+const size_t cVariablePayload = SIZE_MAX;
+
+struct CommandDescriptor
+{
+    Opcode opcode;
+    const char *name;
+    size_t payloadSize;         // Bytes following the opcode, or cVariablePayload
+    size_t responseSize;        // Bulk IN reply, 0 if none
+    bool reenumerates;          // Device resets once the command is accepted
+};
+
+constexpr CommandDescriptor cCommands[] = {
+    {Opcode::UploadTMJ,      "upload tmj",      cVariablePayload,  0,                     false},
+    {Opcode::UploadProfile,  "upload profile",  cTmcSizeBytes - 1, 0,                     false},
+    {Opcode::SetOptions,     "set options",     1,                 0,                     false},
+    {Opcode::ReadProfile,    "read profile",    1,                 cProfileDataSizeBytes, false},
+    {Opcode::UploadFirmware, "upload firmware", cVariablePayload,  0,                     true},
+    {Opcode::EmulationOff,   "emulation off",   0,                 0,                     false},
+    {Opcode::Reset,          "reset",           1,                 0,                     true}
+};
+
+const size_t cCommandCount = sizeof(cCommands) / sizeof(cCommands[0]);
+
+// Null for an opcode the Cougar does not know
+constexpr const CommandDescriptor* FindCommand(unsigned char opcode)
+{
+    for (size_t i = 0; i < cCommandCount; i++)
+        if (static_cast<unsigned char>(cCommands[i].opcode) == opcode)
+            return &cCommands[i];
+
+    return nullptr;
+}
+
+constexpr const CommandDescriptor& Command(Opcode opcode)
+{
+    return *FindCommand(static_cast<unsigned char>(opcode));
+}
+
+//////////////////////////////////////////////////////////////////////
+// Fixed Size Commands
+//////////////////////////////////////////////////////////////////////
+
+// Complete frame of a fixed size command, sized from the table so it can
+// live on the stack or in static storage
+template <Opcode op>
+struct FixedCommand
+{
+    static_assert(Command(op).payloadSize != cVariablePayload, "Command has a variable size payload");
+
+    static constexpr size_t cSize = 1 + Command(op).payloadSize;
+    static constexpr const CommandDescriptor& Descriptor() { return Command(op); }
+
+    std::array<unsigned char, cSize> bytes;
+
+    const unsigned char* Data() const { return bytes.data(); }
+    constexpr size_t Size() const { return cSize; }
+};
+
+template <Opcode op, typename... Payload>
+constexpr FixedCommand<op> MakeCommand(Payload... payload)
+{
+    static_assert(sizeof...(Payload) == Command(op).payloadSize, "Payload size does not match the command table");
+    return FixedCommand<op>{{{static_cast<unsigned char>(op), static_cast<unsigned char>(payload)...}}};
+}
+
+template <size_t... Options>
+constexpr std::array<FixedCommand<Opcode::SetOptions>, sizeof...(Options)> MakeSetOptionsCommands(std::index_sequence<Options...>)
+{
+    return {{MakeCommand<Opcode::SetOptions>(Options)...}};
+}
+
+const FixedCommand<Opcode::Reset> cResetCommand = MakeCommand<Opcode::Reset>(0x05);
+const FixedCommand<Opcode::ReadProfile> cReadProfileCommand = MakeCommand<Opcode::ReadProfile>(0x01);
+const FixedCommand<Opcode::EmulationOff> cEmulationOffCommand = MakeCommand<Opcode::EmulationOff>();
+
+// Every 03 xx variant, indexed by the CougarOptions bitmask
+const std::array<FixedCommand<Opcode::SetOptions>, 8> cSetOptionsCommands =
+    MakeSetOptionsCommands(std::make_index_sequence<8>());
+
+static_assert(Command(Opcode::ReadProfile).responseSize == cProfileDataSizeBytes, "Profile readback size mismatch");
+static_assert(Command(Opcode::Reset).reenumerates, "Reset must be marked as re-enumerating");
+
+} // namespace CougarDevice
+
+#endif // COUGARPROTOCOL_H
@@ -0,0 +1,189 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "daemon.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "cougardevice.h"
+#include "usbmetrics.h"
+
+namespace CougarDevice {
+
+// Arrival events can beat udev applying device permissions, retry open briefly
+static const int cOpenAttempts = 20;
+static const std::chrono::milliseconds cOpenRetryDelay{25};
+
+static std::atomic<bool> sStopRequested{false};
+
+static void StopHandler(int)
+{
+    sStopRequested = true;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+using Clock = std::chrono::steady_clock;
+
+struct Arrival
+{
+    std::string portPath;
+    Clock::time_point time;
+};
+
+static void ConfigureArrival(std::shared_ptr<USBContext> context, const FleetOperation &configure, const std::string &portPath)
+{
+    USBDevice dev(context, cCougarVID, cCougarPID, portPath);
+
+    for (int attempt = 1; ; attempt++)
+    {
+        try
+        {
+            dev.Open();
+            break;
+        }
+        catch (const std::exception &)
+        {
+            if (attempt == cOpenAttempts)
+                throw;
+            std::this_thread::sleep_for(cOpenRetryDelay);
+        }
+    }
+
+    dev.ClaimInterface(cCougarInterfaceBulkOut);
+    dev.ClaimInterface(cCougarInterfaceBulkIn);
+
+    configure(dev);
+}
+
+static void WriteMetrics(const std::string &metricsFilename)
+{
+    if (metricsFilename.empty())
+        return;
+
+    try
+    {
+        USBMetrics::Global().WritePrometheusFile(metricsFilename);
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "Error: " << e.what() << "\n" << std::flush;
+    }
+}
+
+void RunDaemon(const FleetOperation &configure, const std::string &metricsFilename)
+{
+    auto context = std::make_shared<USBContext>();
+
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::deque<Arrival> arrivals;
+
+    std::signal(SIGINT, StopHandler);
+    std::signal(SIGTERM, StopHandler);
+
+    int handle = context->RegisterHotplug(cCougarVID, cCougarPID, [&](const std::string &portPath, bool arrived)
+    {
+        if (! arrived)
+            return;
+
+        Arrival arrival{portPath, Clock::now()};
+
+        if (context->ConsumeExpectedReconnect(portPath))
+        {
+            std::cout << portPath << ": reconnect after reset, ignored\n" << std::flush;
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            arrivals.push_back(arrival);
+        }
+        queueChanged.notify_one();
+    }, true);
+
+    std::cout << "Waiting for Cougar connections...\n" << std::flush;
+
+    size_t configured = 0;
+    double totalMs = 0, minMs = 0, maxMs = 0;
+
+    while (! sStopRequested)
+    {
+        Arrival arrival;
+
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+
+            // Timed wait as the signal handler cannot notify
+            if (! queueChanged.wait_for(lock, std::chrono::milliseconds(200), [&]() { return ! arrivals.empty(); }))
+                continue;
+
+            arrival = arrivals.front();
+            arrivals.pop_front();
+        }
+
+        try
+        {
+            ConfigureArrival(context, configure, arrival.portPath);
+            USBMetrics::Global().Record(USBMetrics::OpReady, Clock::now() - arrival.time);
+
+            double ms = std::chrono::duration<double, std::milli>(Clock::now() - arrival.time).count();
+
+            minMs = configured == 0 ? ms : std::min(minMs, ms);
+            maxMs = std::max(maxMs, ms);
+            totalMs += ms;
+            configured++;
+
+            std::cout << arrival.portPath << ": configured " << std::fixed << std::setprecision(1) << ms
+                      << " ms after arrival\n" << std::flush;
+        }
+        catch (const std::exception &e)
+        {
+            USBMetrics::Global().RecordFailure(USBMetrics::OpReady);
+            std::cout << arrival.portPath << ": Error: " << e.what() << "\n" << std::flush;
+        }
+
+        WriteMetrics(metricsFilename);
+    }
+
+    context->DeregisterHotplug(handle);
+
+    std::cout << "Configured " << configured << " Cougar connection(s)";
+    if (configured != 0)
+        std::cout << ", plug to ready min/avg/max " << std::fixed << std::setprecision(1)
+                  << minMs << "/" << totalMs / configured << "/" << maxMs << " ms";
+    std::cout << "\n";
+
+    WriteMetrics(metricsFilename);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,47 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <string>
+
+#include "fleet.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// Daemon
+//////////////////////////////////////////////////////////////////////
+
+// Remain resident and run configure against each Cougar as it is plugged
+// in, including any already attached at startup. Reconnects caused by our
+// own resets are ignored. Blocks until SIGINT/SIGTERM.
+//
+// If metricsFilename is given, USB metrics are written to it in Prometheus
+// text format after each arrival and on exit.
+void RunDaemon(const FleetOperation &configure, const std::string &metricsFilename = "");
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // DAEMON_H
@@ -0,0 +1,80 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "firmware.h"
+
+#include <stdexcept>
+
+#include <crypto++/sha.h>
+
+#include "trace.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// Known Firmware
+//////////////////////////////////////////////////////////////////////
+
+// Image appended to the end of the installer
+struct KnownFirmware
+{
+    const char *version;
+    size_t size;
+    unsigned char digest[CryptoPP::SHA::DIGESTSIZE];
+};
+
+// Add further versions here
+static const KnownFirmware cKnownFirmware[] = {
+    {
+        "3.00.6 revB", 25030,
+        {0x79,0x38,0x9f,0x7f,0xfb,0x27,0x65,0xa4,0x5a,0x7a,0xb2,0xf1,0x21,0x97,0x81,0x47,0xd4,0xc2,0xe5,0xb0}
+    },
+};
+
+//////////////////////////////////////////////////////////////////////
+
+static bool DigestMatches(const KnownFirmware &known, const unsigned char *candidate)
+{
+    TraceSpan span("SHA-1 verify", "firmware");
+    span.Arg("bytes", known.size);
+
+    // Hashed in place from the mapping, no copy of the candidate is made
+    return CryptoPP::SHA().VerifyDigest(known.digest, candidate, known.size);
+}
+
+FirmwareImage ExtractFirmware(const MappedFile &installer)
+{
+    TraceSpan span("ExtractFirmware", "firmware");
+
+    const unsigned char *end = installer.Data() + installer.Size();
+
+    for (const auto &known : cKnownFirmware)
+    {
+        if (known.size <= installer.Size() && DigestMatches(known, end - known.size))
+            return FirmwareImage{end - known.size, known.size, known.version};
+    }
+
+    throw std::runtime_error("No supported firmware found in " + installer.Filename() + ". Aborting firmware upload.");
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,54 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FIRMWARE_H
+#define FIRMWARE_H
+
+#include <cstddef>
+#include <string>
+
+#include "mappedfile.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// Firmware Extraction
+//////////////////////////////////////////////////////////////////////
+
+// Known-good image located within an installer. Points into the mapping,
+// valid for the lifetime of the MappedFile it was extracted from.
+struct FirmwareImage
+{
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    std::string version;
+};
+
+// Locate a known firmware image within an installer (e.g HOTASUpdate.exe).
+// Candidates are only accepted if their digest matches a known-good image.
+// Throws if no supported firmware is found.
+FirmwareImage ExtractFirmware(const MappedFile &installer);
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // FIRMWARE_H
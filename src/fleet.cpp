@@ -0,0 +1,85 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "fleet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "cougardevice.h"
+#include "trace.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+
+std::vector<FleetResult> RunFleet(std::shared_ptr<USBContext> context, const FleetOperation &operation, size_t maxWorkers)
+{
+    // Enumerate once, each worker then opens its device node without rescanning
+    auto nodes = context->FindDevices(cCougarVID, cCougarPID);
+
+    std::vector<FleetResult> results(nodes.size());
+    std::atomic<size_t> next{0};
+
+    auto worker = [&](size_t id)
+    {
+        TraceLog::Global().NameThread("worker " + std::to_string(id));
+
+        for (size_t i = next++; i < nodes.size(); i = next++)
+        {
+            FleetResult &result = results[i];
+            result.portPath = nodes[i].portPath;
+
+            try
+            {
+                USBDevice dev(context, cCougarVID, cCougarPID, nodes[i]);
+                dev.Open();
+                dev.ClaimInterface(cCougarInterfaceBulkOut);
+                dev.ClaimInterface(cCougarInterfaceBulkIn);
+
+                operation(dev);
+
+                result.success = true;
+            }
+            catch (const std::exception &e)
+            {
+                result.error = e.what();
+            }
+        }
+    };
+
+    size_t workerCount = std::min(std::max<size_t>(maxWorkers, 1), nodes.size());
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < workerCount; i++)
+        workers.emplace_back(worker, i + 1);
+
+    for (auto &thread : workers)
+        thread.join();
+
+    return results;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
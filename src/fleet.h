@@ -0,0 +1,58 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "usbcontext.h"
+#include "usbdevice.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// Fleet
+//////////////////////////////////////////////////////////////////////
+
+struct FleetResult
+{
+    std::string portPath;
+    bool success = false;
+    std::string error;
+};
+
+// Invoked with an opened device, interfaces claimed
+using FleetOperation = std::function<void(USBDevice &dev)>;
+
+// Run operation against every attached Cougar using up to maxWorkers
+// threads. Results are returned in enumeration order, one per device.
+std::vector<FleetResult> RunFleet(std::shared_ptr<USBContext> context, const FleetOperation &operation, size_t maxWorkers);
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // FLEET_H
@@ -0,0 +1,237 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hidreport.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+// Generic desktop page, X (0x30) to Wheel (0x38)
+static const uint16_t cGenericDesktopPage = 0x01;
+static const uint16_t cUsageX = 0x30;
+static const uint16_t cUsageWheel = 0x38;
+
+static const uint16_t cButtonPage = 0x09;
+
+//////////////////////////////////////////////////////////////////////
+// HIDField
+//////////////////////////////////////////////////////////////////////
+
+bool HIDField::IsAxis() const
+{
+    return usagePage == cGenericDesktopPage && usage >= cUsageX && usage <= cUsageWheel;
+}
+
+bool HIDField::IsButton() const
+{
+    return usagePage == cButtonPage;
+}
+
+int32_t HIDField::Extract(const unsigned char *report) const
+{
+    // Little endian bit field of at most 32 bits, may straddle five bytes
+    size_t first = bitOffset / 8;
+    size_t last = (bitOffset + bitSize - 1) / 8;
+
+    uint64_t bits = 0;
+    for (size_t i = last + 1; i-- > first; )
+        bits = (bits << 8) | report[i];
+
+    bits >>= bitOffset % 8;
+    uint32_t value = static_cast<uint32_t>(bits & ((uint64_t(1) << bitSize) - 1));
+
+    // Signed fields are declared by a negative logical minimum
+    if (logicalMin < 0 && bitSize < 32 && (value & (uint32_t(1) << (bitSize - 1))))
+        value |= ~((uint32_t(1) << bitSize) - 1);
+
+    return static_cast<int32_t>(value);
+}
+
+//////////////////////////////////////////////////////////////////////
+// HIDReportLayout
+//////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// Item prefix: tag in the top nibble, type in bits 2-3, data size in bits 0-1
+enum ItemType { TypeMain = 0, TypeGlobal = 1, TypeLocal = 2 };
+
+enum MainTag   { TagInput = 0x8 };
+enum GlobalTag { TagUsagePage = 0x0, TagLogicalMin = 0x1, TagLogicalMax = 0x2, TagReportSize = 0x7,
+                 TagReportID = 0x8, TagReportCount = 0x9, TagPush = 0xa, TagPop = 0xb };
+enum LocalTag  { TagUsage = 0x0, TagUsageMin = 0x1, TagUsageMax = 0x2 };
+
+const unsigned char cLongItemPrefix = 0xfe;
+
+// Input item flags
+const uint32_t cInputConstant = 0x01;
+const uint32_t cInputVariable = 0x02;
+
+struct GlobalState
+{
+    uint16_t usagePage = 0;
+    int32_t logicalMin = 0;
+    int32_t logicalMax = 0;
+    uint32_t reportSize = 0;
+    uint32_t reportCount = 0;
+    uint8_t reportID = 0;
+};
+
+// Usages carry their page in the top 16 bits when given as four bytes
+struct LocalState
+{
+    std::vector<uint32_t> usages;
+    uint32_t usageMin = 0;
+    uint32_t usageMax = 0;
+    bool hasRange = false;
+};
+
+int32_t SignExtend(uint32_t data, size_t size)
+{
+    if (size == 1) return static_cast<int8_t>(data);
+    if (size == 2) return static_cast<int16_t>(data);
+    return static_cast<int32_t>(data);
+}
+
+} // namespace
+
+HIDReportLayout::HIDReportLayout(const unsigned char *descriptor, size_t size)
+{
+    GlobalState global;
+    std::vector<GlobalState> globalStack;
+    LocalState local;
+
+    // Bit position reached within each report
+    std::map<uint8_t, size_t> reportBits;
+
+    size_t pos = 0;
+    while (pos < size)
+    {
+        unsigned char prefix = descriptor[pos];
+
+        if (prefix == cLongItemPrefix)
+        {
+            if (pos + 1 >= size)
+                throw std::runtime_error("HID report descriptor truncated");
+            pos += 3 + descriptor[pos + 1];
+            continue;
+        }
+
+        static const size_t cDataSizes[] = {0, 1, 2, 4};
+        size_t dataSize = cDataSizes[prefix & 0x03];
+        unsigned type = (prefix >> 2) & 0x03;
+        unsigned tag = prefix >> 4;
+
+        if (pos + 1 + dataSize > size)
+            throw std::runtime_error("HID report descriptor truncated at byte " + std::to_string(pos));
+
+        uint32_t data = 0;
+        for (size_t i = 0; i < dataSize; i++)
+            data |= static_cast<uint32_t>(descriptor[pos + 1 + i]) << (8 * i);
+        pos += 1 + dataSize;
+
+        if (type == TypeGlobal)
+        {
+            switch (tag)
+            {
+                case TagUsagePage:   global.usagePage = static_cast<uint16_t>(data); break;
+                case TagLogicalMin:  global.logicalMin = SignExtend(data, dataSize); break;
+                case TagLogicalMax:  global.logicalMax = SignExtend(data, dataSize); break;
+                case TagReportSize:  global.reportSize = data; break;
+                case TagReportCount: global.reportCount = data; break;
+                case TagReportID:    global.reportID = static_cast<uint8_t>(data); break;
+                case TagPush:        globalStack.push_back(global); break;
+                case TagPop:
+                    if (globalStack.empty())
+                        throw std::runtime_error("HID report descriptor pops an empty stack");
+                    global = globalStack.back();
+                    globalStack.pop_back();
+                    break;
+                default: break;
+            }
+
+            // Unsigned ranges such as 0-65535 commonly omit the sign byte
+            if ((tag == TagLogicalMin || tag == TagLogicalMax) && global.logicalMin >= 0 &&
+                global.logicalMax < global.logicalMin && dataSize < 4)
+                global.logicalMax = static_cast<int32_t>(data);
+        }
+        else if (type == TypeLocal)
+        {
+            // Page defaults to the current usage page
+            uint32_t usage = dataSize == 4 ? data : (static_cast<uint32_t>(global.usagePage) << 16) | data;
+
+            switch (tag)
+            {
+                case TagUsage:    local.usages.push_back(usage); break;
+                case TagUsageMin: local.usageMin = usage; local.hasRange = true; break;
+                case TagUsageMax: local.usageMax = usage; local.hasRange = true; break;
+                default: break;
+            }
+        }
+        else if (type == TypeMain)
+        {
+            if (tag == TagInput)
+            {
+                if (global.reportSize == 0 || global.reportSize > 32)
+                    throw std::runtime_error("HID report descriptor has unsupported field size " +
+                                             std::to_string(global.reportSize));
+
+                // Report ID occupies the first byte
+                auto bits = reportBits.find(global.reportID);
+                if (bits == reportBits.end())
+                    bits = reportBits.emplace(global.reportID, global.reportID ? 8 : 0).first;
+
+                bool variable = (data & cInputVariable) && ! (data & cInputConstant);
+
+                for (uint32_t i = 0; i < global.reportCount; i++)
+                {
+                    uint32_t usage = 0;
+                    if (local.hasRange)
+                        usage = std::min(local.usageMin + i, local.usageMax);
+                    else if (! local.usages.empty())
+                        usage = local.usages[std::min<size_t>(i, local.usages.size() - 1)];
+
+                    HIDField field{static_cast<uint16_t>(usage >> 16), static_cast<uint16_t>(usage), global.reportID,
+                                   bits->second, global.reportSize, global.logicalMin, global.logicalMax};
+
+                    if (variable && field.IsAxis())
+                        axes.push_back(field);
+                    else if (variable && field.IsButton())
+                        buttons.push_back(field);
+
+                    bits->second += global.reportSize;
+                }
+
+                reportBytes = std::max(reportBytes, (bits->second + 7) / 8);
+            }
+
+            // Locals apply to the next main item only
+            local = LocalState();
+        }
+    }
+}
+
+bool HIDReportLayout::Contains(const HIDField &field, const unsigned char *report, size_t size)
+{
+    return (field.bitOffset + field.bitSize + 7) / 8 <= size && (field.reportID == 0 || report[0] == field.reportID);
+}
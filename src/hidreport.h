@@ -0,0 +1,83 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HIDREPORT_H
+#define HIDREPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////
+// HIDField
+//////////////////////////////////////////////////////////////////////
+
+// Variable input field located by parsing a HID report descriptor
+struct HIDField
+{
+    uint16_t usagePage;
+    uint16_t usage;
+    uint8_t reportID;       // 0 when the device does not use report IDs
+
+    size_t bitOffset;       // From the start of the report, including any ID byte
+    size_t bitSize;
+
+    int32_t logicalMin;
+    int32_t logicalMax;
+
+    bool IsAxis() const;
+    bool IsButton() const;
+
+    // Caller ensures the report is long enough and carries reportID
+    int32_t Extract(const unsigned char *report) const;
+};
+
+//////////////////////////////////////////////////////////////////////
+// HIDReportLayout
+//////////////////////////////////////////////////////////////////////
+
+class HIDReportLayout
+{
+public:
+    // Throws on a malformed descriptor
+    HIDReportLayout(const unsigned char *descriptor, size_t size);
+    explicit HIDReportLayout(const std::vector<unsigned char> &descriptor)
+        : HIDReportLayout(descriptor.data(), descriptor.size()) {}
+
+    // Generic desktop X through Wheel, in report order
+    const std::vector<HIDField>& Axes() const { return axes; }
+
+    // Button page, in report order
+    const std::vector<HIDField>& Buttons() const { return buttons; }
+
+    // Bytes needed to hold the longest input report
+    size_t ReportSize() const { return reportBytes; }
+
+    // True if report is long enough and has the ID of field
+    static bool Contains(const HIDField &field, const unsigned char *report, size_t size);
+
+private:
+    std::vector<HIDField> axes;
+    std::vector<HIDField> buttons;
+    size_t reportBytes = 0;
+};
+
+#endif // HIDREPORT_H
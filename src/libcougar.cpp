@@ -0,0 +1,371 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cougar.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libusb.h>
+
+#include "cougardevice.h"
+#include "usbcontext.h"
+#include "usbdevice.h"
+
+using namespace CougarDevice;
+
+//////////////////////////////////////////////////////////////////////
+// Handles
+//////////////////////////////////////////////////////////////////////
+
+struct cougar_context
+{
+    std::shared_ptr<USBContext> usb;
+    std::string error;
+
+    std::vector<cougar_device*> devices;
+
+    cougar_pollfd_added_cb added = nullptr;
+    cougar_pollfd_removed_cb removed = nullptr;
+    void *pollfdUserData = nullptr;
+};
+
+struct cougar_device
+{
+    cougar_context *context;
+    std::unique_ptr<USBDevice> usb;
+    CougarState state;
+    std::string error;
+
+    std::unique_ptr<CougarTransaction> staged;
+
+    // The committing transaction must outlive its AsyncCommit
+    std::unique_ptr<CougarTransaction> committing;
+    std::unique_ptr<AsyncCommit> commit;
+    cougar_commit_cb callback = nullptr;
+    void *userData = nullptr;
+
+    int status = COUGAR_OK;
+    bool written = false;
+};
+
+// Reconnect after a reset is polled when hotplug cannot signal it
+static const int cReconnectPollMs = 50;
+
+//////////////////////////////////////////////////////////////////////
+
+// Exceptions must not cross the C boundary
+template <typename Call>
+static int Guarded(std::string &error, Call call)
+{
+    try
+    {
+        return call();
+    }
+    catch (const std::exception &e)
+    {
+        error = e.what();
+    }
+    catch (...)
+    {
+        error = "Unknown error";
+    }
+
+    return COUGAR_ERROR;
+}
+
+// Only once complete, or failed, is the callback invoked
+static void AdvanceCommit(cougar_device *dev)
+{
+    int status = Guarded(dev->error, [dev]() { return dev->commit->Poll() ? COUGAR_OK : COUGAR_PENDING; });
+    if (status == COUGAR_PENDING)
+        return;
+
+    dev->written = status == COUGAR_OK && dev->commit->Written();
+    dev->status = status;
+    dev->commit.reset();
+    dev->committing.reset();
+
+    // Transfers may have been abandoned mid command, reopen before the next commit
+    if (status == COUGAR_ERROR && dev->usb->IsOpen())
+        dev->usb->Close();
+
+    if (dev->callback)
+        dev->callback(dev, status, dev->written, dev->userData);
+}
+
+static void PollfdAdded(int fd, short events, void *userData)
+{
+    auto ctx = static_cast<cougar_context*>(userData);
+    if (ctx->added)
+        ctx->added(fd, events, ctx->pollfdUserData);
+}
+
+static void PollfdRemoved(int fd, void *userData)
+{
+    auto ctx = static_cast<cougar_context*>(userData);
+    if (ctx->removed)
+        ctx->removed(fd, ctx->pollfdUserData);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Context
+//////////////////////////////////////////////////////////////////////
+
+int cougar_api_version(void)
+{
+    return COUGAR_API_VERSION;
+}
+
+cougar_context* cougar_context_new(void)
+{
+    try
+    {
+        std::unique_ptr<cougar_context> ctx(new cougar_context);
+        ctx->usb = std::make_shared<USBContext>(USBContext::EventMode::Polled);
+        return ctx.release();
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void cougar_context_free(cougar_context *ctx)
+{
+    if (! ctx)
+        return;
+
+    while (! ctx->devices.empty())
+        cougar_device_close(ctx->devices.back());
+
+    libusb_set_pollfd_notifiers(ctx->usb->Handle(), nullptr, nullptr, nullptr);
+    delete ctx;
+}
+
+const char* cougar_error(const cougar_context *ctx)
+{
+    return ctx->error.c_str();
+}
+
+int cougar_get_pollfds(cougar_context *ctx, struct pollfd *fds, size_t max_fds)
+{
+    const libusb_pollfd **pollfds = libusb_get_pollfds(ctx->usb->Handle());
+    if (! pollfds)
+    {
+        ctx->error = "libusb cannot provide poll descriptors on this platform";
+        return COUGAR_ERROR;
+    }
+
+    int count = 0;
+    for (; pollfds[count]; count++)
+    {
+        if (static_cast<size_t>(count) < max_fds)
+            fds[count] = {pollfds[count]->fd, pollfds[count]->events, 0};
+    }
+
+    libusb_free_pollfds(pollfds);
+    return count;
+}
+
+void cougar_set_pollfd_notifiers(cougar_context *ctx, cougar_pollfd_added_cb added,
+                                 cougar_pollfd_removed_cb removed, void *user_data)
+{
+    ctx->added = added;
+    ctx->removed = removed;
+    ctx->pollfdUserData = user_data;
+
+    libusb_set_pollfd_notifiers(ctx->usb->Handle(), PollfdAdded, PollfdRemoved, ctx);
+}
+
+int cougar_next_timeout(cougar_context *ctx)
+{
+    int timeout = -1;
+
+    timeval tv;
+    if (libusb_get_next_timeout(ctx->usb->Handle(), &tv) == 1)
+        timeout = static_cast<int>(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+
+    // Commits also advance on reopen, reconnect and their own deadlines
+    bool committing = std::any_of(ctx->devices.begin(), ctx->devices.end(),
+                                  [](const cougar_device *dev) { return dev->commit != nullptr; });
+    if (committing && (timeout < 0 || timeout > cReconnectPollMs))
+        timeout = cReconnectPollMs;
+
+    return timeout;
+}
+
+int cougar_handle_events(cougar_context *ctx)
+{
+    int err = Guarded(ctx->error, [ctx]()
+    {
+        ctx->usb->HandleEvents();
+        return COUGAR_OK;
+    });
+
+    // Callbacks may close devices, so each is checked against the live list
+    auto devices = ctx->devices;
+    for (auto dev : devices)
+    {
+        if (std::find(ctx->devices.begin(), ctx->devices.end(), dev) != ctx->devices.end() && dev->commit)
+            AdvanceCommit(dev);
+    }
+
+    return err;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Device
+//////////////////////////////////////////////////////////////////////
+
+cougar_device* cougar_device_open(cougar_context *ctx, const char *device)
+{
+    std::unique_ptr<cougar_device> dev(new cougar_device);
+    dev->context = ctx;
+
+    int err = Guarded(ctx->error, [&]()
+    {
+        if (device)
+            dev->usb.reset(new USBDevice(ctx->usb, cCougarVID, cCougarPID, USBContext::FindDeviceNode(device)));
+        else
+            dev->usb.reset(new USBDevice(ctx->usb, cCougarVID, cCougarPID));
+
+        dev->usb->SetTransferPolicy(CougarTransferPolicy());
+        dev->usb->Open();
+        dev->usb->ClaimInterface(cCougarInterfaceBulkOut);
+        dev->usb->ClaimInterface(cCougarInterfaceBulkIn);
+
+        return COUGAR_OK;
+    });
+
+    if (err != COUGAR_OK)
+        return nullptr;
+
+    ctx->devices.push_back(dev.get());
+    return dev.release();
+}
+
+void cougar_device_close(cougar_device *dev)
+{
+    if (! dev)
+        return;
+
+    auto &devices = dev->context->devices;
+    devices.erase(std::remove(devices.begin(), devices.end(), dev), devices.end());
+
+    // Cancels anything in flight, handling events until it completes
+    try
+    {
+        if (dev->usb->IsOpen())
+            dev->usb->Close();
+    }
+    catch (...)
+    {
+    }
+
+    delete dev;
+}
+
+const char* cougar_device_port(const cougar_device *dev)
+{
+    return dev->usb->PortPath().c_str();
+}
+
+const char* cougar_device_error(const cougar_device *dev)
+{
+    return dev->error.c_str();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Staging and commit
+//////////////////////////////////////////////////////////////////////
+
+// Created on first use, so the store-less transaction always writes what was staged
+static CougarTransaction& Staged(cougar_device *dev)
+{
+    if (! dev->staged)
+        dev->staged.reset(new CougarTransaction());
+
+    return *dev->staged;
+}
+
+int cougar_stage_profile(cougar_device *dev, const char *tmc_filename)
+{
+    return Guarded(dev->error, [&]()
+    {
+        Staged(dev).UploadProfile(tmc_filename);
+        return COUGAR_OK;
+    });
+}
+
+int cougar_stage_tmj(cougar_device *dev, const char *tmj_filename)
+{
+    return Guarded(dev->error, [&]()
+    {
+        Staged(dev).UploadTMJBinary(tmj_filename);
+        return COUGAR_OK;
+    });
+}
+
+int cougar_stage_options(cougar_device *dev, unsigned int options)
+{
+    const unsigned int cAllOptions = COUGAR_OPTION_USER_PROFILE | COUGAR_OPTION_BUTTON_AXIS_EMULATION |
+                                     COUGAR_OPTION_MANUAL_CALIBRATION;
+
+    if (options & ~cAllOptions)
+    {
+        dev->error = "Unsupported Cougar options " + std::to_string(options);
+        return COUGAR_ERROR;
+    }
+
+    Staged(dev).SetOptions(static_cast<CougarOptions>(options));
+    return COUGAR_OK;
+}
+
+int cougar_commit(cougar_device *dev, cougar_commit_cb callback, void *user_data)
+{
+    if (dev->commit)
+        return COUGAR_BUSY;
+
+    dev->committing = std::move(dev->staged);
+    if (! dev->committing)
+        dev->committing.reset(new CougarTransaction());
+
+    dev->commit.reset(new AsyncCommit(*dev->usb, *dev->committing, dev->state));
+    dev->callback = callback;
+    dev->userData = user_data;
+    dev->status = COUGAR_PENDING;
+
+    // Submit the first transfers now rather than on the next event. A device
+    // closed by a failed commit is reopened from cougar_handle_events instead.
+    if (dev->usb->IsOpen())
+        AdvanceCommit(dev);
+
+    return dev->status;
+}
+
+int cougar_commit_status(const cougar_device *dev)
+{
+    return dev->status;
+}
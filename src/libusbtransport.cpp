@@ -0,0 +1,929 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "libusbtransport.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <libusb.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "usbmetrics.h"
+
+// Without hotplug, time for a resetting device to drop off before it is looked for
+static const std::chrono::milliseconds cSettleDelay{250};
+
+//////////////////////////////////////////////////////////////////////
+// Async Transfers
+//////////////////////////////////////////////////////////////////////
+
+struct LibUSBTransport::Transfer
+{
+    LibUSBTransport *device;
+
+    // Empty when the caller owns the buffer
+    std::vector<unsigned char> buffer;
+
+    // Invoked on the event thread once the transfer has finished, successfully or otherwise
+    std::function<void(libusb_transfer*, std::vector<unsigned char>&)> complete;
+};
+
+// Interrupt IN transfers resubmitted from their own callback until stopped
+struct LibUSBTransport::InterruptStream
+{
+    LibUSBTransport *device;
+    ReportCallback onReport;
+
+    // One report sized slot per transfer
+    std::vector<unsigned char> buffers;
+
+    // Guarded by transferMutex
+    bool stopping;
+    std::vector<libusb_transfer*> transfers;
+};
+
+// Stack resident state shared by the transfers of a single blocking call
+struct LibUSBTransport::SyncCompletion
+{
+    LibUSBTransport *device;
+    size_t remaining;
+
+    // First failure, if any
+    libusb_transfer_status status;
+    int shortWriteLength;
+    int shortWriteExpected;
+
+    // Of the final transfer, and of all transfers
+    int actualLength;
+    size_t totalLength;
+};
+
+// Counts the error by code in the global metrics
+static std::runtime_error LibUSBError(int err)
+{
+    USBMetrics::Global().RecordError(err);
+    return std::runtime_error(libusb_strerror(static_cast<libusb_error>(err)));
+}
+
+static std::runtime_error TransferError(libusb_transfer_status status)
+{
+    libusb_error err = LIBUSB_ERROR_IO;
+
+    switch (status)
+    {
+        case LIBUSB_TRANSFER_TIMED_OUT: err = LIBUSB_ERROR_TIMEOUT; break;
+        case LIBUSB_TRANSFER_CANCELLED: err = LIBUSB_ERROR_INTERRUPTED; break;
+        case LIBUSB_TRANSFER_STALL:     err = LIBUSB_ERROR_PIPE; break;
+        case LIBUSB_TRANSFER_NO_DEVICE: err = LIBUSB_ERROR_NO_DEVICE; break;
+        case LIBUSB_TRANSFER_OVERFLOW:  err = LIBUSB_ERROR_OVERFLOW; break;
+        default: break;
+    }
+
+    return LibUSBError(err);
+}
+
+// As TransferError, typed so callers can decide whether to retry
+static USBTransferError TransferFailure(libusb_transfer_status status, size_t transferred)
+{
+    USBTransferError::Cause cause = USBTransferError::Failed;
+
+    switch (status)
+    {
+        case LIBUSB_TRANSFER_TIMED_OUT: cause = USBTransferError::TimedOut; break;
+        case LIBUSB_TRANSFER_STALL:     cause = USBTransferError::Stalled; break;
+        case LIBUSB_TRANSFER_NO_DEVICE: cause = USBTransferError::NoDevice; break;
+        default: break;
+    }
+
+    return USBTransferError(TransferError(status).what(), transferred, cause);
+}
+
+static unsigned int TimeoutMs(std::chrono::milliseconds timeout)
+{
+    return static_cast<unsigned int>(std::max<std::chrono::milliseconds::rep>(timeout.count(), 0));
+}
+
+//////////////////////////////////////////////////////////////////////
+
+LibUSBTransport::LibUSBTransport(std::shared_ptr<USBContext> context, uint16_t vendorID, uint16_t productID, const std::string& portPath)
+    : context(std::move(context)), vendorID(vendorID), productID(productID), portPath(portPath)
+{
+    // Enough for a pipelined command sequence without growing
+    inFlight.reserve(8);
+    transferPool.reserve(8);
+}
+
+LibUSBTransport::LibUSBTransport(std::shared_ptr<USBContext> context, uint16_t vendorID, uint16_t productID, const USBDeviceNode &node)
+    : LibUSBTransport(std::move(context), vendorID, productID, node.portPath)
+{
+    deviceNode = node.path;
+}
+
+LibUSBTransport::~LibUSBTransport()
+{
+    if (deviceHandle != nullptr)
+        Close();
+
+    for (auto usbTransfer : transferPool)
+        libusb_free_transfer(usbTransfer);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void LibUSBTransport::Open()
+{
+    assert(deviceHandle == nullptr && "Open called on already opened device");
+
+    if (deviceHandle != nullptr)
+        return;
+
+    if (! deviceNode.empty())
+    {
+        OpenDeviceNode();
+        return;
+    }
+
+    TraceSpan span("device_list_scan", "usb");
+
+    libusb_device **list;
+    libusb_device *found = nullptr;
+
+    ssize_t cnt = libusb_get_device_list(context->Handle(), &list);
+    if (cnt < 0)
+        throw LibUSBError(cnt);
+
+    try
+    {
+        ssize_t i = 0;
+        for (i = 0; i < cnt; i++) 
+        {
+            libusb_device *device = list[i];
+            libusb_device_descriptor desc;
+            libusb_get_device_descriptor(device, &desc);
+            if (desc.idVendor == vendorID && desc.idProduct == productID &&
+                (portPath.empty() || USBContext::PortPath(device) == portPath))
+            {
+                found = device;
+                break;
+            }
+        }
+
+        if (! found)
+            throw std::runtime_error("Unable to find usb device" + (portPath.empty() ? "" : " at " + portPath));
+        
+        span.Arg("devices", static_cast<uint64_t>(cnt));
+
+        TraceSpan open_span("libusb_open", "usb");
+        int err = libusb_open(found, &deviceHandle);
+        if (err)
+            throw LibUSBError(err);
+
+        // Pin to the physical port so a Reconnect finds the same device again
+        portPath = USBContext::PortPath(found);
+
+        // The HID interface is bound to usbhid, detached only while we hold it
+        libusb_set_auto_detach_kernel_driver(deviceHandle, 1);
+    }
+    catch(const std::exception &e)
+    {
+        // free and unreference devices
+        libusb_free_device_list(list, 1);
+        throw;
+    }
+
+    libusb_free_device_list(list, 1);
+}
+
+void LibUSBTransport::OpenDeviceNode()
+{
+    TraceSpan span("libusb_wrap_sys_device", "usb");
+    span.Arg("node", deviceNode);
+
+    int fd = open(deviceNode.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Unable to open usb device " + deviceNode + ": " + std::strerror(errno));
+
+    int err = libusb_wrap_sys_device(context->Handle(), fd, &deviceHandle);
+    if (err)
+    {
+        close(fd);
+        throw LibUSBError(err);
+    }
+
+    libusb_device_descriptor desc;
+    libusb_get_device_descriptor(libusb_get_device(deviceHandle), &desc);
+    if (desc.idVendor != vendorID || desc.idProduct != productID)
+    {
+        libusb_close(deviceHandle);
+        deviceHandle = nullptr;
+        close(fd);
+        throw std::runtime_error(deviceNode + " is not the expected usb device");
+    }
+
+    // libusb does not take ownership of the descriptor
+    deviceFd = fd;
+    deviceNode.clear();
+
+    libusb_set_auto_detach_kernel_driver(deviceHandle, 1);
+}
+
+void LibUSBTransport::Close()
+{
+    assert(deviceHandle != nullptr && "Close called on already closed device");
+
+    // Transfers must not outlive the handle they were submitted on
+    CancelTransfers();
+    interruptStream.reset();
+
+    for (const auto& interfaceNum : claimedInterfaces)
+        libusb_release_interface(deviceHandle, interfaceNum);
+    claimedInterfaces.clear();
+
+    if (deviceHandle != nullptr)
+        libusb_close(deviceHandle);
+    
+    deviceHandle = nullptr;
+
+    if (deviceFd >= 0)
+        close(deviceFd);
+    deviceFd = -1;
+}
+
+void LibUSBTransport::Reconnect(std::chrono::milliseconds timeout)
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Polling schedule, used to retry open and when hotplug events are unavailable
+    static const std::chrono::milliseconds cInitialPollDelay{10};
+    static const std::chrono::milliseconds cMaxPollDelay{250};
+
+    bool expected = reconnectExpected;
+    if (! expected)
+        ExpectReconnect();
+    reconnectExpected = false;
+
+    auto deadline = Clock::now() + timeout;
+
+    auto err = libusb_reset_device(deviceHandle);
+
+    // Reset in place, libusb restores claimed interfaces itself. A device resetting
+    // itself (e.g after 09 05) may still drop off and re-enumerate after that though.
+    if (err == 0)
+    {
+        if (! expected || ! AwaitReenumeration(deadline))
+        {
+            context->ConsumeExpectedReconnect(portPath);
+            return;
+        }
+    }
+    // Device reset may fail causing deviceHandle to be invalidated and requiring re-open
+    else if (err != LIBUSB_ERROR_NOT_FOUND && err != LIBUSB_ERROR_NO_DEVICE)
+        // Unhandled error
+        throw LibUSBError(err);
+
+    auto interfaces = claimedInterfaces;
+    Close();
+
+    // With hotplug, nothing to do until the device re-enumerates on the same port
+    if (context->HasHotplug() && ! context->WaitForArrival(portPath, reconnectArrivals, deadline))
+        throw std::runtime_error("Device did not reconnect on " + portPath + " within " +
+                                 std::to_string(timeout.count()) + " ms");
+
+    // Arrival has been seen so try immediately, otherwise give the device time to drop off first.
+    // Retries cover the device being visible before udev has finished with it.
+    bool wait = ! context->HasHotplug();
+    auto delay = cInitialPollDelay;
+
+    for (;;)
+    {
+        if (wait)
+        {
+            std::this_thread::sleep_for(std::min<Clock::duration>(delay, deadline - Clock::now()));
+            delay = std::min(delay * 2, cMaxPollDelay);
+        }
+        wait = true;
+
+        try
+        {
+            Open();
+            for (int interfaceNum : interfaces)
+                ClaimInterface(interfaceNum);
+            return;
+        }
+        catch (const std::exception &)
+        {
+            if (deviceHandle != nullptr)
+                Close();
+
+            if (Clock::now() >= deadline)
+                throw;
+        }
+    }
+}
+
+bool LibUSBTransport::AwaitReenumeration(std::chrono::steady_clock::time_point deadline)
+{
+    using Clock = std::chrono::steady_clock;
+
+    if (context->HasHotplug())
+    {
+        if (context->WaitForArrival(portPath, reconnectArrivals, deadline))
+            return true;
+    }
+    else
+        std::this_thread::sleep_for(std::min<Clock::duration>(cSettleDelay, deadline - Clock::now()));
+
+    // Still answering on the old handle, the reset really did complete in place
+    return ! Answering();
+}
+
+bool LibUSBTransport::Answering()
+{
+    unsigned char descriptor[LIBUSB_DT_DEVICE_SIZE];
+    return libusb_get_descriptor(deviceHandle, LIBUSB_DT_DEVICE, 0, descriptor, sizeof(descriptor)) >= 0;
+}
+
+bool LibUSBTransport::TryReconnect()
+{
+    if (! reconnecting)
+    {
+        if (! reconnectExpected)
+            ExpectReconnect();
+
+        reconnectInterfaces = claimedInterfaces;
+        if (deviceHandle != nullptr && context->HasHotplug())
+            Close();
+
+        reconnecting = true;
+        reconnectDropped = false;
+        reconnectStart = std::chrono::steady_clock::now();
+    }
+
+    if (context->HasHotplug())
+    {
+        if (context->ArrivalCount(portPath) == reconnectArrivals)
+            return false;
+    }
+    // Without hotplug the old handle shows when the device drops off, opening
+    // before then would only find it again on its way out
+    else if (! reconnectDropped)
+    {
+        bool settling = std::chrono::steady_clock::now() < reconnectStart + cSettleDelay;
+
+        // Closed before the reconnect began, all we can do is give it time to drop off
+        if (deviceHandle == nullptr)
+        {
+            if (settling)
+                return false;
+        }
+        else if (Answering())
+        {
+            if (settling)
+                return false;
+
+            // Answered throughout, as in Reconnect the reset completed in place
+            context->ConsumeExpectedReconnect(portPath);
+            reconnectExpected = false;
+            reconnecting = false;
+            return true;
+        }
+        else
+            Close();
+
+        reconnectDropped = true;
+    }
+
+    // Failure is retried on the next call, e.g udev may not have finished with the device
+    try
+    {
+        Open();
+        for (int interfaceNum : reconnectInterfaces)
+            ClaimInterface(interfaceNum);
+    }
+    catch (const std::exception &)
+    {
+        if (deviceHandle != nullptr)
+            Close();
+        return false;
+    }
+
+    reconnectExpected = false;
+    reconnecting = false;
+    return true;
+}
+
+void LibUSBTransport::ExpectReconnect()
+{
+    reconnectExpected = true;
+    reconnectArrivals = context->ArrivalCount(portPath);
+    context->ExpectReconnect(portPath);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void LibUSBTransport::ClaimInterface(int interfaceNum)
+{
+    if( claimedInterfaces.find(interfaceNum) != claimedInterfaces.end() )
+        return;
+    
+    int err = libusb_claim_interface(deviceHandle, interfaceNum);
+    if (err)
+        throw LibUSBError(err);
+
+    claimedInterfaces.insert(interfaceNum);
+}
+
+void LibUSBTransport::ReleaseInterface(int interfaceNum)
+{
+    if( claimedInterfaces.find(interfaceNum) == claimedInterfaces.end() )
+        return;
+    
+    libusb_release_interface(deviceHandle, interfaceNum);
+
+    claimedInterfaces.erase(interfaceNum);
+}
+
+size_t LibUSBTransport::MaxPacketSize(int endpoint)
+{
+    assert(deviceHandle != nullptr && "MaxPacketSize called on closed device");
+
+    int size = libusb_get_max_packet_size(libusb_get_device(deviceHandle), static_cast<unsigned char>(endpoint));
+    if (size <= 0)
+        throw std::runtime_error(std::string("Unable to query packet size: ") + LibUSBError(size).what());
+
+    return static_cast<size_t>(size);
+}
+
+void LibUSBTransport::ClearHalt(int endpoint)
+{
+    assert(deviceHandle != nullptr && "ClearHalt called on closed device");
+
+    int err = libusb_clear_halt(deviceHandle, static_cast<unsigned char>(endpoint));
+    if (err)
+        throw LibUSBError(err);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+size_t LibUSBTransport::ReadBulkEP(unsigned char *buffer, size_t size, int endpoint, std::chrono::milliseconds timeout)
+{
+    // NOTE: No attempt is made to check that correct interface has been claimed for the endpoint to write to.
+    assert( ! claimedInterfaces.empty() && "Cannot write to endpoint without claiming interface first");
+    assert( (endpoint & LIBUSB_ENDPOINT_IN) == LIBUSB_ENDPOINT_IN && "ReadBulkEP requires IN endpoint for reading");
+
+    ConstBuffer read{buffer, size};
+    return TransferSync(&read, 1, endpoint, TimeoutMs(timeout));
+}
+
+void LibUSBTransport::WriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint, std::chrono::milliseconds timeout)
+{
+    // NOTE: No attempt is made to check that correct interface has been claimed for the endpoint to write to.
+    assert( ! claimedInterfaces.empty() && "Cannot write to endpoint without claiming interface first");
+    assert( (endpoint & LIBUSB_ENDPOINT_IN) != LIBUSB_ENDPOINT_IN && "WriteBulkEP requires OUT endpoint for writing");
+
+    TransferSync(buffers, count, endpoint, TimeoutMs(timeout));
+}
+
+//////////////////////////////////////////////////////////////////////
+
+template <typename Predicate>
+void LibUSBTransport::WaitTransfers(std::unique_lock<std::mutex> &lock, Predicate done)
+{
+    if (! context->Polled())
+    {
+        transferDone.wait(lock, done);
+        return;
+    }
+
+    // No event thread, so completions are only delivered by handling events here
+    while (! done())
+    {
+        lock.unlock();
+        context->HandleEvents(std::chrono::milliseconds(100));
+        lock.lock();
+    }
+}
+
+size_t LibUSBTransport::TransferSync(const ConstBuffer *buffers, size_t count, int endpoint, unsigned int timeoutMs)
+{
+    assert(deviceHandle != nullptr && "Transfer submitted on closed device");
+
+    SyncCompletion completion{this, 0, LIBUSB_TRANSFER_COMPLETED, 0, 0, 0, 0};
+    int err = 0;
+
+    std::unique_lock<std::mutex> lock(transferMutex);
+
+    for (size_t i = 0; i < count && err == 0; i++)
+    {
+        libusb_transfer *usbTransfer = AcquireTransfer();
+        if (! usbTransfer)
+        {
+            err = LIBUSB_ERROR_NO_MEM;
+            break;
+        }
+
+        // libusb only writes to the buffer for IN transfers
+        libusb_fill_bulk_transfer(usbTransfer, deviceHandle, endpoint, const_cast<unsigned char*>(buffers[i].data),
+                                  buffers[i].size, SyncTransferCallback, &completion, timeoutMs);
+
+        err = libusb_submit_transfer(usbTransfer);
+        if (err)
+        {
+            ReleaseTransfer(usbTransfer);
+            break;
+        }
+
+        inFlight.push_back(usbTransfer);
+        completion.remaining++;
+    }
+
+    // Even on a failed submit, anything already in flight references completion
+    WaitTransfers(lock, [&completion]() { return completion.remaining == 0; });
+
+    if (err)
+        throw LibUSBError(err);
+    if (completion.status != LIBUSB_TRANSFER_COMPLETED)
+        throw TransferFailure(completion.status, completion.totalLength);
+    if (completion.shortWriteExpected != 0)
+        throw USBTransferError("WriteBulkEP only transferred " + std::to_string(completion.shortWriteLength) + 
+                               " bytes out of " + std::to_string(completion.shortWriteExpected), completion.totalLength);
+
+    return completion.actualLength;
+}
+
+void LibUSBTransport::SyncTransferCallback(libusb_transfer *usbTransfer)
+{
+    auto &completion = *static_cast<SyncCompletion*>(usbTransfer->user_data);
+    LibUSBTransport *device = completion.device;
+
+    {
+        std::lock_guard<std::mutex> lock(device->transferMutex);
+
+        if (usbTransfer->status != LIBUSB_TRANSFER_COMPLETED)
+        {
+            if (completion.status == LIBUSB_TRANSFER_COMPLETED)
+            {
+                completion.status = usbTransfer->status;
+
+                // Later writes must not reach the device without this one
+                for (auto other : device->inFlight)
+                    if (other != usbTransfer && other->user_data == &completion)
+                        libusb_cancel_transfer(other);
+            }
+        }
+        else if ( (usbTransfer->endpoint & LIBUSB_ENDPOINT_IN) != LIBUSB_ENDPOINT_IN &&
+                  usbTransfer->actual_length != usbTransfer->length && completion.shortWriteExpected == 0)
+        {
+            completion.shortWriteLength = usbTransfer->actual_length;
+            completion.shortWriteExpected = usbTransfer->length;
+        }
+
+        completion.actualLength = usbTransfer->actual_length;
+        completion.totalLength += usbTransfer->actual_length;
+        completion.remaining--;
+
+        device->inFlight.erase(std::find(device->inFlight.begin(), device->inFlight.end(), usbTransfer));
+        device->ReleaseTransfer(usbTransfer);
+    }
+
+    device->transferDone.notify_all();
+}
+
+libusb_transfer* LibUSBTransport::AcquireTransfer()
+{
+    if (transferPool.empty())
+        return libusb_alloc_transfer(0);
+
+    libusb_transfer *usbTransfer = transferPool.back();
+    transferPool.pop_back();
+
+    return usbTransfer;
+}
+
+void LibUSBTransport::ReleaseTransfer(libusb_transfer *usbTransfer)
+{
+    transferPool.push_back(usbTransfer);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+std::future<size_t> LibUSBTransport::SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint,
+                                                       std::chrono::milliseconds timeout)
+{
+    // NOTE: No attempt is made to check that correct interface has been claimed for the endpoint to write to.
+    assert( ! claimedInterfaces.empty() && "Cannot write to endpoint without claiming interface first");
+    assert( (endpoint & LIBUSB_ENDPOINT_IN) != LIBUSB_ENDPOINT_IN && "WriteBulkEP requires OUT endpoint for writing");
+
+    auto promise = std::make_shared<std::promise<size_t>>();
+    auto future = promise->get_future();
+
+    std::unique_ptr<Transfer> transfer(new Transfer{this, std::move(data), nullptr});
+    transfer->complete = [promise](libusb_transfer *usbTransfer, std::vector<unsigned char>&)
+    {
+        if (usbTransfer->status != LIBUSB_TRANSFER_COMPLETED)
+            promise->set_exception(std::make_exception_ptr(TransferFailure(usbTransfer->status, usbTransfer->actual_length)));
+        else if (usbTransfer->actual_length != usbTransfer->length)
+            promise->set_exception(std::make_exception_ptr(USBTransferError(
+                "WriteBulkEP only transferred " + std::to_string(usbTransfer->actual_length) + 
+                " bytes out of " + std::to_string(usbTransfer->length), usbTransfer->actual_length)));
+        else
+            promise->set_value(usbTransfer->actual_length);
+    };
+
+    SubmitTransfer(transfer.get(), endpoint, transfer->buffer.data(), transfer->buffer.size(), TimeoutMs(timeout));
+    transfer.release();
+
+    return future;
+}
+
+std::future<std::vector<unsigned char>> LibUSBTransport::SubmitReadBulkEP(size_t readSize, int endpoint,
+                                                                          std::chrono::milliseconds timeout)
+{
+    // NOTE: No attempt is made to check that correct interface has been claimed for the endpoint to write to.
+    assert( ! claimedInterfaces.empty() && "Cannot write to endpoint without claiming interface first");
+    assert( (endpoint & LIBUSB_ENDPOINT_IN) == LIBUSB_ENDPOINT_IN && "ReadBulkEP requires IN endpoint for reading");
+
+    auto promise = std::make_shared<std::promise<std::vector<unsigned char>>>();
+    auto future = promise->get_future();
+
+    std::unique_ptr<Transfer> transfer(new Transfer{this, std::vector<unsigned char>(readSize), nullptr});
+    transfer->complete = [promise](libusb_transfer *usbTransfer, std::vector<unsigned char>& data)
+    {
+        if (usbTransfer->status != LIBUSB_TRANSFER_COMPLETED)
+        {
+            promise->set_exception(std::make_exception_ptr(TransferFailure(usbTransfer->status, usbTransfer->actual_length)));
+            return;
+        }
+
+        data.resize(usbTransfer->actual_length);
+        promise->set_value(std::move(data));
+    };
+
+    SubmitTransfer(transfer.get(), endpoint, transfer->buffer.data(), transfer->buffer.size(), TimeoutMs(timeout));
+    transfer.release();
+
+    return future;
+}
+
+std::future<size_t> LibUSBTransport::SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                                      std::chrono::milliseconds timeout)
+{
+    // NOTE: No attempt is made to check that correct interface has been claimed for the endpoint to write to.
+    assert( ! claimedInterfaces.empty() && "Cannot write to endpoint without claiming interface first");
+    assert( (endpoint & LIBUSB_ENDPOINT_IN) == LIBUSB_ENDPOINT_IN && "ReadBulkEP requires IN endpoint for reading");
+
+    auto promise = std::make_shared<std::promise<size_t>>();
+    auto future = promise->get_future();
+
+    std::unique_ptr<Transfer> transfer(new Transfer{this, {}, nullptr});
+    transfer->complete = [promise](libusb_transfer *usbTransfer, std::vector<unsigned char>&)
+    {
+        if (usbTransfer->status != LIBUSB_TRANSFER_COMPLETED)
+            promise->set_exception(std::make_exception_ptr(TransferFailure(usbTransfer->status, usbTransfer->actual_length)));
+        else
+            promise->set_value(usbTransfer->actual_length);
+    };
+
+    SubmitTransfer(transfer.get(), endpoint, buffer, size, TimeoutMs(timeout));
+    transfer.release();
+
+    return future;
+}
+
+std::future<size_t> LibUSBTransport::SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                                       std::chrono::milliseconds timeout)
+{
+    // NOTE: No attempt is made to check that correct interface has been claimed for the endpoint to write to.
+    assert( ! claimedInterfaces.empty() && "Cannot write to endpoint without claiming interface first");
+    assert( (endpoint & LIBUSB_ENDPOINT_IN) != LIBUSB_ENDPOINT_IN && "WriteBulkEP requires OUT endpoint for writing");
+
+    auto promise = std::make_shared<std::promise<size_t>>();
+    auto future = promise->get_future();
+
+    std::unique_ptr<Transfer> transfer(new Transfer{this, {}, nullptr});
+    transfer->complete = [promise](libusb_transfer *usbTransfer, std::vector<unsigned char>&)
+    {
+        if (usbTransfer->status != LIBUSB_TRANSFER_COMPLETED)
+            promise->set_exception(std::make_exception_ptr(TransferFailure(usbTransfer->status, usbTransfer->actual_length)));
+        else if (usbTransfer->actual_length != usbTransfer->length)
+            promise->set_exception(std::make_exception_ptr(USBTransferError(
+                "WriteBulkEP only transferred " + std::to_string(usbTransfer->actual_length) + 
+                " bytes out of " + std::to_string(usbTransfer->length), usbTransfer->actual_length)));
+        else
+            promise->set_value(usbTransfer->actual_length);
+    };
+
+    // libusb only writes to the buffer for IN transfers
+    SubmitTransfer(transfer.get(), endpoint, const_cast<unsigned char*>(data), size, TimeoutMs(timeout));
+    transfer.release();
+
+    return future;
+}
+
+void LibUSBTransport::SubmitTransfer(Transfer *transfer, int endpoint, unsigned char *data, size_t size,
+                                     unsigned int timeoutMs)
+{
+    assert(deviceHandle != nullptr && "Transfer submitted on closed device");
+
+    // Held across submit so the callback cannot observe the transfer before it is tracked
+    std::lock_guard<std::mutex> lock(transferMutex);
+
+    libusb_transfer *usbTransfer = AcquireTransfer();
+    if (! usbTransfer)
+        throw LibUSBError(LIBUSB_ERROR_NO_MEM);
+
+    libusb_fill_bulk_transfer(usbTransfer, deviceHandle, endpoint, data, size, TransferCallback, transfer, timeoutMs);
+
+    int err = libusb_submit_transfer(usbTransfer);
+    if (err)
+    {
+        ReleaseTransfer(usbTransfer);
+        throw LibUSBError(err);
+    }
+
+    inFlight.push_back(usbTransfer);
+}
+
+void LibUSBTransport::TransferCallback(libusb_transfer *usbTransfer)
+{
+    std::unique_ptr<Transfer> transfer(static_cast<Transfer*>(usbTransfer->user_data));
+    LibUSBTransport *device = transfer->device;
+
+    transfer->complete(usbTransfer, transfer->buffer);
+
+    {
+        std::lock_guard<std::mutex> lock(device->transferMutex);
+        device->inFlight.erase(std::find(device->inFlight.begin(), device->inFlight.end(), usbTransfer));
+        device->ReleaseTransfer(usbTransfer);
+    }
+    device->transferDone.notify_all();
+}
+
+void LibUSBTransport::CancelTransfers()
+{
+    std::unique_lock<std::mutex> lock(transferMutex);
+
+    for (auto usbTransfer : inFlight)
+        libusb_cancel_transfer(usbTransfer);
+
+    // Cancelled transfers still complete via the event thread
+    WaitTransfers(lock, [this]() { return inFlight.empty(); });
+}
+
+//////////////////////////////////////////////////////////////////////
+
+size_t LibUSBTransport::ReadInterfaceDescriptor(int interfaceNum, unsigned char type, unsigned char *buffer, size_t size)
+{
+    assert(deviceHandle != nullptr && "ReadInterfaceDescriptor called on closed device");
+
+    static const unsigned int cControlTimeoutMs = 1000;
+
+    int read = libusb_control_transfer(deviceHandle, LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_INTERFACE,
+                                       LIBUSB_REQUEST_GET_DESCRIPTOR, static_cast<uint16_t>(type << 8),
+                                       static_cast<uint16_t>(interfaceNum), buffer, static_cast<uint16_t>(size),
+                                       cControlTimeoutMs);
+    if (read < 0)
+        throw LibUSBError(read);
+
+    return static_cast<size_t>(read);
+}
+
+void LibUSBTransport::StartInterruptIn(int endpoint, size_t reportSize, ReportCallback onReport)
+{
+    assert(deviceHandle != nullptr && "StartInterruptIn called on closed device");
+    assert(! interruptStream && "Only one interrupt stream may be active");
+    assert( (endpoint & LIBUSB_ENDPOINT_IN) == LIBUSB_ENDPOINT_IN && "StartInterruptIn requires IN endpoint");
+
+    // Enough queued that the host keeps polling while callbacks run
+    static const size_t cInterruptTransfers = 8;
+
+    interruptStream.reset(new InterruptStream{this, std::move(onReport),
+                                              std::vector<unsigned char>(reportSize * cInterruptTransfers), false, {}});
+
+    int err = 0;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+
+        for (size_t i = 0; i < cInterruptTransfers && err == 0; i++)
+        {
+            libusb_transfer *usbTransfer = AcquireTransfer();
+            if (! usbTransfer)
+            {
+                err = LIBUSB_ERROR_NO_MEM;
+                break;
+            }
+
+            libusb_fill_interrupt_transfer(usbTransfer, deviceHandle, endpoint, &interruptStream->buffers[i * reportSize],
+                                           reportSize, InterruptCallback, interruptStream.get(), 0);
+
+            err = libusb_submit_transfer(usbTransfer);
+            if (err)
+            {
+                ReleaseTransfer(usbTransfer);
+                break;
+            }
+
+            inFlight.push_back(usbTransfer);
+            interruptStream->transfers.push_back(usbTransfer);
+        }
+    }
+
+    if (err)
+    {
+        StopInterruptIn();
+        throw LibUSBError(err);
+    }
+}
+
+void LibUSBTransport::StopInterruptIn()
+{
+    if (! interruptStream)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(transferMutex);
+
+        interruptStream->stopping = true;
+        for (auto usbTransfer : interruptStream->transfers)
+            libusb_cancel_transfer(usbTransfer);
+
+        WaitTransfers(lock, [this]() { return interruptStream->transfers.empty(); });
+    }
+
+    interruptStream.reset();
+}
+
+void LibUSBTransport::InterruptCallback(libusb_transfer *usbTransfer)
+{
+    auto stream = static_cast<InterruptStream*>(usbTransfer->user_data);
+    LibUSBTransport *device = stream->device;
+
+    bool completed = usbTransfer->status == LIBUSB_TRANSFER_COMPLETED;
+    if (completed)
+        stream->onReport(usbTransfer->buffer, static_cast<size_t>(usbTransfer->actual_length));
+
+    bool ended = false;
+    {
+        std::lock_guard<std::mutex> lock(device->transferMutex);
+
+        if (completed && ! stream->stopping && libusb_submit_transfer(usbTransfer) == 0)
+            return;
+
+        // Unrequested end of stream, stop the remaining transfers with it
+        if (! stream->stopping)
+        {
+            // Constructed only to count the error
+            if (usbTransfer->status != LIBUSB_TRANSFER_CANCELLED)
+                TransferError(usbTransfer->status);
+
+            stream->stopping = true;
+            for (auto other : stream->transfers)
+                if (other != usbTransfer)
+                    libusb_cancel_transfer(other);
+            ended = true;
+        }
+    }
+
+    // Still tracked, so StopInterruptIn cannot free the stream beneath us
+    if (ended)
+        stream->onReport(nullptr, 0);
+
+    {
+        std::lock_guard<std::mutex> lock(device->transferMutex);
+
+        stream->transfers.erase(std::find(stream->transfers.begin(), stream->transfers.end(), usbTransfer));
+        device->inFlight.erase(std::find(device->inFlight.begin(), device->inFlight.end(), usbTransfer));
+        device->ReleaseTransfer(usbTransfer);
+    }
+
+    device->transferDone.notify_all();
+}
@@ -0,0 +1,168 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIBUSBTRANSPORT_H
+#define LIBUSBTRANSPORT_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "usbcontext.h"
+#include "usbtransport.h"
+
+//////////////////////////////////////////////////////////////////////
+// Forwards
+//////////////////////////////////////////////////////////////////////
+
+struct libusb_device_handle;
+struct libusb_transfer;
+
+//////////////////////////////////////////////////////////////////////
+// LibUSBTransport
+//////////////////////////////////////////////////////////////////////
+
+class LibUSBTransport : public USBTransport
+{
+public:
+    // Empty portPath opens the first matching device
+    LibUSBTransport(std::shared_ptr<USBContext> context, uint16_t vendorID, uint16_t productID,
+                    const std::string& portPath = "");
+    LibUSBTransport(std::shared_ptr<USBContext> context, uint16_t vendorID, uint16_t productID,
+                    const USBDeviceNode &node);
+    ~LibUSBTransport();
+
+    LibUSBTransport(const LibUSBTransport&) = delete;
+    LibUSBTransport& operator=(const LibUSBTransport&) = delete;
+    
+    void Open() override;
+    void Close() override;
+    bool IsOpen() const override { return deviceHandle != nullptr; }
+
+    const std::string& PortPath() const override { return portPath; }
+    
+    void Reconnect(std::chrono::milliseconds timeout) override;
+    void ExpectReconnect() override;
+    bool TryReconnect() override;
+
+    void ClaimInterface(int interfaceNum) override;
+    void ReleaseInterface(int interfaceNum) override;
+
+    size_t MaxPacketSize(int endpoint) override;
+    void ClearHalt(int endpoint) override;
+
+    void WriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint,
+                     std::chrono::milliseconds timeout) override;
+    size_t ReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                      std::chrono::milliseconds timeout) override;
+
+    std::future<size_t> SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint,
+                                          std::chrono::milliseconds timeout) override;
+    std::future<std::vector<unsigned char>> SubmitReadBulkEP(size_t readSize, int endpoint,
+                                                             std::chrono::milliseconds timeout) override;
+    std::future<size_t> SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                         std::chrono::milliseconds timeout) override;
+    std::future<size_t> SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                          std::chrono::milliseconds timeout) override;
+
+    void CancelTransfers() override;
+
+    size_t ReadInterfaceDescriptor(int interfaceNum, unsigned char type, unsigned char *buffer, size_t size) override;
+
+    void StartInterruptIn(int endpoint, size_t reportSize, ReportCallback onReport) override;
+    void StopInterruptIn() override;
+    
+private:
+    struct Transfer;
+    struct SyncCompletion;
+    struct InterruptStream;
+
+    // Open via usbfs without scanning the device list
+    void OpenDeviceNode();
+
+    // After a successful reset of a device expected to re-enumerate, true once
+    // it has (or the handle no longer answers) rather than having reset in place
+    bool AwaitReenumeration(std::chrono::steady_clock::time_point deadline);
+
+    // True while the open handle still reaches the device
+    bool Answering();
+
+    void SubmitTransfer(Transfer *transfer, int endpoint, unsigned char *data, size_t size,
+                        unsigned int timeoutMs);
+    static void TransferCallback(libusb_transfer *transfer);
+
+    size_t TransferSync(const ConstBuffer *buffers, size_t count, int endpoint, unsigned int timeoutMs);
+    static void SyncTransferCallback(libusb_transfer *transfer);
+
+    static void InterruptCallback(libusb_transfer *transfer);
+
+    // Waits with transferMutex held by lock until done returns true
+    template <typename Predicate>
+    void WaitTransfers(std::unique_lock<std::mutex> &lock, Predicate done);
+
+    // transferMutex must be held
+    libusb_transfer* AcquireTransfer();
+    void ReleaseTransfer(libusb_transfer *transfer);
+
+    std::shared_ptr<USBContext> context;
+
+    uint16_t vendorID;
+    uint16_t productID;
+    std::string portPath;
+
+    // Used for the first open only, the address changes when the device re-enumerates
+    std::string deviceNode;
+    int deviceFd = -1;
+    
+    std::unordered_set<int> claimedInterfaces;
+
+    // Arrival count on portPath when the pending reconnect was requested
+    bool reconnectExpected = false;
+    uint64_t reconnectArrivals = 0;
+
+    // TryReconnect in progress. The handle has been closed, or without hotplug
+    // is kept until the device stops answering on it
+    bool reconnecting = false;
+    bool reconnectDropped = false;
+    std::chrono::steady_clock::time_point reconnectStart;
+    std::unordered_set<int> reconnectInterfaces;
+
+    libusb_device_handle *deviceHandle = nullptr;
+
+    // In flight transfers, completed by the context's event handling. Finished
+    // transfers are pooled for reuse rather than freed.
+    std::mutex transferMutex;
+    std::condition_variable transferDone;
+    std::vector<libusb_transfer*> inFlight;
+    std::vector<libusb_transfer*> transferPool;
+
+    // Transfers of the active stream are also tracked in inFlight
+    std::unique_ptr<InterruptStream> interruptStream;
+};
+
+#endif // LIBUSBTRANSPORT_H
@@ -19,23 +19,256 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <type_traits>
+#include <getopt.h>
 #include <unistd.h>
 
+#include "usbcontext.h"
 #include "usbdevice.h"
+#include "calibration.h"
+#include "controlserver.h"
 #include "cougardevice.h"
+#include "daemon.h"
+#include "firmware.h"
+#include "fleet.h"
+#include "hidreport.h"
+#include "mappedfile.h"
+#include "profilelibrary.h"
+#include "remap.h"
+#include "statestore.h"
+#include "telemetry.h"
+#include "tmccheck.h"
+#include "tmcview.h"
+#include "trace.h"
+#include "uinputsink.h"
+#include "usbmetrics.h"
+#include "usbrecord.h"
 
 using CougarOptions = CougarDevice::CougarOptions;
 
 const std::string cAppVersion = "0.2.0";
 
+// Upper limit for -j
+const unsigned long cMaxWorkers = 64;
+
+// Long only options
+enum LongOption
+{
+    OptDaemon = 256,
+    OptStateFile,
+    OptCheckTmc,
+    OptLibrary,
+    OptAdd,
+    OptSwitch,
+    OptStats,
+    OptMetricsFile,
+    OptTrace,
+    OptCalibrate,
+    OptRemap,
+    OptTelemetry,
+    OptDevice,
+    OptServe,
+    OptRecord,
+    OptReplay,
+    OptReplayRealtime
+};
+
+//////////////////////////////////////////////////////////////////////
+// Progress
+//////////////////////////////////////////////////////////////////////
+
+static void PrintFirmwareProgress(const CougarDevice::TransferProgress &progress)
+{
+    std::printf("\r  %6zu / %zu bytes %5.1f%%  %7.1f KiB/s  chunk %6.2f ms", progress.bytesSent,
+                progress.totalBytes, progress.Percent(), progress.BytesPerSecond() / 1024.0,
+                progress.chunkLatency.count() / 1000.0);
+
+    if (progress.bytesSent == progress.totalBytes)
+        std::printf("\n");
+
+    std::fflush(stdout);
+}
+
+//////////////////////////////////////////////////////////////////////
+// TMC Check
+//////////////////////////////////////////////////////////////////////
+
+// Returns false if any profile is invalid
+static bool PrintTmcReports(const std::vector<CougarDevice::TmcReport> &reports)
+{
+    size_t invalid = 0;
+
+    for (size_t i = 0; i < reports.size(); i++)
+    {
+        const auto &report = reports[i];
+        if (! report.valid)
+        {
+            std::cout << report.filename << ": Error: " << report.error << "\n";
+            invalid++;
+            continue;
+        }
+
+        std::cout << report.filename << ": OK " << report.fingerprint.substr(0, 16);
+
+        auto duplicate = std::find_if(reports.begin(), reports.begin() + i,
+                                      [&](const CougarDevice::TmcReport &other) { return other.fingerprint == report.fingerprint; });
+        if (duplicate != reports.begin() + i)
+        {
+            std::cout << " identical to " << duplicate->filename << "\n";
+            continue;
+        }
+
+        if (report.changes.empty())
+            std::cout << " default profile";
+        for (size_t change = 0; change < report.changes.size(); change++)
+            std::cout << (change == 0 ? " changes " : ", ") << report.changes[change];
+        std::cout << "\n";
+    }
+
+    std::cout << reports.size() << " TMC files checked, " << invalid << " invalid.\n";
+
+    return invalid == 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Calibration
+//////////////////////////////////////////////////////////////////////
+
+// Capture each axis' limits and centre from the HID reports. Only reported, the
+// TMC calibration region's encoding is not yet known well enough to write it.
+static void RunCalibration(const USBDeviceNode &node)
+{
+    // Centre samples are averaged over this period
+    static const std::chrono::seconds cCentreCapture{2};
+
+    USBDevice usb_device(std::make_shared<USBContext>(), CougarDevice::cCougarVID, CougarDevice::cCougarPID, node);
+    usb_device.Open();
+    usb_device.ClaimInterface(CougarDevice::cCougarInterfaceHID);
+
+    HIDReportLayout layout(usb_device.ReadHIDReportDescriptor(CougarDevice::cCougarInterfaceHID));
+    CougarDevice::CalibrationTracker tracker(layout);
+    CougarDevice::HIDCapture capture(usb_device, tracker);
+
+    std::cout << "Found " << tracker.AxisCount() << " axes. The joystick is unavailable to other applications "
+                 "until calibration completes.\n\n";
+    capture.Start();
+
+    std::string temp;
+    std::cout << "Release the stick and centre every axis, then press ENTER.";
+    std::getline(std::cin, temp);
+
+    tracker.SetPhase(CougarDevice::CalibrationTracker::PhaseCentre);
+    std::this_thread::sleep_for(cCentreCapture);
+    tracker.SetPhase(CougarDevice::CalibrationTracker::PhaseIdle);
+
+    std::cout << "Move every axis through its full range of motion, holding at each limit for 3 seconds. "
+                 "Press ENTER when done.";
+    tracker.SetPhase(CougarDevice::CalibrationTracker::PhaseRange);
+    std::getline(std::cin, temp);
+
+    capture.Stop();
+    auto calibration = tracker.Result();
+
+    std::printf("\n%zu reports at %.0f Hz\n", static_cast<size_t>(tracker.Samples()), tracker.ReportRate());
+    for (const auto &axis : calibration)
+        std::printf("  axis 0x%02x  min %6d  centre %6d  max %6d\n", axis.usage, axis.min, axis.centre, axis.max);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Device
+//////////////////////////////////////////////////////////////////////
+
+// Opened with its bulk interfaces claimed. With a replay filename the recorded
+// session stands in for the Cougar, returned in replay.
+static std::unique_ptr<USBDevice> OpenCougar(const USBDeviceNode &node, const std::string &recordFilename,
+                                             const std::string &replayFilename, ReplayTransport::Speed replaySpeed,
+                                             ReplayTransport *&replay)
+{
+    TraceSpan span("open device", "cougar");
+
+    std::unique_ptr<USBDevice> usb_device;
+
+    if (! replayFilename.empty())
+    {
+        replay = new ReplayTransport(replayFilename, replaySpeed);
+        usb_device.reset(new USBDevice(std::unique_ptr<USBTransport>(replay)));
+    }
+    else
+        usb_device.reset(new USBDevice(std::make_shared<USBContext>(), CougarDevice::cCougarVID, CougarDevice::cCougarPID, node));
+
+    if (! recordFilename.empty())
+        usb_device->Record(recordFilename);
+
+    usb_device->Open();
+    usb_device->ClaimInterface(CougarDevice::cCougarInterfaceBulkOut);
+    usb_device->ClaimInterface(CougarDevice::cCougarInterfaceBulkIn);
+
+    return usb_device;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Metrics
+//////////////////////////////////////////////////////////////////////
+
+// Reports USB metrics and the trace however main exits once a device may have
+// been touched
+struct ExitReport
+{
+    bool printStats;
+    std::string metricsFilename;
+    std::string traceFilename;
+
+    ~ExitReport()
+    {
+        if (printStats)
+            std::cout << USBMetrics::Global().FormatJson() << std::flush;
+
+        try
+        {
+            if (! metricsFilename.empty())
+                USBMetrics::Global().WritePrometheusFile(metricsFilename);
+
+            if (! traceFilename.empty())
+                TraceLog::Global().WriteFile(traceFilename);
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "Error: " << e.what() << "\n";
+        }
+    }
+};
+
+// -j argument, a whole number from 1 to cMaxWorkers
+static size_t ParseWorkerCount(const char *text)
+{
+    char *end = nullptr;
+    errno = 0;
+    unsigned long count = std::strtoul(text, &end, 10);
+
+    // strtoul accepts and negates a leading minus sign
+    if (! std::isdigit(static_cast<unsigned char>(text[0])) || *end != '\0' || errno == ERANGE ||
+        count == 0 || count > cMaxWorkers)
+        throw std::invalid_argument("Option -j requires a number of workers from 1 to " + std::to_string(cMaxWorkers));
+
+    return count;
+}
+
 //////////////////////////////////////////////////////////////////////
 // Main/Usage
 //////////////////////////////////////////////////////////////////////
@@ -51,29 +284,154 @@ static void PrintUsage(const char* appName)
     std::cout << "  -p FILE\tUpload a tmc user profile (implies -u)\n";
     std::cout << "  -t FILE\tUpload a compiled tjm binary\n";
     std::cout << "  -f FILE\tUpload new firmware to Cougar\n";
+    std::cout << "  -a \tApply to all connected Cougars in parallel\n";
+    std::cout << "  -j N\tMaximum number of Cougars configured at once with -a, 1 to " << cMaxWorkers << " (default 4)\n";
+    std::cout << "  -s \tSkip uploads and option changes already present on the Cougar\n";
+    std::cout << "  --state-file FILE\tRecord of flashed TMC/TMJ files used by -s, updated by every upload once it exists (default " << CougarDevice::cDefaultStateFile << ")\n";
+    std::cout << "  --daemon\tStay resident and configure each Cougar as it is connected\n";
+    std::cout << "  --add NAME\tStore the -p profile and/or -t binary in the library as NAME\n";
+    std::cout << "  --switch NAME\tUpload library entry NAME unless already on the Cougar\n";
+    std::cout << "  --library DIR\tProfile library used by --add, --switch and --serve (default " << CougarDevice::cDefaultLibraryDirectory << ")\n";
+    std::cout << "  --check-tmc DIR\tValidate, fingerprint and diff every tmc file in DIR against the default profile (uses -j)\n";
+    std::cout << "  --stats\tPrint USB transfer and latency statistics as JSON on exit\n";
+    std::cout << "  --metrics-file FILE\tWrite USB metrics in Prometheus text format on exit, and after each connection with --daemon\n";
+    std::cout << "  --calibrate\tCapture and print each axis' limits and centre for manual calibration (experimental)\n";
+    std::cout << "  --remap FILE\tPublish a virtual joystick with the axis curves in FILE applied, reloaded on SIGHUP\n";
+    std::cout << "  --telemetry NAME\tPublish live axis and button state to shared memory NAME, e.g /cougar-util\n";
+    std::cout << "  --serve SOCKET\tKeep the Cougar open and accept option, tmc, tmj and state requests on Unix socket SOCKET, reading files from --library\n";
+    std::cout << "  --device DEV\tOpen the Cougar at bus:address, /dev/bus/usb node or sysfs path (default from udev's environment)\n";
+    std::cout << "  --record FILE\tRecord every bulk transfer and reconnect to FILE\n";
+    std::cout << "  --replay FILE\tServe the Cougar from a --record trace instead of the device, failing if the session differs\n";
+    std::cout << "  --replay-realtime\tReplay with the recorded timing rather than as fast as possible\n";
+    std::cout << "  --trace FILE\tWrite a Chrome/Perfetto trace-event timeline of the run on exit\n";
     std::cout << "  -v \tPrint version information";
     std::cout << "Defaults: default axis profile, no emulation, auto calibration.\n";
 }
 
 int main( int argc, char *argv[])
 {
+    auto process_start = std::chrono::steady_clock::now();
+
     std::string profile_filename;
     std::string tjmbin_filename;
     std::string firmware_filename;
     CougarOptions cougar_options = CougarOptions::Defaults;
+    bool all_devices = false;
+    bool daemon_mode = false;
+    bool skip_unchanged = false;
+    std::string state_filename = CougarDevice::cDefaultStateFile;
+    bool state_file_given = false;
+    std::string check_tmc_directory;
+    std::string library_directory = CougarDevice::cDefaultLibraryDirectory;
+    std::string add_name;
+    std::string switch_name;
+    size_t max_workers = 4;
+    bool print_stats = false;
+    std::string metrics_filename;
+    std::string trace_filename;
+    bool calibrate = false;
+    std::string remap_filename;
+    std::string telemetry_name;
+    USBDeviceNode device_node;
+    std::string serve_socket;
+    std::string record_filename;
+    std::string replay_filename;
+    ReplayTransport::Speed replay_speed = ReplayTransport::Speed::Maximum;
 
     try
     {                
         int opt;
 
+        static const option long_options[] = {
+            {"all",            no_argument,       nullptr, 'a'},
+            {"jobs",           required_argument, nullptr, 'j'},
+            {"skip-unchanged", no_argument,       nullptr, 's'},
+            {"daemon",         no_argument,       nullptr, OptDaemon},
+            {"state-file",     required_argument, nullptr, OptStateFile},
+            {"check-tmc",      required_argument, nullptr, OptCheckTmc},
+            {"library",        required_argument, nullptr, OptLibrary},
+            {"add",            required_argument, nullptr, OptAdd},
+            {"switch",         required_argument, nullptr, OptSwitch},
+            {"stats",          no_argument,       nullptr, OptStats},
+            {"metrics-file",   required_argument, nullptr, OptMetricsFile},
+            {"trace",          required_argument, nullptr, OptTrace},
+            {"calibrate",      no_argument,       nullptr, OptCalibrate},
+            {"remap",          required_argument, nullptr, OptRemap},
+            {"telemetry",      required_argument, nullptr, OptTelemetry},
+            {"device",         required_argument, nullptr, OptDevice},
+            {"serve",          required_argument, nullptr, OptServe},
+            {"record",         required_argument, nullptr, OptRecord},
+            {"replay",         required_argument, nullptr, OptReplay},
+            {"replay-realtime", no_argument,      nullptr, OptReplayRealtime},
+            {nullptr,          0,                 nullptr, 0}
+        };
+
         // Args with default error message disabled
-        while ((opt = getopt(argc, argv, ":euf:p:t:hm")) != -1)
+        while ((opt = getopt_long(argc, argv, ":aeuf:j:p:st:hm", long_options, nullptr)) != -1)
         {
             switch (opt)
             {
+                case OptDaemon:
+                    daemon_mode = true;
+                    break;
+                case OptStateFile:
+                    state_filename = optarg;
+                    state_file_given = true;
+                    break;
+                case OptCheckTmc:
+                    check_tmc_directory = optarg;
+                    break;
+                case OptLibrary:
+                    library_directory = optarg;
+                    break;
+                case OptAdd:
+                    add_name = optarg;
+                    break;
+                case OptSwitch:
+                    switch_name = optarg;
+                    break;
+                case OptStats:
+                    print_stats = true;
+                    break;
+                case OptMetricsFile:
+                    metrics_filename = optarg;
+                    break;
+                case OptTrace:
+                    trace_filename = optarg;
+                    break;
+                case OptCalibrate:
+                    calibrate = true;
+                    break;
+                case OptRemap:
+                    remap_filename = optarg;
+                    break;
+                case OptTelemetry:
+                    telemetry_name = optarg;
+                    break;
+                case OptServe:
+                    serve_socket = optarg;
+                    break;
+                case OptDevice:
+                    device_node = USBContext::FindDeviceNode(optarg);
+                    break;
+                case OptRecord:
+                    record_filename = optarg;
+                    break;
+                case OptReplay:
+                    replay_filename = optarg;
+                    break;
+                case OptReplayRealtime:
+                    replay_speed = ReplayTransport::Speed::Recorded;
+                    break;
+                case 'a':
+                    all_devices = true;
+                    break;
                 case 'h':
                     PrintUsage(argv[0]);
                     return EXIT_SUCCESS;
+                case 'j':
+                    max_workers = ParseWorkerCount(optarg);
+                    break;
                 case 'm':
                     cougar_options = cougar_options | CougarOptions::ManualCalibration | CougarOptions::UserProfile;
                     break;
@@ -87,6 +445,9 @@ int main( int argc, char *argv[])
                     profile_filename = optarg;
                     cougar_options = cougar_options | CougarOptions::UserProfile;
                     break;
+                case 's':
+                    skip_unchanged = true;
+                    break;
                 case 't':
                     tjmbin_filename = optarg;
                     break;
@@ -99,6 +460,49 @@ int main( int argc, char *argv[])
                     throw std::invalid_argument(std::string("Option -") + static_cast<char>(optopt) + " missing argument");  
             }
         }
+
+        if (daemon_mode && (all_devices || ! firmware_filename.empty()))
+            throw std::invalid_argument("--daemon cannot be combined with -a or -f");
+
+        if (! add_name.empty() && (profile_filename.empty() && tjmbin_filename.empty()))
+            throw std::invalid_argument("--add requires -p and/or -t");
+
+        if (! add_name.empty() && (! switch_name.empty() || ! firmware_filename.empty() || daemon_mode || all_devices))
+            throw std::invalid_argument("--add cannot be combined with --switch, -f, -a or --daemon");
+
+        if (calibrate && (! profile_filename.empty() || ! tjmbin_filename.empty() || ! firmware_filename.empty() || daemon_mode ||
+                          all_devices || ! add_name.empty() || ! switch_name.empty()))
+            throw std::invalid_argument("--calibrate cannot be combined with -p, -t, -f, -a, --daemon, --add or --switch");
+
+        if ((! remap_filename.empty() || ! telemetry_name.empty()) && (! profile_filename.empty() || ! tjmbin_filename.empty() ||
+                                         ! firmware_filename.empty() || daemon_mode || all_devices ||
+                                         ! add_name.empty() || ! switch_name.empty() || calibrate))
+            throw std::invalid_argument("--remap and --telemetry cannot be combined with device configuration options");
+
+        if (! switch_name.empty() && (! profile_filename.empty() || ! tjmbin_filename.empty() || ! firmware_filename.empty()))
+            throw std::invalid_argument("--switch cannot be combined with -p, -t or -f");
+
+        if (! serve_socket.empty() && (! profile_filename.empty() || ! tjmbin_filename.empty() ||
+                                       ! firmware_filename.empty() || daemon_mode || all_devices ||
+                                       ! add_name.empty() || ! switch_name.empty() || calibrate ||
+                                       ! remap_filename.empty() || ! telemetry_name.empty()))
+            throw std::invalid_argument("--serve cannot be combined with other device options");
+
+        if (! device_node.Empty() && (daemon_mode || all_devices))
+            throw std::invalid_argument("--device cannot be combined with --daemon or -a");
+
+        if ((! record_filename.empty() || ! replay_filename.empty()) &&
+            (daemon_mode || all_devices || calibrate || ! remap_filename.empty() ||
+             ! telemetry_name.empty() || ! serve_socket.empty()))
+            throw std::invalid_argument("--record and --replay cannot be combined with -a, --daemon, --calibrate, --remap, --telemetry or --serve");
+
+        if (! replay_filename.empty() && ! device_node.Empty())
+            throw std::invalid_argument("--replay cannot be combined with --device");
+
+        // Run by udev for the device just connected, open it directly
+        if (device_node.Empty() && ! daemon_mode && ! all_devices && check_tmc_directory.empty() && add_name.empty() &&
+            replay_filename.empty())
+            device_node = USBContext::DeviceNodeFromEnvironment();
     }
     catch( const std::invalid_argument &e )
     {
@@ -110,6 +514,77 @@ int main( int argc, char *argv[])
 
     try
     {
+        // Offline, no device is touched
+        if (! check_tmc_directory.empty())
+            return PrintTmcReports(CougarDevice::CheckTmcDirectory(check_tmc_directory, max_workers)) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+        // Offline, no device is touched
+        if (! add_name.empty())
+        {
+            CougarDevice::ProfileLibrary(library_directory).Add(add_name, profile_filename, tjmbin_filename);
+            std::cout << "Added " << add_name << " to " << library_directory << "\n";
+
+            return EXIT_SUCCESS;
+        }
+
+        ExitReport exit_report{print_stats, metrics_filename, trace_filename};
+
+        if (! trace_filename.empty())
+        {
+            TraceLog::Global().Enable();
+            TraceLog::Global().NameThread("main");
+        }
+
+        if (calibrate)
+        {
+            RunCalibration(device_node);
+            return EXIT_SUCCESS;
+        }
+
+        if (! serve_socket.empty())
+        {
+            CougarDevice::DeviceStateStore store(state_filename);
+
+            USBDevice usb_device(std::make_shared<USBContext>(), CougarDevice::cCougarVID, CougarDevice::cCougarPID, device_node);
+            usb_device.SetTransferPolicy(CougarDevice::CougarTransferPolicy());
+
+            CougarDevice::RunControlServer(usb_device, serve_socket, store, library_directory);
+            return EXIT_SUCCESS;
+        }
+
+        if (! remap_filename.empty() || ! telemetry_name.empty())
+        {
+            // Created first, so a missing uinput module fails before the joystick is taken
+            std::unique_ptr<CougarDevice::UInputSink> uinput_sink;
+            if (! remap_filename.empty())
+                uinput_sink.reset(new CougarDevice::UInputSink());
+
+            std::unique_ptr<CougarDevice::TelemetryWriter> telemetry_sink;
+            if (! telemetry_name.empty())
+                telemetry_sink.reset(new CougarDevice::TelemetryWriter(telemetry_name));
+
+            USBDevice usb_device(std::make_shared<USBContext>(), CougarDevice::cCougarVID, CougarDevice::cCougarPID, device_node);
+            usb_device.Open();
+            usb_device.ClaimInterface(CougarDevice::cCougarInterfaceHID);
+            USBMetrics::Global().Record(USBMetrics::OpColdStart, std::chrono::steady_clock::now() - process_start);
+
+            if (uinput_sink && telemetry_sink)
+            {
+                CougarDevice::JoystickTee sink(*uinput_sink, *telemetry_sink);
+                CougarDevice::RunRemap(usb_device, remap_filename, sink);
+            }
+            else if (uinput_sink)
+                CougarDevice::RunRemap(usb_device, remap_filename, *uinput_sink);
+            else
+                CougarDevice::RunRemap(usb_device, remap_filename, *telemetry_sink);
+
+            return EXIT_SUCCESS;
+        }
+
+        // Extracted and verified once, before the prompt, then shared by every device
+        std::unique_ptr<MappedFile> installer;
+        CougarDevice::FirmwareImage firmware;
+
         if (! firmware_filename.empty())
         {
             std::cout << "********************************************************************************\n"
@@ -122,7 +597,10 @@ int main( int argc, char *argv[])
                          "down the trigger, plug your Cougar back in. Keep the trigger held down for "
                          "at least four seconds after connection to wipe any existing firmware. Then release the trigger "
                          "and wait a few more seconds for Linux to re-detect the device.\n\n";
-            std::cout << "Proceed with firmware (" << CougarDevice::cSupportedFirmwareVersion << ") upload version ? (y/n): ";
+            installer.reset(new MappedFile(firmware_filename));
+            firmware = CougarDevice::ExtractFirmware(*installer);
+
+            std::cout << "Proceed with firmware (" << firmware.version << ") upload version ? (y/n): ";
 
             std::string temp;
             std::getline(std::cin, temp);
@@ -133,17 +611,151 @@ int main( int argc, char *argv[])
             }
         }
 
-        USBDevice usb_device(CougarDevice::cCougarVID, CougarDevice::cCougarPID);
-        usb_device.Open();
-        usb_device.ClaimInterface(CougarDevice::cCougarInterfaceBulkOut);
-        usb_device.ClaimInterface(CougarDevice::cCougarInterfaceBulkIn);
+        // libusb initialisation, enumeration and the claims run while the inputs below
+        // load, validate and hash. Should any input fail nothing is written to the device.
+        // Firmware is excluded as the Cougar is only connected once the prompt is answered.
+        ReplayTransport *replay = nullptr;
+        std::future<std::unique_ptr<USBDevice>> opening;
+        std::future<std::shared_ptr<USBContext>> fleet_context;
 
-        // Options can be chained but always complete in priority of firmware, profile, tjm, options
-        if (! firmware_filename.empty())
+        if (! daemon_mode && ! all_devices && firmware_filename.empty())
+        {
+            opening = std::async(std::launch::async, [&]()
+            {
+                TraceLog::Global().NameThread("open");
+
+                auto usb_device = OpenCougar(device_node, record_filename, replay_filename, replay_speed, replay);
+                USBMetrics::Global().Record(USBMetrics::OpColdStart, std::chrono::steady_clock::now() - process_start);
+
+                return usb_device;
+            });
+        }
+        else if (all_devices)
+            fleet_context = std::async(std::launch::async, []() { return std::make_shared<USBContext>(); });
+
+        auto inputs_start = std::chrono::steady_clock::now();
+        std::unique_ptr<TraceSpan> inputs_span(new TraceSpan("load inputs", "cougar"));
+
+        // Once in use every upload is recorded, with or without -s, so the store never
+        // claims a TMC/TMJ that has since been overwritten
+        std::unique_ptr<CougarDevice::DeviceStateStore> state_store;
+        if (skip_unchanged || ! switch_name.empty() || state_file_given || access(state_filename.c_str(), F_OK) == 0)
+            state_store.reset(new CougarDevice::DeviceStateStore(state_filename));
+
+        std::unique_ptr<CougarDevice::ProfileLibrary> library;
+        if (! switch_name.empty())
+        {
+            library.reset(new CougarDevice::ProfileLibrary(library_directory));
+
+            // As with -p, a library profile is only used once activated
+            if (! library->Find(switch_name).tmc.empty())
+                cougar_options = cougar_options | CougarOptions::UserProfile;
+        }
+
+        // Files are loaded once up front, then committed to each device. With -s the
+        // transaction skips anything already present on the Cougar.
+        CougarDevice::CougarTransaction transaction(state_store.get(), skip_unchanged);
+        if (firmware_filename.empty() && ! library)
+        {
+            if (! profile_filename.empty())
+                transaction.UploadProfile(profile_filename);
+
+            if (! tjmbin_filename.empty())
+                transaction.UploadTMJBinary(tjmbin_filename);
+
+            transaction.SetOptions(cougar_options);
+        }
+
+        inputs_span.reset();
+        USBMetrics::Global().Record(USBMetrics::OpInputLoad, std::chrono::steady_clock::now() - inputs_start);
+
+        // Firmware is always uploaded alone, otherwise profile, tjm and options are applied in one pass
+        auto configure = [&](USBDevice &usb_device)
         {
+            TraceSpan span("configure", "cougar");
+            span.Arg("port", usb_device.PortPath());
+
+            // Bounded, so a wedged Cougar cannot hold up the next connection
+            usb_device.SetTransferPolicy(CougarDevice::CougarTransferPolicy());
+
+            if (! firmware_filename.empty())
+            {
+                // Flash contents are unknown from here on, even if the upload fails
+                if (state_store)
+                {
+                    state_store->Clear(usb_device.PortPath(), "tmc");
+                    state_store->Clear(usb_device.PortPath(), "tmj");
+                }
+
+                // Concurrent uploads would interleave progress lines
+                CougarDevice::UploadFirmware(usb_device, firmware,
+                                             all_devices ? nullptr : PrintFirmwareProgress);
+                return;
+            }
+
+            // Shared by every step on this device, the profile is read at most once
+            CougarDevice::CougarState state;
+
+            if (library)
+            {
+                CougarDevice::SwitchProfile(usb_device, *library, switch_name, *state_store, &state);
+                CougarDevice::SetCougarOptionsIfChanged(usb_device, cougar_options, &state);
+                return;
+            }
+
+            transaction.Commit(usb_device, &state);
+        };
+
+        if (! firmware_filename.empty())
             std::cout << "Uploading firmware. This may take several seconds to complete...\n" << std::flush;
-            CougarDevice::UploadFirmware(usb_device, firmware_filename);
 
+        if (daemon_mode)
+        {
+            CougarDevice::RunDaemon(configure, metrics_filename);
+        }
+        else if (all_devices)
+        {
+            auto results = CougarDevice::RunFleet(fleet_context.get(), configure, max_workers);
+            if (results.empty())
+                throw std::runtime_error("Unable to find usb device");
+
+            size_t failed = 0;
+            for (const auto &result : results)
+            {
+                std::cout << result.portPath << ": " << (result.success ? "OK" : "Error: " + result.error) << "\n";
+                if (! result.success)
+                    failed++;
+            }
+
+            if (failed != 0)
+            {
+                std::cout << failed << " of " << results.size() << " Cougars failed to configure.\n";
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            std::unique_ptr<USBDevice> usb_device;
+            if (opening.valid())
+                usb_device = opening.get();
+            else
+            {
+                usb_device = OpenCougar(device_node, record_filename, replay_filename, replay_speed, replay);
+                USBMetrics::Global().Record(USBMetrics::OpColdStart, std::chrono::steady_clock::now() - process_start);
+            }
+
+            configure(*usb_device);
+
+            // A replayed session fails if the protocol no longer matches it
+            if (replay && ! replay->AtEnd())
+                throw std::runtime_error("Replay of " + replay_filename + " finished with recorded transfers left over after " +
+                                         std::to_string(replay->Replayed()));
+
+            USBMetrics::Global().Record(USBMetrics::OpEndToEnd, std::chrono::steady_clock::now() - process_start);
+        }
+
+        if (! firmware_filename.empty())
+        {
             std::cout << "\nFirmware upload complete. "
                          "Please disconnect your Cougar, re-attach the throttle and reconnect. Wait a few seconds "
                          "for device detection then move each axis through its full range of motion, "
@@ -155,17 +767,7 @@ int main( int argc, char *argv[])
             // udev rule will (unless user modified) switch to manual calibration.            
             std::string temp;
             std::getline(std::cin, temp);
-            
-            return EXIT_SUCCESS;            
         }
-        
-        if (! profile_filename.empty())
-            CougarDevice::UploadProfile(usb_device, profile_filename);
-
-        if (! tjmbin_filename.empty())
-            CougarDevice::UploadTMJBinary(usb_device, tjmbin_filename);
-
-        CougarDevice::SetCougarOptions(usb_device, cougar_options);
     } 
     catch( const std::exception &e )
     {
@@ -0,0 +1,71 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mappedfile.h"
+
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////////////////////////
+
+MappedFile::MappedFile(const std::string &filename) : filename(filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Unable to open file " + filename);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Unable to read file data from " + filename);
+    }
+
+    size = st.st_size;
+
+    // mmap rejects zero length, an empty file simply has no data
+    if (size != 0)
+    {
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Unable to map file " + filename);
+        }
+
+        // Accessed front to back when scanning or uploading
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = static_cast<const unsigned char*>(mapping);
+    }
+
+    // Mapping remains valid once the descriptor is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr)
+        munmap(const_cast<unsigned char*>(data), size);
+}
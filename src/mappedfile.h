@@ -0,0 +1,53 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+//////////////////////////////////////////////////////////////////////
+// MappedFile
+//////////////////////////////////////////////////////////////////////
+
+// Read-only memory mapping of an entire file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* Data() const { return data; }
+    size_t Size() const { return size; }
+
+    const std::string& Filename() const { return filename; }
+
+private:
+    std::string filename;
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+};
+
+#endif // MAPPEDFILE_H
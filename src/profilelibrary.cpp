@@ -0,0 +1,137 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "profilelibrary.h"
+
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "commandframe.h"
+#include "cougardevice.h"
+#include "statestore.h"
+
+namespace CougarDevice {
+
+// Placeholder for a missing TMC or TMJ in the index
+static const std::string cNoHash{ "-" };
+
+//////////////////////////////////////////////////////////////////////
+
+// Creates the library directory and its parent on first use
+static void MakeDirectory(const std::string &directory)
+{
+    auto slash = directory.find_last_of('/');
+    if (slash != std::string::npos && slash != 0)
+        mkdir(directory.substr(0, slash).c_str(), 0755);
+
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+        throw std::runtime_error("Unable to create library directory " + directory);
+}
+
+ProfileLibrary::ProfileLibrary(const std::string &directory) : directory(directory)
+{
+    std::ifstream file(directory + "/index");
+    if (! file.is_open())
+        return;
+
+    // One "<name> <tmc hash> <tmj hash>" entry per line
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string name, tmc, tmj;
+
+        if (fields >> name >> tmc >> tmj)
+            entries[name] = {tmc == cNoHash ? "" : tmc, tmj == cNoHash ? "" : tmj};
+    }
+}
+
+void ProfileLibrary::Add(const std::string &name, const std::string &tmcFilename, const std::string &tmjFilename)
+{
+    if (name.empty() || name.find_first_of(" \t\n/") != std::string::npos)
+        throw std::runtime_error("Invalid library name \"" + name + "\"");
+
+    if (tmcFilename.empty() && tmjFilename.empty())
+        throw std::runtime_error("Library entry " + name + " requires a TMC profile or TMJ binary");
+
+    MakeDirectory(directory);
+
+    LibraryEntry entry;
+
+    // TMC files already begin with their 02 upload opcode
+    if (! tmcFilename.empty())
+    {
+        auto tmc = LoadTmcFile(tmcFilename);
+        entry.tmc = ContentHash(tmc.data(), tmc.size());
+        StoreBlob(entry.tmc, tmc.data(), tmc.size());
+    }
+
+    if (! tmjFilename.empty())
+    {
+        auto frame = LoadTMJBinary(tmjFilename);
+        entry.tmj = ContentHash(frame.Payload(), frame.PayloadSize());
+        StoreBlob(entry.tmj, frame.Data(), frame.Size());
+    }
+
+    entries[name] = entry;
+    Save();
+}
+
+const LibraryEntry& ProfileLibrary::Find(const std::string &name) const
+{
+    auto it = entries.find(name);
+    if (it == entries.end())
+        throw std::runtime_error("No entry " + name + " in profile library " + directory);
+
+    return it->second;
+}
+
+void ProfileLibrary::StoreBlob(const std::string &hash, const unsigned char *data, size_t size) const
+{
+    // Content addressed, an existing blob already holds identical data
+    std::string filename = BlobFilename(hash);
+    if (access(filename.c_str(), F_OK) == 0)
+        return;
+
+    ReplaceFile(filename, data, size);
+}
+
+void ProfileLibrary::Save() const
+{
+    std::ostringstream index;
+    for (const auto &entry : entries)
+    {
+        index << entry.first << " " << (entry.second.tmc.empty() ? cNoHash : entry.second.tmc)
+              << " " << (entry.second.tmj.empty() ? cNoHash : entry.second.tmj) << "\n";
+    }
+
+    auto text = index.str();
+    ReplaceFile(directory + "/index", reinterpret_cast<const unsigned char*>(text.data()), text.size());
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
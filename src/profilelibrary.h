@@ -0,0 +1,74 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROFILELIBRARY_H
+#define PROFILELIBRARY_H
+
+#include <string>
+#include <unordered_map>
+
+namespace CougarDevice {
+
+const std::string cDefaultLibraryDirectory{ "/var/lib/cougar-util/library" };
+
+// SHA-256 of the TMC file and TMJ binary, empty if not part of the entry
+struct LibraryEntry
+{
+    std::string tmc;
+    std::string tmj;
+};
+
+//////////////////////////////////////////////////////////////////////
+// ProfileLibrary
+//////////////////////////////////////////////////////////////////////
+
+// Named TMC/TMJ combinations. Each file is stored once, named by the
+// SHA-256 of its contents, already framed with its upload opcode so it
+// can be sent as is. Hashes match those recorded by DeviceStateStore.
+class ProfileLibrary
+{
+public:
+    // Missing directory is treated as an empty library
+    explicit ProfileLibrary(const std::string &directory);
+
+    // Validates and stores the files under name, replacing any existing
+    // entry. Either filename may be empty.
+    void Add(const std::string &name, const std::string &tmcFilename, const std::string &tmjFilename);
+
+    // Throws if name is not in the library
+    const LibraryEntry& Find(const std::string &name) const;
+
+    // Upload ready blob for a hash held by an entry
+    std::string BlobFilename(const std::string &hash) const { return directory + "/" + hash; }
+
+private:
+    void StoreBlob(const std::string &hash, const unsigned char *data, size_t size) const;
+    void Save() const;
+
+    std::string directory;
+    std::unordered_map<std::string, LibraryEntry> entries;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // PROFILELIBRARY_H
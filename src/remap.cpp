@@ -0,0 +1,333 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "remap.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "cougardevice.h"
+
+namespace CougarDevice {
+
+// Larger logical ranges are quantised to keep each table within the cache
+static const int64_t cMaxTableEntries = 65536;
+
+static std::atomic<bool> sStopRequested{false};
+static std::atomic<bool> sReloadRequested{false};
+
+static void StopHandler(int)
+{
+    sStopRequested = true;
+}
+
+static void ReloadHandler(int)
+{
+    sReloadRequested = true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// AxisResponse
+//////////////////////////////////////////////////////////////////////
+
+static const struct { const char *name; uint16_t usage; } cAxisNames[] = {
+    {"x", 0x30}, {"y", 0x31}, {"z", 0x32}, {"rx", 0x33}, {"ry", 0x34}, {"rz", 0x35},
+    {"slider", 0x36}, {"dial", 0x37}, {"wheel", 0x38}
+};
+
+static uint16_t AxisUsage(const std::string &name)
+{
+    for (const auto &axis : cAxisNames)
+        if (name == axis.name)
+            return axis.usage;
+
+    throw std::runtime_error("Unknown axis " + name);
+}
+
+std::vector<AxisResponse> LoadRemapFile(const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (! file.is_open())
+        throw std::runtime_error("Unable to open file " + filename);
+
+    std::vector<AxisResponse> responses;
+    std::string line;
+
+    for (size_t line_number = 1; std::getline(file, line); line_number++)
+    {
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream fields(line);
+        std::string input, output, flag;
+        AxisResponse response{0, 0, 0.0, 0.0, false};
+
+        if (! (fields >> input))
+            continue;
+
+        if (! (fields >> output >> response.deadzone >> response.expo))
+            throw std::runtime_error(filename + ":" + std::to_string(line_number) +
+                                     ": expected \"input output deadzone expo [invert]\"");
+
+        if (fields >> flag)
+        {
+            if (flag != "invert")
+                throw std::runtime_error(filename + ":" + std::to_string(line_number) + ": unknown flag " + flag);
+            response.invert = true;
+        }
+
+        if (response.deadzone < 0.0 || response.deadzone >= 1.0 || response.expo < 0.0 || response.expo > 1.0)
+            throw std::runtime_error(filename + ":" + std::to_string(line_number) +
+                                     ": deadzone must be 0 to below 1, expo 0 to 1");
+
+        response.input = AxisUsage(input);
+        response.output = AxisUsage(output);
+        responses.push_back(response);
+    }
+
+    return responses;
+}
+
+//////////////////////////////////////////////////////////////////////
+// RemapPipeline
+//////////////////////////////////////////////////////////////////////
+
+struct RemapPipeline::Tables
+{
+    // Per input axis, output slot or -1 when unused
+    std::vector<int> target;
+
+    std::vector<int32_t> inputMin;
+    std::vector<int64_t> inputRange;
+    std::vector<unsigned> shift;
+    std::vector<std::vector<int32_t>> lut;
+};
+
+static int32_t Respond(double position, const AxisResponse &response)
+{
+    double magnitude = std::fabs(position);
+
+    magnitude = magnitude <= response.deadzone ? 0.0 : (magnitude - response.deadzone) / (1.0 - response.deadzone);
+    magnitude = (1.0 - response.expo) * magnitude + response.expo * magnitude * magnitude * magnitude;
+
+    double value = std::copysign(std::min(magnitude, 1.0), position);
+    if (response.invert)
+        value = -value;
+
+    return static_cast<int32_t>(std::lround(value * cRemapAxisMax));
+}
+
+RemapPipeline::RemapPipeline(const HIDReportLayout &layout, JoystickSink &sink)
+    : axes(layout.Axes()), buttons(layout.Buttons()), sink(sink), output(axes.size(), 0)
+{
+    if (axes.empty())
+        throw std::runtime_error("HID report descriptor declares no axes");
+
+    // The virtual joystick mirrors the Cougar's axes
+    for (const auto &axis : axes)
+        outputUsages.push_back(axis.usage);
+
+    sink.Setup(outputUsages, std::min<size_t>(buttons.size(), 64));
+    SetResponses({});
+}
+
+RemapPipeline::~RemapPipeline()
+{
+    delete tables.load();
+}
+
+void RemapPipeline::SetResponses(const std::vector<AxisResponse> &responses)
+{
+    auto slot = [this](uint16_t usage) -> int
+    {
+        auto found = std::find(outputUsages.begin(), outputUsages.end(), usage);
+        if (found == outputUsages.end())
+            throw std::runtime_error("The Cougar has no axis with usage " + std::to_string(usage));
+        return static_cast<int>(found - outputUsages.begin());
+    };
+
+    std::unique_ptr<Tables> built(new Tables);
+    std::vector<bool> claimed(axes.size(), false);
+
+    for (const auto &response : responses)
+    {
+        int out = slot(response.output);
+        if (claimed[out])
+            throw std::runtime_error("More than one axis is mapped to output usage " + std::to_string(response.output));
+        claimed[out] = true;
+    }
+
+    for (size_t a = 0; a < axes.size(); a++)
+    {
+        const auto &axis = axes[a];
+
+        // Unlisted axes pass straight through unless their output was taken
+        AxisResponse response{axis.usage, axis.usage, 0.0, 0.0, false};
+        auto listed = std::find_if(responses.begin(), responses.end(),
+                                   [&](const AxisResponse &r) { return r.input == axis.usage; });
+        if (listed != responses.end())
+            response = *listed;
+
+        int target = slot(response.output);
+        if (listed == responses.end() && claimed[target])
+            target = -1;
+
+        // Descriptors without a logical range use the full field
+        int64_t min = axis.logicalMin;
+        int64_t max = axis.logicalMax;
+        if (max <= min)
+        {
+            min = 0;
+            max = (int64_t(1) << std::min<size_t>(axis.bitSize, 32)) - 1;
+        }
+
+        int64_t range = max - min + 1;
+        unsigned shift = 0;
+        while (((range - 1) >> shift) + 1 > cMaxTableEntries)
+            shift++;
+
+        std::vector<int32_t> lut(static_cast<size_t>(((range - 1) >> shift) + 1));
+        for (size_t i = 0; i < lut.size(); i++)
+        {
+            double raw = static_cast<double>(static_cast<int64_t>(i) << shift);
+            lut[i] = Respond(2.0 * raw / (max - min) - 1.0, response);
+        }
+
+        built->target.push_back(target);
+        built->inputMin.push_back(static_cast<int32_t>(min));
+        built->inputRange.push_back(range);
+        built->shift.push_back(shift);
+        built->lut.push_back(std::move(lut));
+    }
+
+    const Tables *retired = tables.exchange(built.release());
+
+    // A Process that began before the exchange may still be reading the old
+    // tables, every later one sees the new. Reports take microseconds.
+    uint64_t epoch = processEpoch.load();
+    if (epoch & 1)
+    {
+        while (processEpoch.load() == epoch)
+            std::this_thread::yield();
+    }
+
+    delete retired;
+}
+
+void RemapPipeline::Process(const unsigned char *report, size_t size) noexcept
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // Sequentially consistent with SetResponses' exchange and epoch read
+    processEpoch.fetch_add(1);
+    const Tables *current = tables.load();
+
+    for (size_t a = 0; a < axes.size(); a++)
+    {
+        int target = current->target[a];
+        if (target < 0 || ! HIDReportLayout::Contains(axes[a], report, size))
+            continue;
+
+        int64_t offset = static_cast<int64_t>(axes[a].Extract(report)) - current->inputMin[a];
+        offset = std::min(std::max<int64_t>(offset, 0), current->inputRange[a] - 1);
+
+        output[target] = current->lut[a][static_cast<size_t>(offset >> current->shift[a])];
+    }
+
+    processEpoch.fetch_add(1, std::memory_order_release);
+
+    uint64_t pressed = 0;
+    for (size_t b = 0; b < buttons.size() && b < 64; b++)
+        if (HIDReportLayout::Contains(buttons[b], report, size) && buttons[b].Extract(report))
+            pressed |= uint64_t(1) << b;
+
+    sink.Publish(output.data(), pressed);
+
+    latency.Record(std::chrono::steady_clock::now() - start);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void RunRemap(USBDevice &dev, const std::string &remapFilename, JoystickSink &sink)
+{
+    HIDReportLayout layout(dev.ReadHIDReportDescriptor(cCougarInterfaceHID));
+
+    RemapPipeline pipeline(layout, sink);
+    pipeline.SetResponses(remapFilename.empty() ? std::vector<AxisResponse>() : LoadRemapFile(remapFilename));
+
+    std::signal(SIGINT, StopHandler);
+    std::signal(SIGTERM, StopHandler);
+    std::signal(SIGHUP, ReloadHandler);
+
+    std::atomic<bool> ended{false};
+    dev.StartInterruptIn(cCougarEndpointInterruptIn, dev.MaxPacketSize(cCougarEndpointInterruptIn),
+                         [&](const unsigned char *report, size_t size)
+    {
+        if (report == nullptr)
+            ended = true;
+        else
+            pipeline.Process(report, size);
+    });
+
+    std::cout << "Remapping " << layout.Axes().size() << " axes and " << layout.Buttons().size() << " buttons.";
+    if (! remapFilename.empty())
+        std::cout << " Send SIGHUP to reload " << remapFilename << ".";
+    std::cout << "\n" << std::flush;
+
+    while (! sStopRequested && ! ended)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        if (sReloadRequested.exchange(false) && ! remapFilename.empty())
+        {
+            // A bad edit keeps the curves already in use
+            try
+            {
+                pipeline.SetResponses(LoadRemapFile(remapFilename));
+                std::cout << "Reloaded " << remapFilename << "\n" << std::flush;
+            }
+            catch (const std::exception &e)
+            {
+                std::cout << "Error: " << e.what() << "\n" << std::flush;
+            }
+        }
+    }
+
+    dev.StopInterruptIn();
+
+    const auto &latency = pipeline.Latency();
+    std::cout << latency.Count() << " reports remapped, added latency p50 < " << latency.QuantileMicros(0.5)
+              << " us, p99 < " << latency.QuantileMicros(0.99) << " us\n";
+
+    if (ended)
+        throw std::runtime_error("HID reports stopped, the Cougar may have been disconnected");
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,134 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REMAP_H
+#define REMAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "hidreport.h"
+#include "usbdevice.h"
+#include "usbmetrics.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// JoystickSink
+//////////////////////////////////////////////////////////////////////
+
+// Output range of every remapped axis
+const int32_t cRemapAxisMin = -32767;
+const int32_t cRemapAxisMax = 32767;
+
+// Where remapped reports are published, e.g a uinput virtual joystick.
+// Publish is called from the USB event thread and must not block.
+class JoystickSink
+{
+public:
+    virtual ~JoystickSink() = default;
+
+    // Once, before the first Publish. Axes are HID generic desktop usages.
+    virtual void Setup(const std::vector<uint16_t> &axisUsages, size_t buttonCount) = 0;
+
+    // axes holds one value per Setup usage, bit n of buttons is button n
+    virtual void Publish(const int32_t *axes, uint64_t buttons) = 0;
+};
+
+//////////////////////////////////////////////////////////////////////
+// AxisResponse
+//////////////////////////////////////////////////////////////////////
+
+// Response of one input axis. Axes without one pass through linearly.
+struct AxisResponse
+{
+    uint16_t input;         // HID usage, X = 0x30
+    uint16_t output;        // HID usage of the virtual axis it drives
+    double deadzone;        // Fraction of half travel around the centre, 0-1
+    double expo;            // 0 linear, 1 fully cubic
+    bool invert;
+};
+
+// Lines of "input output deadzone expo [invert]" with axes named x, y, z,
+// rx, ry, rz, slider, dial or wheel. Blank lines and # comments ignored.
+std::vector<AxisResponse> LoadRemapFile(const std::string &filename);
+
+//////////////////////////////////////////////////////////////////////
+// RemapPipeline
+//////////////////////////////////////////////////////////////////////
+
+// Applies per axis lookup tables to each HID report and publishes the result.
+// Tables are built off the report path and swapped in atomically, the report
+// path taking no lock to read them.
+class RemapPipeline
+{
+public:
+    RemapPipeline(const HIDReportLayout &layout, JoystickSink &sink);
+    ~RemapPipeline();
+
+    // Builds new tables and swaps them in, throws if responses are invalid.
+    // Returns once the report path no longer uses the old tables. Not to be
+    // called concurrently with itself.
+    void SetResponses(const std::vector<AxisResponse> &responses);
+
+    // Report path, from the USB event thread only
+    void Process(const unsigned char *report, size_t size) noexcept;
+
+    // Time from report arrival to the sink accepting it
+    const LatencyHistogram& Latency() const { return latency; }
+
+private:
+    struct Tables;
+
+    std::vector<HIDField> axes;
+    std::vector<HIDField> buttons;
+    std::vector<uint16_t> outputUsages;
+
+    JoystickSink &sink;
+
+    // Immutable once published, freed by SetResponses once retired
+    std::atomic<const Tables*> tables{nullptr};
+
+    // Incremented as Process starts and finishes, so odd while it may hold tables
+    std::atomic<uint64_t> processEpoch{0};
+
+    // Report path only
+    std::vector<int32_t> output;
+
+    LatencyHistogram latency;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+// Run dev's HID reports through a RemapPipeline into sink until SIGINT/SIGTERM.
+// remapFilename is reloaded on SIGHUP, empty passes every axis through. The HID
+// interface must be claimed.
+void RunRemap(USBDevice &dev, const std::string &remapFilename, JoystickSink &sink);
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // REMAP_H
@@ -0,0 +1,453 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "simcougar.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+
+#include <libusb.h>
+
+#include "cougardevice.h"
+#include "usbmetrics.h"
+
+// Mirrors TMC layout, command byte followed by profile data
+static const size_t cSimTMCSizeBytes = 171;
+
+// Joystick, X Y Z Rx Ry Rz Slider Dial as 16 bit fields of 0-16383, then 32 buttons
+static const unsigned char cSimHIDReportDescriptor[] = {
+    0x05, 0x01, 0x09, 0x04, 0xa1, 0x01,
+    0x15, 0x00, 0x26, 0xff, 0x3f, 0x75, 0x10, 0x95, 0x08,
+    0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09, 0x33, 0x09, 0x34, 0x09, 0x35, 0x09, 0x36, 0x09, 0x37,
+    0x81, 0x02,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x20, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x20,
+    0x81, 0x02,
+    0xc0
+};
+
+const uint16_t SimulatedCougar::cHIDAxisMin[cHIDAxisCount] = {900, 1000, 1100, 1200, 1300, 1400, 1500, 1600};
+const uint16_t SimulatedCougar::cHIDAxisMax[cHIDAxisCount] = {15000, 14800, 14600, 14400, 14200, 14000, 13800, 13600};
+
+//////////////////////////////////////////////////////////////////////
+
+// Run f now and hand back its result (or exception) as a ready future
+template <typename T, typename F>
+static std::future<T> Completed(F f)
+{
+    std::promise<T> promise;
+
+    try
+    {
+        promise.set_value(f());
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+
+    return promise.get_future();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+SimulatedCougar::SimulatedCougar(const SimulatedCougarConfig &config, const std::string &portPath)
+    : config(config), portPath(portPath)
+{
+}
+
+SimulatedCougar::~SimulatedCougar()
+{
+    StopInterruptIn();
+}
+
+void SimulatedCougar::Open()
+{
+    assert(! open && "Open called on already opened device");
+
+    if (! Present())
+        throw std::runtime_error("Unable to find usb device at " + portPath);
+
+    open = true;
+}
+
+void SimulatedCougar::Close()
+{
+    assert(open && "Close called on already closed device");
+
+    StopInterruptIn();
+    claimedInterfaces.clear();
+    open = false;
+}
+
+void SimulatedCougar::Reconnect(std::chrono::milliseconds timeout)
+{
+    bool expected = reconnectExpected;
+    reconnectExpected = false;
+
+    // No reset in progress, or one nothing warned of and the device is yet to drop
+    // off, equivalent to libusb resetting in place. As with LibUSBTransport an
+    // expected re-enumeration is always waited for.
+    if (! resetPending || (! expected && Present()))
+        return;
+
+    auto ready = resetTime + config.dropOffDelay + config.reenumerationDelay;
+    auto deadline = Clock::now() + timeout;
+
+    if (config.failReenumeration || ready > deadline)
+    {
+        std::this_thread::sleep_until(deadline);
+        throw std::runtime_error("Device did not reconnect on " + portPath + " within " +
+                                 std::to_string(timeout.count()) + " ms");
+    }
+
+    std::this_thread::sleep_until(ready);
+
+    // Claimed interfaces carry over, as LibUSBTransport re-claims them
+    resetPending = false;
+}
+
+bool SimulatedCougar::TryReconnect()
+{
+    // Never back when re-enumeration is set to fail, the caller owns the deadline
+    if (resetPending && (config.failReenumeration ||
+                         Clock::now() < resetTime + config.dropOffDelay + config.reenumerationDelay))
+        return false;
+
+    resetPending = false;
+    reconnectExpected = false;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void SimulatedCougar::ClaimInterface(int interfaceNum)
+{
+    assert(open && "ClaimInterface called on closed device");
+    claimedInterfaces.insert(interfaceNum);
+}
+
+void SimulatedCougar::ReleaseInterface(int interfaceNum)
+{
+    claimedInterfaces.erase(interfaceNum);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void SimulatedCougar::ClearHalt(int endpoint)
+{
+    haltedEndpoints.erase(endpoint);
+    clearHaltCount++;
+}
+
+void SimulatedCougar::WriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint, std::chrono::milliseconds)
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++)
+        bytes += buffers[i].size;
+
+    // Pipelined writes share a single round trip
+    Delay(bytes);
+
+    size_t accepted = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        CheckTransfer(endpoint, accepted);
+
+        const ConstBuffer &buffer = buffers[i];
+        accepted += buffer.size;
+        bool short_packet = buffer.size % cPacketSize != 0;
+
+        if (partial.empty() && short_packet)
+        {
+            HandleCommand(buffer.data, buffer.size);
+            continue;
+        }
+
+        partial.insert(partial.end(), buffer.data, buffer.data + buffer.size);
+        if (short_packet)
+        {
+            HandleCommand(partial.data(), partial.size());
+            partial.clear();
+        }
+    }
+}
+
+size_t SimulatedCougar::ReadBulkEP(unsigned char *buffer, size_t size, int endpoint, std::chrono::milliseconds)
+{
+    Delay(response.size());
+    CheckTransfer(endpoint, 0);
+
+    // As a real device, the read would be left pending until it timed out
+    if (response.empty())
+    {
+        USBMetrics::Global().RecordError(LIBUSB_ERROR_TIMEOUT);
+        throw USBTransferError("Simulated Cougar has no response queued", 0, USBTransferError::TimedOut);
+    }
+
+    size_t count = std::min(size, response.size());
+    std::copy(response.begin(), response.begin() + count, buffer);
+    response.clear();
+
+    return count;
+}
+
+std::future<size_t> SimulatedCougar::SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint,
+                                                       std::chrono::milliseconds timeout)
+{
+    return Completed<size_t>([&]()
+    {
+        ConstBuffer buffer{data.data(), data.size()};
+        WriteBulkEP(&buffer, 1, endpoint, timeout);
+        return data.size();
+    });
+}
+
+std::future<std::vector<unsigned char>> SimulatedCougar::SubmitReadBulkEP(size_t readSize, int endpoint,
+                                                                          std::chrono::milliseconds timeout)
+{
+    return Completed<std::vector<unsigned char>>([&]()
+    {
+        std::vector<unsigned char> data(readSize);
+        data.resize(ReadBulkEP(data.data(), data.size(), endpoint, timeout));
+        return data;
+    });
+}
+
+std::future<size_t> SimulatedCougar::SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                                      std::chrono::milliseconds timeout)
+{
+    return Completed<size_t>([&]() { return ReadBulkEP(buffer, size, endpoint, timeout); });
+}
+
+std::future<size_t> SimulatedCougar::SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                                       std::chrono::milliseconds timeout)
+{
+    return Completed<size_t>([&]()
+    {
+        // Failures are all-or-nothing, the device never accepts part of a transfer
+        try
+        {
+            ConstBuffer buffer{data, size};
+            WriteBulkEP(&buffer, 1, endpoint, timeout);
+        }
+        catch (const USBTransferError &)
+        {
+            throw;
+        }
+        catch (const std::runtime_error &e)
+        {
+            throw USBTransferError(e.what(), 0);
+        }
+
+        return size;
+    });
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void SimulatedCougar::Delay(size_t bytes)
+{
+    auto delay = config.latency;
+    if (config.bytesPerSecond != 0)
+        delay += std::chrono::microseconds(bytes * 1000000 / config.bytesPerSecond);
+
+    if (delay.count() != 0)
+        std::this_thread::sleep_for(delay);
+}
+
+void SimulatedCougar::CheckTransfer(int endpoint, size_t accepted)
+{
+    assert(open && "Transfer submitted on closed device");
+    assert(claimedInterfaces.count((endpoint & 0x80) ? CougarDevice::cCougarInterfaceBulkIn
+                                                     : CougarDevice::cCougarInterfaceBulkOut) &&
+           "Cannot transfer on endpoint without claiming interface first");
+
+    transferCount++;
+
+    if (! Present())
+    {
+        USBMetrics::Global().RecordError(LIBUSB_ERROR_NO_DEVICE);
+        throw USBTransferError("No such device (it may have been disconnected)", accepted, USBTransferError::NoDevice);
+    }
+
+    if (config.stallEveryNthTransfer != 0 && transferCount % config.stallEveryNthTransfer == 0)
+        haltedEndpoints.insert(endpoint);
+
+    if (haltedEndpoints.count(endpoint))
+    {
+        USBMetrics::Global().RecordError(LIBUSB_ERROR_PIPE);
+        throw USBTransferError("Pipe error (simulated)", accepted, USBTransferError::Stalled);
+    }
+
+    if (config.timeoutEveryNthTransfer != 0 && transferCount % config.timeoutEveryNthTransfer == 0)
+    {
+        USBMetrics::Global().RecordError(LIBUSB_ERROR_TIMEOUT);
+        throw USBTransferError("Operation timed out (simulated)", accepted, USBTransferError::TimedOut);
+    }
+
+    if (config.failEveryNthTransfer != 0 && transferCount % config.failEveryNthTransfer == 0)
+    {
+        USBMetrics::Global().RecordError(LIBUSB_ERROR_IO);
+        throw USBTransferError("Input/Output Error (simulated)", accepted);
+    }
+}
+
+void SimulatedCougar::HandleCommand(const unsigned char *data, size_t size)
+{
+    if (size == 0)
+        throw std::runtime_error("Simulated Cougar received empty command");
+
+    commandCount++;
+    bytesWritten += size;
+
+    switch (data[0])
+    {
+        case 0x01:
+            tmj.assign(data + 1, data + size);
+            break;
+
+        case 0x02:
+            // Built in default profile carries two extra trailing bytes, ignored as on the device
+            if (size < cSimTMCSizeBytes)
+                throw std::runtime_error("Simulated Cougar received " + std::to_string(size) + " byte profile");
+            std::copy(data + 1, data + cSimTMCSizeBytes, profile.begin() + 1);
+            break;
+
+        case 0x03:
+            if (size != 2)
+                throw std::runtime_error("Simulated Cougar received malformed options command");
+            profile[0] = data[1];
+            break;
+
+        case 0x04:
+            if (size != 2 || data[1] != 0x01)
+                throw std::runtime_error("Simulated Cougar received unknown 04 command");
+            response.assign(profile.begin(), profile.end());
+            break;
+
+        case 0x05:
+            if (size < 2 || data[size - 1] != 0xff)
+                throw std::runtime_error("Simulated Cougar received unterminated firmware");
+            firmware.assign(data + 1, data + size - 1);
+
+            // Fresh firmware has no profile
+            profile.fill(0);
+            BeginReset();
+            break;
+
+        case 0x07:
+            break;
+
+        case 0x09:
+            if (size != 2 || data[1] != 0x05)
+                throw std::runtime_error("Simulated Cougar received unknown 09 command");
+            BeginReset();
+            break;
+
+        default:
+        {
+            char opcode[8];
+            std::snprintf(opcode, sizeof(opcode), "%02x", data[0]);
+            throw std::runtime_error(std::string("Simulated Cougar received unknown opcode ") + opcode);
+        }
+    }
+}
+
+bool SimulatedCougar::Present() const
+{
+    return ! resetPending || Clock::now() < resetTime + config.dropOffDelay;
+}
+
+void SimulatedCougar::BeginReset()
+{
+    // Device always returns in its default mode
+    profile[0] = 0;
+    response.clear();
+    partial.clear();
+
+    resetPending = true;
+    resetTime = Clock::now();
+    resetCount++;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+size_t SimulatedCougar::ReadInterfaceDescriptor(int interfaceNum, unsigned char type, unsigned char *buffer, size_t size)
+{
+    static const unsigned char cHIDReportDescriptor = 0x22;
+
+    if (interfaceNum != CougarDevice::cCougarInterfaceHID || type != cHIDReportDescriptor)
+        throw std::runtime_error("Pipe error (simulated)");
+
+    size = std::min(size, sizeof(cSimHIDReportDescriptor));
+    std::copy(cSimHIDReportDescriptor, cSimHIDReportDescriptor + size, buffer);
+
+    return size;
+}
+
+void SimulatedCougar::StartInterruptIn(int endpoint, size_t reportSize, ReportCallback onReport)
+{
+    assert(claimedInterfaces.count(CougarDevice::cCougarInterfaceHID) && endpoint == CougarDevice::cCougarEndpointInterruptIn &&
+           "Cannot transfer on endpoint without claiming interface first");
+    assert(! reportThread.joinable() && "Only one interrupt stream may be active");
+    assert(reportSize >= cHIDReportSize);
+    (void)endpoint;
+    (void)reportSize;
+
+    reportStop = false;
+    reportThread = std::thread([this, onReport]()
+    {
+        unsigned char report[cHIDReportSize] = {};
+        auto next = Clock::now();
+
+        for (size_t n = 0; ! reportStop; n++)
+        {
+            // Triangle wave per axis, each at its own speed
+            for (size_t axis = 0; axis < cHIDAxisCount; axis++)
+            {
+                size_t span = cHIDAxisMax[axis] - cHIDAxisMin[axis];
+                size_t pos = (n * 37 * (axis + 1)) % (2 * span);
+                size_t value = cHIDAxisMin[axis] + (pos <= span ? pos : 2 * span - pos);
+
+                report[axis * 2] = static_cast<unsigned char>(value);
+                report[axis * 2 + 1] = static_cast<unsigned char>(value >> 8);
+            }
+
+            onReport(report, sizeof(report));
+            reportCount++;
+
+            next += config.reportInterval;
+            std::this_thread::sleep_until(next);
+        }
+    });
+}
+
+void SimulatedCougar::StopInterruptIn()
+{
+    if (! reportThread.joinable())
+        return;
+
+    reportStop = true;
+    reportThread.join();
+}
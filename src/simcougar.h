@@ -0,0 +1,187 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMCOUGAR_H
+#define SIMCOUGAR_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "usbtransport.h"
+
+//////////////////////////////////////////////////////////////////////
+// SimulatedCougar
+//////////////////////////////////////////////////////////////////////
+
+struct SimulatedCougarConfig
+{
+    // Charged once per blocking call or async submit, models a USB round trip
+    std::chrono::microseconds latency{1000};
+
+    // Bulk throughput, 0 for unlimited
+    size_t bytesPerSecond = 0;
+
+    // Time from a reset (09 05 or firmware upload) until the device is back
+    std::chrono::milliseconds reenumerationDelay{1500};
+
+    // Time from a reset until the device drops off the bus, counted before
+    // reenumerationDelay. Until then it still answers and a port reset succeeds in place.
+    std::chrono::milliseconds dropOffDelay{0};
+
+    // Fault injection. Fail every Nth transfer, 0 disables.
+    unsigned failEveryNthTransfer = 0;
+
+    // Fault injection. Every Nth transfer times out, or stalls its endpoint until
+    // the halt is cleared, without reaching the device. 0 disables.
+    unsigned timeoutEveryNthTransfer = 0;
+    unsigned stallEveryNthTransfer = 0;
+
+    // Fault injection. Device never returns after a reset.
+    bool failReenumeration = false;
+
+    // HID report rate, axes sweep back and forth between the limits below
+    std::chrono::microseconds reportInterval{1000};
+};
+
+// In-process model of the Cougar bulk protocol. Implements the known
+// opcodes (01 TMJ, 02 TMC, 03 options, 04 01 profile read, 05 firmware,
+// 07 and 09 05 reset) with configurable timing and fault injection.
+// As on the wire, a command ends with a short packet so one command may
+// span several whole-packet transfers. Async submits complete before returning.
+// HID reports are generated on a thread of their own.
+class SimulatedCougar : public USBTransport
+{
+public:
+    static const size_t cProfileDataSizeBytes = 256;
+    static const size_t cPacketSize = 64;
+
+    // Eight 14 bit axes followed by 32 buttons
+    static const size_t cHIDAxisCount = 8;
+    static const size_t cHIDReportSize = cHIDAxisCount * 2 + 4;
+    static const uint16_t cHIDAxisMin[cHIDAxisCount];
+    static const uint16_t cHIDAxisMax[cHIDAxisCount];
+
+    explicit SimulatedCougar(const SimulatedCougarConfig &config = SimulatedCougarConfig(),
+                             const std::string &portPath = "sim-1");
+    ~SimulatedCougar();
+
+    void Open() override;
+    void Close() override;
+    bool IsOpen() const override { return open; }
+
+    const std::string& PortPath() const override { return portPath; }
+
+    void Reconnect(std::chrono::milliseconds timeout) override;
+    void ExpectReconnect() override { reconnectExpected = true; }
+    bool TryReconnect() override;
+
+    void ClaimInterface(int interfaceNum) override;
+    void ReleaseInterface(int interfaceNum) override;
+
+    size_t MaxPacketSize(int) override { return cPacketSize; }
+    void ClearHalt(int endpoint) override;
+
+    // Timeouts are not modelled, transfers only time out by fault injection
+    void WriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint,
+                     std::chrono::milliseconds timeout) override;
+    size_t ReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                      std::chrono::milliseconds timeout) override;
+
+    std::future<size_t> SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint,
+                                          std::chrono::milliseconds timeout) override;
+    std::future<std::vector<unsigned char>> SubmitReadBulkEP(size_t readSize, int endpoint,
+                                                             std::chrono::milliseconds timeout) override;
+    std::future<size_t> SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                         std::chrono::milliseconds timeout) override;
+    std::future<size_t> SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                          std::chrono::milliseconds timeout) override;
+
+    // Nothing is ever left in flight
+    void CancelTransfers() override {}
+
+    size_t ReadInterfaceDescriptor(int interfaceNum, unsigned char type, unsigned char *buffer, size_t size) override;
+
+    void StartInterruptIn(int endpoint, size_t reportSize, ReportCallback onReport) override;
+    void StopInterruptIn() override;
+
+    // Device state, as would be held in flash/RAM
+    unsigned char Options() const { return profile[0]; }
+    const std::array<unsigned char, cProfileDataSizeBytes>& Profile() const { return profile; }
+    const std::vector<unsigned char>& TMJ() const { return tmj; }
+    const std::vector<unsigned char>& Firmware() const { return firmware; }
+
+    size_t ResetCount() const { return resetCount; }
+    size_t CommandCount() const { return commandCount; }
+    size_t BytesWritten() const { return bytesWritten; }
+    size_t ReportCount() const { return reportCount; }
+    size_t ClearHaltCount() const { return clearHaltCount; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void Delay(size_t bytes);
+    // accepted is the bytes of this call already taken by the device
+    void CheckTransfer(int endpoint, size_t accepted);
+    void HandleCommand(const unsigned char *data, size_t size);
+    void BeginReset();
+
+    // Current handle still usable, false once a reset has dropped the device off
+    bool Present() const;
+
+    SimulatedCougarConfig config;
+    std::string portPath;
+
+    bool open = false;
+    bool resetPending = false;
+    bool reconnectExpected = false;
+    Clock::time_point resetTime;
+    std::unordered_set<int> claimedInterfaces;
+    std::unordered_set<int> haltedEndpoints;
+
+    std::array<unsigned char, cProfileDataSizeBytes> profile{};
+    std::vector<unsigned char> tmj;
+    std::vector<unsigned char> firmware;
+
+    // Queued response to 04 01
+    std::vector<unsigned char> response;
+
+    // Command received so far, awaiting a short packet
+    std::vector<unsigned char> partial;
+
+    std::thread reportThread;
+    std::atomic<bool> reportStop{false};
+    std::atomic<size_t> reportCount{0};
+
+    size_t transferCount = 0;
+    size_t resetCount = 0;
+    size_t commandCount = 0;
+    size_t bytesWritten = 0;
+    size_t clearHaltCount = 0;
+};
+
+#endif // SIMCOUGAR_H
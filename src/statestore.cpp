@@ -0,0 +1,188 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "statestore.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <crypto++/sha.h>
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+
+std::string ContentHash(const unsigned char *data, size_t size)
+{
+    static const char cHexDigits[] = "0123456789abcdef";
+
+    unsigned char digest[CryptoPP::SHA256::DIGESTSIZE];
+    CryptoPP::SHA256().CalculateDigest(digest, data, size);
+
+    std::string hex;
+    hex.reserve(sizeof(digest) * 2);
+    for (unsigned char byte : digest)
+    {
+        hex += cHexDigits[byte >> 4];
+        hex += cHexDigits[byte & 0x0f];
+    }
+
+    return hex;
+}
+
+void ReplaceFile(const std::string &filename, const unsigned char *data, size_t size)
+{
+    std::string temp_filename = filename + ".XXXXXX";
+
+    int fd = mkostemp(&temp_filename[0], O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Unable to create temporary file for " + filename + ": " + std::strerror(errno));
+
+    // mkstemp creates the file private to its owner
+    bool written = fchmod(fd, 0644) == 0;
+    while (written && size > 0)
+    {
+        ssize_t count = write(fd, data, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+
+        written = count > 0;
+        if (written)
+        {
+            data += count;
+            size -= count;
+        }
+    }
+
+    if (close(fd) != 0 || ! written)
+    {
+        int error = errno;
+        unlink(temp_filename.c_str());
+        throw std::runtime_error("Unable to write " + temp_filename + ": " + std::strerror(error));
+    }
+
+    if (std::rename(temp_filename.c_str(), filename.c_str()) != 0)
+    {
+        int error = errno;
+        unlink(temp_filename.c_str());
+        throw std::runtime_error("Unable to replace " + filename + ": " + std::strerror(error));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// DeviceStateStore
+//////////////////////////////////////////////////////////////////////
+
+DeviceStateStore::DeviceStateStore(const std::string &filename) : filename(filename)
+{
+    std::ifstream file(filename);
+    if (! file.is_open())
+        return;
+
+    // One "<device> <kind> <hash> <identity>" entry per line. Entries from
+    // before identities were recorded cannot be trusted and are dropped.
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string device, kind, hash, identity;
+
+        if (fields >> device >> kind >> hash >> identity)
+            entries[{device, kind}] = {hash, identity};
+    }
+}
+
+std::string DeviceStateStore::Get(const std::string &device, const std::string &kind,
+                                  const std::string &identity) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = entries.find({device, kind});
+    return it == entries.end() || it->second.identity != identity ? std::string() : it->second.hash;
+}
+
+void DeviceStateStore::Set(const std::string &device, const std::string &kind, const std::string &hash,
+                           const std::string &identity)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    entries[{device, kind}] = {hash, identity};
+    Save();
+}
+
+void DeviceStateStore::Clear(const std::string &device, const std::string &kind)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (entries.erase({device, kind}) != 0)
+        Save();
+}
+
+void DeviceStateStore::Reidentify(const std::string &device, const std::string &from, const std::string &to)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    bool changed = false;
+    for (auto it = entries.lower_bound({device, ""}); it != entries.end() && it->first.first == device; ++it)
+    {
+        if (it->second.identity == from && from != to)
+        {
+            it->second.identity = to;
+            changed = true;
+        }
+    }
+
+    if (changed)
+        Save();
+}
+
+void DeviceStateStore::Save() const
+{
+    // Create the state directory on first use
+    auto slash = filename.find_last_of('/');
+    if (slash != std::string::npos && slash != 0)
+    {
+        if (mkdir(filename.substr(0, slash).c_str(), 0755) != 0 && errno != EEXIST)
+            throw std::runtime_error("Unable to create state directory for " + filename);
+    }
+
+    std::ostringstream contents;
+    for (const auto &entry : entries)
+    {
+        contents << entry.first.first << " " << entry.first.second << " " << entry.second.hash
+                 << " " << entry.second.identity << "\n";
+    }
+
+    auto text = contents.str();
+    ReplaceFile(filename, reinterpret_cast<const unsigned char*>(text.data()), text.size());
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,92 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATESTORE_H
+#define STATESTORE_H
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace CougarDevice {
+
+const std::string cDefaultStateFile{ "/var/lib/cougar-util/state" };
+
+// Hex encoded SHA-256 of data
+std::string ContentHash(const unsigned char *data, size_t size);
+
+// Replace filename with data through a uniquely named temporary file in the
+// same directory, so neither an interrupted write nor a concurrent writer can
+// leave it truncated or mixed
+void ReplaceFile(const std::string &filename, const unsigned char *data, size_t size);
+
+//////////////////////////////////////////////////////////////////////
+// DeviceStateStore
+//////////////////////////////////////////////////////////////////////
+
+// Persistent record of content last flashed to each device, for data
+// that cannot be read back from the Cougar (e.g TMJ binaries). Devices
+// are keyed by port path, and each value is recorded with the identity
+// of the device it was flashed to (see ProfileIdentity) so another
+// Cougar later plugged into the same port is never taken for it. Safe
+// for concurrent use by fleet workers.
+class DeviceStateStore
+{
+public:
+    // Missing file is treated as an empty store
+    explicit DeviceStateStore(const std::string &filename);
+
+    // Empty string if nothing recorded, or if recorded for another identity
+    std::string Get(const std::string &device, const std::string &kind, const std::string &identity) const;
+
+    // Records and immediately persists the new value
+    void Set(const std::string &device, const std::string &kind, const std::string &hash,
+             const std::string &identity);
+
+    // Forgets the value, e.g ahead of a write that may fail part way
+    void Clear(const std::string &device, const std::string &kind);
+
+    // Moves every value recorded for device under identity from to identity
+    // to, e.g once a new profile is written leaving its TMJ in place
+    void Reidentify(const std::string &device, const std::string &from, const std::string &to);
+
+private:
+    void Save() const;
+
+    std::string filename;
+
+    struct Entry
+    {
+        std::string hash;
+        std::string identity;
+    };
+
+    mutable std::mutex mutex;
+    std::map<std::pair<std::string, std::string>, Entry> entries;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // STATESTORE_H
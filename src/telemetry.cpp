@@ -0,0 +1,167 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "telemetry.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CougarDevice {
+
+static const size_t cTelemetrySize = sizeof(TelemetryHeader) + cTelemetrySlots * sizeof(TelemetrySlot);
+
+static int64_t MonotonicNs()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+static std::runtime_error SystemError(const std::string &what)
+{
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+//////////////////////////////////////////////////////////////////////
+// TelemetryWriter
+//////////////////////////////////////////////////////////////////////
+
+// Process that created an existing feed, 0 if unknown
+static pid_t FeedWriterPid(const std::string &name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return 0;
+
+    struct stat info;
+    pid_t pid = 0;
+    if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(TelemetryHeader))
+    {
+        void *mapping = mmap(nullptr, sizeof(TelemetryHeader), PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            pid = static_cast<const TelemetryHeader*>(mapping)->writerPid;
+            munmap(mapping, sizeof(TelemetryHeader));
+        }
+    }
+
+    close(fd);
+    return pid;
+}
+
+TelemetryWriter::TelemetryWriter(const std::string &name) : name(name)
+{
+    fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+
+    // Only a feed left behind by a writer that did not exit cleanly is replaced,
+    // never one that live readers may be following
+    if (fd < 0 && errno == EEXIST)
+    {
+        pid_t pid = FeedWriterPid(name);
+        if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM))
+            throw std::runtime_error("Telemetry feed " + name + " is in use by process " + std::to_string(pid));
+
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+    }
+
+    if (fd < 0)
+        throw SystemError("Unable to create shared memory " + name);
+
+    if (ftruncate(fd, cTelemetrySize) != 0)
+    {
+        auto error = SystemError("Unable to size shared memory " + name);
+        close(fd);
+        shm_unlink(name.c_str());
+        throw error;
+    }
+
+    mapping = mmap(nullptr, cTelemetrySize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        auto error = SystemError("Unable to map shared memory " + name);
+        close(fd);
+        shm_unlink(name.c_str());
+        throw error;
+    }
+
+    // Freshly truncated memory is zeroed, a valid empty ring. Owner recorded at
+    // once so a second writer finds it even before Setup.
+    header = new (mapping) TelemetryHeader();
+    header->writerPid = static_cast<int32_t>(getpid());
+    slots = reinterpret_cast<TelemetrySlot*>(static_cast<unsigned char*>(mapping) + sizeof(TelemetryHeader));
+}
+
+TelemetryWriter::~TelemetryWriter()
+{
+    munmap(mapping, cTelemetrySize);
+    close(fd);
+    shm_unlink(name.c_str());
+}
+
+void TelemetryWriter::Setup(const std::vector<uint16_t> &axisUsages, size_t buttonCount)
+{
+    if (axisUsages.size() > cTelemetryMaxAxes || buttonCount > 64)
+        throw std::runtime_error("Too many axes or buttons for telemetry");
+
+    header->version = cTelemetryVersion;
+    header->slotCount = cTelemetrySlots;
+    header->axisCount = static_cast<uint32_t>(axisUsages.size());
+    header->buttonCount = static_cast<uint32_t>(buttonCount);
+    header->writerPid = static_cast<int32_t>(getpid());
+    std::copy(axisUsages.begin(), axisUsages.end(), header->axisUsages);
+
+    // Readers check the magic before anything else
+    std::atomic_thread_fence(std::memory_order_release);
+    reinterpret_cast<std::atomic<uint32_t>*>(&header->magic)->store(cTelemetryMagic, std::memory_order_release);
+}
+
+void TelemetryWriter::Publish(const int32_t *axes, uint64_t buttons)
+{
+    uint64_t sequence = ++published;
+    TelemetrySlot &slot = slots[(sequence - 1) % cTelemetrySlots];
+
+    uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.state.sequence = sequence;
+    slot.state.timeNs = MonotonicNs();
+    std::memcpy(slot.state.axes, axes, header->axisCount * sizeof(int32_t));
+    slot.state.buttons = buttons;
+
+    slot.seq.store(seq + 2, std::memory_order_release);
+    header->published.store(sequence, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,95 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "remap.h"
+#include "telemetryfeed.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// TelemetryWriter
+//////////////////////////////////////////////////////////////////////
+
+// Creates the shared memory object and publishes input state into it. The
+// object is removed when the writer is destroyed.
+class TelemetryWriter : public JoystickSink
+{
+public:
+    // name as for shm_open, e.g "/cougar-util"
+    explicit TelemetryWriter(const std::string &name);
+    ~TelemetryWriter();
+
+    TelemetryWriter(const TelemetryWriter&) = delete;
+    TelemetryWriter& operator=(const TelemetryWriter&) = delete;
+
+    void Setup(const std::vector<uint16_t> &axisUsages, size_t buttonCount) override;
+    void Publish(const int32_t *axes, uint64_t buttons) override;
+
+private:
+    std::string name;
+    int fd = -1;
+    void *mapping = nullptr;
+
+    TelemetryHeader *header = nullptr;
+    TelemetrySlot *slots = nullptr;
+    uint64_t published = 0;
+};
+
+//////////////////////////////////////////////////////////////////////
+// JoystickTee
+//////////////////////////////////////////////////////////////////////
+
+// Publishes to two sinks, e.g a uinput joystick and telemetry
+class JoystickTee : public JoystickSink
+{
+public:
+    JoystickTee(JoystickSink &first, JoystickSink &second) : first(first), second(second) {}
+
+    void Setup(const std::vector<uint16_t> &axisUsages, size_t buttonCount) override
+    {
+        first.Setup(axisUsages, buttonCount);
+        second.Setup(axisUsages, buttonCount);
+    }
+
+    void Publish(const int32_t *axes, uint64_t buttons) override
+    {
+        first.Publish(axes, buttons);
+        second.Publish(axes, buttons);
+    }
+
+private:
+    JoystickSink &first;
+    JoystickSink &second;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // TELEMETRY_H
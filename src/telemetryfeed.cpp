@@ -0,0 +1,155 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "telemetryfeed.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CougarDevice {
+
+// A publish takes well under a microsecond, a slot still odd after this many
+// reads belongs to a writer that stopped part way
+static const unsigned cMaxReadRetries = 100000;
+
+// Latest retries when lapped by the writer, which needs the reader descheduled
+static const unsigned cMaxLatestAttempts = 8;
+
+static std::runtime_error SystemError(const std::string &what)
+{
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+//////////////////////////////////////////////////////////////////////
+// TelemetryReader
+//////////////////////////////////////////////////////////////////////
+
+TelemetryReader::TelemetryReader(const std::string &name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        throw SystemError("Unable to open shared memory " + name);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(TelemetryHeader))
+    {
+        close(fd);
+        throw std::runtime_error(name + " is not a Cougar telemetry feed");
+    }
+
+    size = static_cast<size_t>(info.st_size);
+    mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+        throw SystemError("Unable to map shared memory " + name);
+
+    header = static_cast<const TelemetryHeader*>(mapping);
+    slots = reinterpret_cast<const TelemetrySlot*>(static_cast<const unsigned char*>(mapping) + sizeof(TelemetryHeader));
+
+    auto magic = reinterpret_cast<const std::atomic<uint32_t>*>(&header->magic)->load(std::memory_order_acquire);
+    slotCount = header->slotCount;
+
+    // Bounded first so the size check cannot overflow
+    if (magic != cTelemetryMagic || header->version != cTelemetryVersion ||
+        slotCount == 0 || slotCount > cTelemetryMaxSlots || header->axisCount > cTelemetryMaxAxes ||
+        size < sizeof(TelemetryHeader) + static_cast<uint64_t>(slotCount) * sizeof(TelemetrySlot))
+    {
+        munmap(const_cast<void*>(mapping), size);
+        throw std::runtime_error(name + " is not a compatible Cougar telemetry feed, or is still starting");
+    }
+}
+
+TelemetryReader::~TelemetryReader()
+{
+    munmap(const_cast<void*>(mapping), size);
+}
+
+bool TelemetryReader::ReadSlot(uint64_t sequence, TelemetryState &state) const
+{
+    const TelemetrySlot &slot = slots[(sequence - 1) % slotCount];
+
+    for (unsigned retry = 0; retry < cMaxReadRetries; retry++)
+    {
+        uint32_t before = slot.seq.load(std::memory_order_acquire);
+        if (before & 1)
+            continue;
+
+        std::memcpy(&state, &slot.state, sizeof(state));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) == before)
+            return state.sequence == sequence;
+    }
+
+    return false;
+}
+
+bool TelemetryReader::Latest(TelemetryState &state) const
+{
+    for (unsigned attempt = 0; attempt < cMaxLatestAttempts; attempt++)
+    {
+        uint64_t published = header->published.load(std::memory_order_acquire);
+        if (published == 0)
+            return false;
+
+        // The writer can only have lapped us if we were descheduled mid read
+        if (ReadSlot(published, state))
+            return true;
+    }
+
+    return false;
+}
+
+size_t TelemetryReader::ReadSince(uint64_t &next, TelemetryState *out, size_t max)
+{
+    uint64_t published = header->published.load(std::memory_order_acquire);
+    size_t count = 0;
+
+    while (next < published && count < max)
+    {
+        // Oldest that may still be intact
+        uint64_t oldest = published >= slotCount ? published - slotCount + 1 : 1;
+        if (next + 1 < oldest)
+        {
+            lost += oldest - (next + 1);
+            next = oldest - 1;
+        }
+
+        if (ReadSlot(next + 1, out[count]))
+            count++;
+        else
+            lost++;
+        next++;
+    }
+
+    return count;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
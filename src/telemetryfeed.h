@@ -0,0 +1,126 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TELEMETRYFEED_H
+#define TELEMETRYFEED_H
+
+// Reader side of the --telemetry feed. Needs only the standard library, link
+// src/telemetryfeed.cpp (or libcougar-telemetry.a) without the USB stack.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// Shared Memory Layout
+//////////////////////////////////////////////////////////////////////
+
+// POSIX shared memory object holding a header followed by a ring of slots.
+// Each slot is guarded by its own seqlock: odd while being written, readers
+// retry until they copy a slot with the same even sequence before and after.
+// Readers never write to the mapping so any number may attach.
+
+const uint32_t cTelemetryMagic = 0x31544743;     // "CGT1"
+const uint32_t cTelemetryVersion = 1;
+const size_t cTelemetryMaxAxes = 16;
+const size_t cTelemetrySlots = 1024;              // About a second at 1 kHz
+const size_t cTelemetryMaxSlots = 1 << 20;        // Readers reject larger rings
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "Shared memory atomics must be lock free to be address free");
+
+struct TelemetryState
+{
+    uint64_t sequence;                      // Report number, 1 for the first
+    int64_t timeNs;                         // CLOCK_MONOTONIC, comparable across processes
+    int32_t axes[cTelemetryMaxAxes];        // -32767 to 32767
+    uint64_t buttons;                       // Bit n is button n
+};
+
+struct TelemetryHeader
+{
+    uint32_t magic;                         // Written last, once the header is complete
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t axisCount;
+    uint32_t buttonCount;
+    int32_t writerPid;
+    uint16_t axisUsages[cTelemetryMaxAxes]; // HID generic desktop usage of each axis
+
+    alignas(64) std::atomic<uint64_t> published;
+};
+
+struct alignas(64) TelemetrySlot
+{
+    std::atomic<uint32_t> seq;
+    TelemetryState state;
+};
+
+//////////////////////////////////////////////////////////////////////
+// TelemetryReader
+//////////////////////////////////////////////////////////////////////
+
+// Read only view of a writer's feed. Reads are plain loads from the mapping,
+// no system calls once attached. Not thread safe, use one reader per thread.
+class TelemetryReader
+{
+public:
+    // Throws if name does not exist or is not a compatible feed
+    explicit TelemetryReader(const std::string &name);
+    ~TelemetryReader();
+
+    TelemetryReader(const TelemetryReader&) = delete;
+    TelemetryReader& operator=(const TelemetryReader&) = delete;
+
+    const TelemetryHeader& Header() const { return *header; }
+
+    // Most recent state, false if nothing has been published yet or the
+    // writer stalled (e.g crashed) part way through publishing it
+    bool Latest(TelemetryState &state) const;
+
+    // Every state after sequence next in order, up to max. Advances next. States
+    // overwritten before being read are skipped and counted in Lost().
+    size_t ReadSince(uint64_t &next, TelemetryState *out, size_t max);
+
+    uint64_t Lost() const { return lost; }
+
+private:
+    // Seqlock read of the slot for sequence, false if overwritten meanwhile or
+    // still mid write after a bounded number of retries
+    bool ReadSlot(uint64_t sequence, TelemetryState &state) const;
+
+    size_t size = 0;
+    uint32_t slotCount = 0;     // Validated copy, the mapping is not trusted
+    const void *mapping = nullptr;
+
+    const TelemetryHeader *header = nullptr;
+    const TelemetrySlot *slots = nullptr;
+    uint64_t lost = 0;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // TELEMETRYFEED_H
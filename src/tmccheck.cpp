@@ -0,0 +1,128 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tmccheck.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <dirent.h>
+
+#include "cougardevice.h"
+#include "mappedfile.h"
+#include "statestore.h"
+#include "tmcview.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+
+static bool IsTmcFile(const std::string &name)
+{
+    if (name.size() <= 4)
+        return false;
+
+    std::string extension = name.substr(name.size() - 4);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    return extension == ".tmc";
+}
+
+static std::vector<std::string> ListTmcFiles(const std::string &directory)
+{
+    DIR *dir = opendir(directory.c_str());
+    if (! dir)
+        throw std::runtime_error("Unable to open directory " + directory + ": " + std::strerror(errno));
+
+    std::vector<std::string> filenames;
+    while (dirent *entry = readdir(dir))
+    {
+        if (IsTmcFile(entry->d_name))
+            filenames.push_back(directory + "/" + entry->d_name);
+    }
+
+    closedir(dir);
+
+    std::sort(filenames.begin(), filenames.end());
+
+    return filenames;
+}
+
+static void CheckTmcFile(TmcReport &report, const TmcView &defaults)
+{
+    MappedFile file(report.filename);
+    if (file.Size() != cTmcSizeBytes)
+        throw std::runtime_error("Profile is " + std::to_string(file.Size()) + " bytes. Required " +
+                                 std::to_string(cTmcSizeBytes) + " bytes.");
+
+    TmcView view(file.Data(), file.Size());
+    view.Validate();
+
+    report.fingerprint = ContentHash(file.Data(), file.Size());
+    report.changes = DiffTmc(view, defaults);
+    report.valid = true;
+}
+
+std::vector<TmcReport> CheckTmcDirectory(const std::string &directory, size_t maxWorkers)
+{
+    auto filenames = ListTmcFiles(directory);
+    TmcView defaults(DefaultProfileData());
+
+    std::vector<TmcReport> reports(filenames.size());
+    std::atomic<size_t> next{0};
+
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < filenames.size(); i = next++)
+        {
+            TmcReport &report = reports[i];
+            report.filename = filenames[i];
+
+            try
+            {
+                CheckTmcFile(report, defaults);
+            }
+            catch (const std::exception &e)
+            {
+                report.error = e.what();
+            }
+        }
+    };
+
+    size_t workerCount = std::min(std::max<size_t>(maxWorkers, 1), filenames.size());
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < workerCount; i++)
+        workers.emplace_back(worker);
+
+    for (auto &thread : workers)
+        thread.join();
+
+    return reports;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,54 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TMCCHECK_H
+#define TMCCHECK_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+
+struct TmcReport
+{
+    std::string filename;
+    bool valid = false;
+    std::string error;
+
+    // SHA-256 of the profile
+    std::string fingerprint;
+
+    // Regions differing from the built in default profile
+    std::vector<std::string> changes;
+};
+
+// Validate, fingerprint and diff every .tmc file in directory using up to
+// maxWorkers threads. Reports are sorted by filename.
+std::vector<TmcReport> CheckTmcDirectory(const std::string &directory, size_t maxWorkers);
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // TMCCHECK_H
@@ -0,0 +1,105 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tmcview.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+
+TmcView::TmcView(const unsigned char *data, size_t size)
+    : data(data)
+{
+    if (size < cTmcSizeBytes)
+        throw std::runtime_error("Profile is " + std::to_string(size) + " bytes. Required " +
+                                 std::to_string(cTmcSizeBytes) + " bytes.");
+}
+
+unsigned char TmcView::AxisMapping(size_t axis) const
+{
+    if (axis >= cTmcAxisCount)
+        throw std::out_of_range("Axis " + std::to_string(axis) + " out of range");
+
+    return data[cTmcAxisMap.offset + axis];
+}
+
+void TmcView::Validate() const
+{
+    if (Header() != cTmcUploadOpcode)
+    {
+        char header[8];
+        std::snprintf(header, sizeof(header), "%02x", Header());
+        throw std::runtime_error(std::string("Invalid TMC header ") + header);
+    }
+
+    bool mapped[cTmcAxisCount + 1] = {};
+    for (size_t axis = 0; axis < cTmcAxisCount; axis++)
+    {
+        unsigned char logical = AxisMapping(axis);
+        if (logical > cTmcAxisCount)
+            throw std::runtime_error("Axis " + std::to_string(axis) + " mapped to invalid axis " + std::to_string(logical));
+
+        if (logical != 0 && mapped[logical])
+            throw std::runtime_error("Axis " + std::to_string(logical) + " mapped more than once");
+
+        mapped[logical] = true;
+    }
+
+    if (WindowsAxisFlag() != cTmcWindowsAxisOn && WindowsAxisFlag() != cTmcWindowsAxisOff)
+        throw std::runtime_error("Invalid windows axis flag " + std::to_string(WindowsAxisFlag()));
+}
+
+//////////////////////////////////////////////////////////////////////
+
+std::vector<std::string> DiffTmc(const TmcView &a, const TmcView &b)
+{
+    std::vector<std::string> regions;
+    bool other = false;
+    size_t offset = cTmcHeader.offset + cTmcHeader.size;
+
+    for (const auto &region : cTmcRegions)
+    {
+        if (region.offset < offset)
+            continue;
+
+        // Gap ahead of this region
+        other = other || ! std::equal(a.Data() + offset, a.Data() + region.offset, b.Data() + offset);
+
+        if (! std::equal(a.Region(region), a.Region(region) + region.size, b.Region(region)))
+            regions.push_back(region.name);
+
+        offset = region.offset + region.size;
+    }
+
+    other = other || ! std::equal(a.Data() + offset, a.Data() + cTmcSizeBytes, b.Data() + offset);
+    if (other)
+        regions.push_back("other");
+
+    return regions;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,129 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TMCVIEW_H
+#define TMCVIEW_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "cougardevice.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// TMC Layout
+//////////////////////////////////////////////////////////////////////
+
+const size_t cTmcAxisCount = 10;
+
+// Byte 0 of a TMC file, replaced by the active options in the 04 01 readback
+const unsigned char cTmcUploadOpcode = static_cast<unsigned char>(Opcode::UploadProfile);
+
+const unsigned char cTmcWindowsAxisOn  = 0x00;
+const unsigned char cTmcWindowsAxisOff = 0xff;
+
+struct TmcRegion
+{
+    const char *name;
+    size_t offset;
+    size_t size;
+};
+
+// Only the axis map and Windows axis flag are fully understood. Remaining
+// regions were identified by comparing profiles saved from HOTAS CCP and
+// are exposed as raw bytes.
+constexpr TmcRegion cTmcHeader      {"header",             0,   1};
+constexpr TmcRegion cTmcAxisMap     {"axis map",           2,   cTmcAxisCount};
+constexpr TmcRegion cTmcCalibration {"manual calibration", 13,  48};
+constexpr TmcRegion cTmcCurves      {"curves",             72,  cTmcAxisCount * 4};
+constexpr TmcRegion cTmcDeadzones   {"deadzones",          112, 16};
+constexpr TmcRegion cTmcWindowsAxis {"windows axis",       168, 1};
+
+// In file order
+constexpr TmcRegion cTmcRegions[] = {
+    cTmcHeader, cTmcAxisMap, cTmcCalibration, cTmcCurves, cTmcDeadzones, cTmcWindowsAxis
+};
+
+constexpr bool TmcLayoutValid()
+{
+    size_t end = 0;
+    for (const auto &region : cTmcRegions)
+    {
+        if (region.size == 0 || region.offset < end)
+            return false;
+        end = region.offset + region.size;
+    }
+
+    return end <= cTmcSizeBytes;
+}
+
+static_assert(TmcLayoutValid(), "TMC regions must be ordered, non-overlapping and within a TMC");
+static_assert(cTmcWindowsAxis.offset == 168, "Windows axis flag moved, 04 01 readback relies on it");
+
+//////////////////////////////////////////////////////////////////////
+// TmcView
+//////////////////////////////////////////////////////////////////////
+
+// Typed overlay of a TMC file or 04 01 profile readback. Does not copy, the
+// underlying data must outlive the view.
+class TmcView
+{
+public:
+    // Throws if size is too small to hold a TMC
+    TmcView(const unsigned char *data, size_t size);
+    explicit TmcView(const std::vector<unsigned char> &data) : TmcView(data.data(), data.size()) {}
+
+    const unsigned char* Data() const { return data; }
+
+    // Upload opcode in a TMC file, active options in device readback
+    unsigned char Header() const { return data[cTmcHeader.offset]; }
+    CougarOptions Options() const { return static_cast<CougarOptions>(Header()); }
+
+    // Logical axis assigned to each physical axis, 0 when unused
+    unsigned char AxisMapping(size_t axis) const;
+
+    // Raw bytes, Region(r) is r.size bytes long
+    const unsigned char* Region(const TmcRegion &region) const { return data + region.offset; }
+    const unsigned char* Calibration() const { return Region(cTmcCalibration); }
+    const unsigned char* Curves() const { return Region(cTmcCurves); }
+    const unsigned char* Deadzones() const { return Region(cTmcDeadzones); }
+
+    // Changing this requires a device reset to apply
+    unsigned char WindowsAxisFlag() const { return data[cTmcWindowsAxis.offset]; }
+    bool WindowsAxis() const { return WindowsAxisFlag() == cTmcWindowsAxisOn; }
+
+    // Checks a TMC file (not readback) is plausible for upload, throws describing the first problem
+    void Validate() const;
+
+private:
+    const unsigned char *data;
+};
+
+// Names of regions that differ, ignoring the header. Bytes outside any known region report as "other".
+std::vector<std::string> DiffTmc(const TmcView &a, const TmcView &b);
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // TMCVIEW_H
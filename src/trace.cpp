@@ -0,0 +1,178 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "trace.h"
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+//////////////////////////////////////////////////////////////////////
+// TraceLog
+//////////////////////////////////////////////////////////////////////
+
+TraceLog::TraceLog() : origin(Clock::now())
+{
+}
+
+TraceLog& TraceLog::Global()
+{
+    static TraceLog trace;
+    return trace;
+}
+
+int64_t TraceLog::Micros(Clock::time_point time) const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - origin).count();
+}
+
+uint32_t TraceLog::ThreadID()
+{
+    // Small stable numbers keep tracks in creation order
+    static std::atomic<uint32_t> nextID{1};
+    thread_local uint32_t id = nextID++;
+
+    return id;
+}
+
+void TraceLog::Complete(const char *name, const char *category, Clock::time_point start, Clock::time_point end,
+                        const std::string &args)
+{
+    Event event{name, category, 'X', ThreadID(), 0, Micros(start), Micros(end) - Micros(start), args};
+
+    std::lock_guard<std::mutex> lock(eventsMutex);
+    events.push_back(std::move(event));
+}
+
+void TraceLog::Async(const char *name, const char *category, Clock::time_point start, Clock::time_point end,
+                     const std::string &args)
+{
+    uint64_t id = nextAsyncID++;
+    Event begin{name, category, 'b', ThreadID(), id, Micros(start), 0, args};
+    Event finish{name, category, 'e', begin.tid, id, Micros(end), 0, ""};
+
+    std::lock_guard<std::mutex> lock(eventsMutex);
+    events.push_back(std::move(begin));
+    events.push_back(std::move(finish));
+}
+
+void TraceLog::NameThread(const std::string &name)
+{
+    if (! Enabled())
+        return;
+
+    Event event{"thread_name", "__metadata", 'M', ThreadID(), 0, 0, 0, "\"name\":" + TraceString(name)};
+
+    std::lock_guard<std::mutex> lock(eventsMutex);
+    events.push_back(std::move(event));
+}
+
+void TraceLog::WriteFile(const std::string &filename) const
+{
+    std::ofstream file(filename, std::ios::trunc);
+    if (! file.is_open())
+        throw std::runtime_error("Unable to create trace file " + filename);
+
+    int pid = static_cast<int>(getpid());
+
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+         << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":0,\"args\":{\"name\":\"cougar-util\"}}";
+
+    std::lock_guard<std::mutex> lock(eventsMutex);
+    for (const auto &event : events)
+    {
+        file << ",\n{\"name\":" << TraceString(event.name) << ",\"cat\":\"" << event.category
+             << "\",\"ph\":\"" << event.phase << "\",\"pid\":" << pid << ",\"tid\":" << event.tid
+             << ",\"ts\":" << event.timestamp;
+
+        if (event.phase == 'X')
+            file << ",\"dur\":" << event.duration;
+        if (event.id != 0)
+            file << ",\"id\":" << event.id;
+
+        file << ",\"args\":{" << event.args << "}}";
+    }
+
+    file << "\n]}\n";
+
+    if (! file.good())
+        throw std::runtime_error("Unable to write trace file " + filename);
+}
+
+//////////////////////////////////////////////////////////////////////
+// TraceSpan
+//////////////////////////////////////////////////////////////////////
+
+TraceSpan::TraceSpan(const char *name, const char *category)
+    : name(name), category(category), active(TraceLog::Global().Enabled())
+{
+    if (active)
+        start = TraceLog::Clock::now();
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (active)
+        TraceLog::Global().Complete(name, category, start, TraceLog::Clock::now(), args);
+}
+
+void TraceSpan::Arg(const char *key, const std::string &value)
+{
+    if (! active)
+        return;
+
+    args += (args.empty() ? "\"" : ",\"") + std::string(key) + "\":" + TraceString(value);
+}
+
+void TraceSpan::Arg(const char *key, uint64_t value)
+{
+    if (! active)
+        return;
+
+    args += (args.empty() ? "\"" : ",\"") + std::string(key) + "\":" + std::to_string(value);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+std::string TraceString(const std::string &value)
+{
+    std::string quoted = "\"";
+
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else
+            quoted += c;
+    }
+
+    return quoted + "\"";
+}
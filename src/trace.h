@@ -0,0 +1,119 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////
+// TraceLog
+//////////////////////////////////////////////////////////////////////
+
+// Chrome/Perfetto trace-event timeline. Disabled by default, when disabled
+// recording a span costs a single atomic load.
+class TraceLog
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static TraceLog& Global();
+
+    void Enable() { enabled.store(true, std::memory_order_relaxed); }
+    bool Enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    // Span on the calling thread's track. Spans nest by time, args is a
+    // comma separated list of JSON members or empty.
+    void Complete(const char *name, const char *category, Clock::time_point start, Clock::time_point end,
+                  const std::string &args);
+
+    // Span that may overlap others on the same thread, e.g an in flight transfer
+    void Async(const char *name, const char *category, Clock::time_point start, Clock::time_point end,
+               const std::string &args);
+
+    // Label the calling thread's track
+    void NameThread(const std::string &name);
+
+    // Chrome JSON object format, load in chrome://tracing or ui.perfetto.dev
+    void WriteFile(const std::string &filename) const;
+
+private:
+    struct Event
+    {
+        std::string name;
+        const char *category;
+        char phase;
+        uint32_t tid;
+        uint64_t id;
+        int64_t timestamp;      // us since origin
+        int64_t duration;
+        std::string args;
+    };
+
+    TraceLog();
+
+    int64_t Micros(Clock::time_point time) const;
+    static uint32_t ThreadID();
+
+    std::atomic<bool> enabled{false};
+    std::atomic<uint64_t> nextAsyncID{1};
+    Clock::time_point origin;
+
+    mutable std::mutex eventsMutex;
+    std::vector<Event> events;
+};
+
+//////////////////////////////////////////////////////////////////////
+// TraceSpan
+//////////////////////////////////////////////////////////////////////
+
+// Records a span from construction to destruction when tracing is enabled
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name, const char *category = "cougar");
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    // Shown in the span's detail pane
+    void Arg(const char *key, const std::string &value);
+    void Arg(const char *key, uint64_t value);
+
+private:
+    const char *name;
+    const char *category;
+    bool active;
+    TraceLog::Clock::time_point start;
+    std::string args;
+};
+
+// Quoted and escaped JSON string
+std::string TraceString(const std::string &value);
+
+#endif // TRACE_H
@@ -0,0 +1,165 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "uinputsink.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "cougardevice.h"
+
+namespace CougarDevice {
+
+// Generic desktop usage X (0x30) onwards to evdev absolute axis
+static const struct { uint16_t usage; uint16_t code; } cAxisCodes[] = {
+    {0x30, ABS_X}, {0x31, ABS_Y}, {0x32, ABS_Z}, {0x33, ABS_RX}, {0x34, ABS_RY}, {0x35, ABS_RZ},
+    {0x36, ABS_THROTTLE}, {0x37, ABS_RUDDER}, {0x38, ABS_WHEEL}
+};
+
+// Joystick buttons, then the trigger happy range once those run out
+static uint16_t ButtonCode(size_t button)
+{
+    size_t joystickButtons = BTN_DEAD - BTN_JOYSTICK + 1;
+    return static_cast<uint16_t>(button < joystickButtons ? BTN_JOYSTICK + button
+                                                          : BTN_TRIGGER_HAPPY + (button - joystickButtons));
+}
+
+static void UInputIoctl(int fd, unsigned long request, unsigned long argument, const char *what)
+{
+    if (ioctl(fd, request, argument) < 0)
+        throw std::runtime_error(std::string("uinput ") + what + " failed: " + std::strerror(errno));
+}
+
+//////////////////////////////////////////////////////////////////////
+
+UInputSink::UInputSink(const std::string &name) : name(name)
+{
+    fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error(std::string("Unable to open /dev/uinput: ") + std::strerror(errno));
+}
+
+UInputSink::~UInputSink()
+{
+    if (created)
+        ioctl(fd, UI_DEV_DESTROY);
+
+    close(fd);
+}
+
+void UInputSink::Setup(const std::vector<uint16_t> &axisUsages, size_t buttonCount)
+{
+    if (axisUsages.size() > cMaxAxes || buttonCount > cMaxButtons)
+        throw std::runtime_error("Too many axes or buttons for a virtual joystick");
+
+    UInputIoctl(fd, UI_SET_EVBIT, EV_ABS, "EV_ABS");
+    UInputIoctl(fd, UI_SET_EVBIT, EV_KEY, "EV_KEY");
+
+    for (auto usage : axisUsages)
+    {
+        uint16_t code = ABS_MISC;
+        for (const auto &axis : cAxisCodes)
+            if (axis.usage == usage)
+                code = axis.code;
+
+        uinput_abs_setup abs;
+        std::memset(&abs, 0, sizeof(abs));
+        abs.code = code;
+        abs.absinfo.minimum = cRemapAxisMin;
+        abs.absinfo.maximum = cRemapAxisMax;
+
+        UInputIoctl(fd, UI_SET_ABSBIT, code, "UI_SET_ABSBIT");
+        if (ioctl(fd, UI_ABS_SETUP, &abs) < 0)
+            throw std::runtime_error(std::string("uinput UI_ABS_SETUP failed: ") + std::strerror(errno));
+
+        axisCodes.push_back(code);
+    }
+
+    for (size_t button = 0; button < buttonCount; button++)
+    {
+        buttonCodes.push_back(ButtonCode(button));
+        UInputIoctl(fd, UI_SET_KEYBIT, buttonCodes.back(), "UI_SET_KEYBIT");
+    }
+
+    uinput_setup setup;
+    std::memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor = cCougarVID;
+    setup.id.product = cCougarPID;
+    std::strncpy(setup.name, name.c_str(), UINPUT_MAX_NAME_SIZE - 1);
+
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0)
+        throw std::runtime_error(std::string("uinput UI_DEV_SETUP failed: ") + std::strerror(errno));
+    UInputIoctl(fd, UI_DEV_CREATE, 0, "UI_DEV_CREATE");
+    created = true;
+
+    // Force the first Publish to send every value
+    lastAxes.assign(axisCodes.size(), cRemapAxisMin - 1);
+    lastButtons = ~uint64_t(0);
+}
+
+void UInputSink::Publish(const int32_t *axes, uint64_t buttons)
+{
+    // Every axis, every button and the SYN_REPORT in a single write
+    input_event events[cMaxAxes + cMaxButtons + 1];
+    size_t count = 0;
+
+    auto add = [&](uint16_t type, uint16_t code, int32_t value)
+    {
+        std::memset(&events[count], 0, sizeof(input_event));
+        events[count].type = type;
+        events[count].code = code;
+        events[count].value = value;
+        count++;
+    };
+
+    for (size_t a = 0; a < axisCodes.size(); a++)
+        if (axes[a] != lastAxes[a])
+        {
+            add(EV_ABS, axisCodes[a], axes[a]);
+            lastAxes[a] = axes[a];
+        }
+
+    uint64_t changed = buttons ^ lastButtons;
+    for (size_t b = 0; b < buttonCodes.size(); b++)
+        if (changed & (uint64_t(1) << b))
+            add(EV_KEY, buttonCodes[b], (buttons >> b) & 1);
+    lastButtons = buttons;
+
+    if (count == 0)
+        return;
+
+    add(EV_SYN, SYN_REPORT, 0);
+
+    // Non-blocking, a full queue means nobody is reading and the event is stale anyway
+    ssize_t written = write(fd, events, count * sizeof(input_event));
+    (void)written;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
@@ -0,0 +1,72 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef UINPUTSINK_H
+#define UINPUTSINK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "remap.h"
+
+namespace CougarDevice {
+
+//////////////////////////////////////////////////////////////////////
+// UInputSink
+//////////////////////////////////////////////////////////////////////
+
+// Virtual joystick created through /dev/uinput, requires the uinput module
+// and write access to the device node
+class UInputSink : public JoystickSink
+{
+public:
+    explicit UInputSink(const std::string &name = "Thrustmaster HOTAS Cougar (remapped)");
+    ~UInputSink();
+
+    UInputSink(const UInputSink&) = delete;
+    UInputSink& operator=(const UInputSink&) = delete;
+
+    void Setup(const std::vector<uint16_t> &axisUsages, size_t buttonCount) override;
+    void Publish(const int32_t *axes, uint64_t buttons) override;
+
+private:
+    static const size_t cMaxAxes = 16;
+    static const size_t cMaxButtons = 64;
+
+    std::string name;
+    int fd = -1;
+    bool created = false;
+
+    std::vector<uint16_t> axisCodes;
+    std::vector<uint16_t> buttonCodes;
+
+    // Last published state, only changes are sent
+    std::vector<int32_t> lastAxes;
+    uint64_t lastButtons = 0;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+} // namespace CougarDevice
+
+#endif // UINPUTSINK_H
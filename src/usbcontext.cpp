@@ -0,0 +1,366 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "usbcontext.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <sys/time.h>
+#include <libusb.h>
+
+#include "trace.h"
+
+// Reconnects not seen within this window are assumed to have been missed
+static const std::chrono::seconds cExpectedReconnectWindow{30};
+
+//////////////////////////////////////////////////////////////////////
+
+static int HotplugTrampoline(libusb_context*, libusb_device *device, libusb_hotplug_event event, void *userData)
+{
+    auto &callback = *static_cast<USBContext::HotplugCallback*>(userData);
+    callback(USBContext::PortPath(device), event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+
+    // Remain registered
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+USBContext::USBContext(EventMode mode) : mode(mode)
+{
+    int err;
+    {
+        TraceSpan span("libusb_init", "usb");
+        err = libusb_init(&context);
+    }
+    if (err)
+        throw std::runtime_error(std::string("Failed to initialise libusb. ") + libusb_strerror(static_cast<libusb_error>(err)));
+
+    // Track arrivals of all devices for Reconnect
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+        arrivalCallback = [this](const std::string &portPath, bool)
+        {
+            {
+                std::lock_guard<std::mutex> lock(arrivalMutex);
+                arrivals[portPath]++;
+            }
+            arrivalSeen.notify_all();
+        };
+
+        err = libusb_hotplug_register_callback(context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                                               LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                                               HotplugTrampoline, &arrivalCallback, &arrivalHandle);
+        hotplugArrivals = (err == 0);
+    }
+
+    if (mode == EventMode::Polled)
+        return;
+
+    handleEvents = true;
+
+    eventThread = std::thread([this]()
+    {
+        while (handleEvents)
+        {
+            // Short timeout so a stop request is noticed without needing a wakeup transfer
+            timeval tv{0, 100000};
+            libusb_handle_events_timeout_completed(context, &tv, nullptr);
+        }
+    });
+}
+
+USBContext::~USBContext()
+{
+    for (const auto &hotplug : hotplugCallbacks)
+        libusb_hotplug_deregister_callback(context, hotplug.first);
+
+    if (hotplugArrivals)
+        libusb_hotplug_deregister_callback(context, arrivalHandle);
+
+    handleEvents = false;
+
+    if (eventThread.joinable())
+        eventThread.join();
+
+    libusb_exit(context);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void USBContext::HandleEvents(std::chrono::milliseconds timeout)
+{
+    assert(mode == EventMode::Polled && "HandleEvents called with an event thread running");
+
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+    timeval tv{static_cast<time_t>(us / 1000000), static_cast<suseconds_t>(us % 1000000)};
+
+    libusb_handle_events_timeout_completed(context, &tv, nullptr);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+static std::string UsbfsNode(int bus, int address);
+
+std::vector<USBDeviceNode> USBContext::FindDevices(uint16_t vendorID, uint16_t productID)
+{
+    libusb_device **list;
+
+    ssize_t cnt = libusb_get_device_list(context, &list);
+    if (cnt < 0)
+        throw std::runtime_error(libusb_strerror(static_cast<libusb_error>(cnt)));
+
+    std::vector<USBDeviceNode> nodes;
+
+    for (ssize_t i = 0; i < cnt; i++)
+    {
+        libusb_device_descriptor desc;
+        libusb_get_device_descriptor(list[i], &desc);
+        if (desc.idVendor == vendorID && desc.idProduct == productID)
+        {
+            nodes.push_back({UsbfsNode(libusb_get_bus_number(list[i]), libusb_get_device_address(list[i])),
+                             PortPath(list[i])});
+        }
+    }
+
+    libusb_free_device_list(list, 1);
+
+    return nodes;
+}
+
+std::string USBContext::PortPath(libusb_device *device)
+{
+    // USB 3.0 spec limits hub depth to 7
+    uint8_t ports[7];
+    int depth = libusb_get_port_numbers(device, ports, sizeof(ports));
+
+    std::string path = std::to_string(libusb_get_bus_number(device));
+
+    for (int i = 0; i < depth; i++)
+        path += (i == 0 ? "-" : ".") + std::to_string(ports[i]);
+
+    return path;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Device Nodes
+//////////////////////////////////////////////////////////////////////
+
+static const char cSysfsDevices[] = "/sys/bus/usb/devices";
+
+// -1 if missing
+static int ReadSysfsNumber(const std::string &directory, const char *attribute)
+{
+    std::ifstream file(directory + "/" + attribute);
+    int value = -1;
+    file >> value;
+
+    return file ? value : -1;
+}
+
+static std::string UsbfsNode(int bus, int address)
+{
+    char node[32];
+    std::snprintf(node, sizeof(node), "/dev/bus/usb/%03d/%03d", bus, address);
+
+    return node;
+}
+
+// Sysfs names devices by port path, e.g "1-2.3"
+static USBDeviceNode NodeFromSysfs(const std::string &directory)
+{
+    int bus = ReadSysfsNumber(directory, "busnum");
+    int address = ReadSysfsNumber(directory, "devnum");
+    if (bus < 0 || address < 0)
+        throw std::invalid_argument(directory + " is not a USB device");
+
+    return {UsbfsNode(bus, address), directory.substr(directory.find_last_of('/') + 1)};
+}
+
+static USBDeviceNode NodeFromAddress(int bus, int address)
+{
+    DIR *dir = opendir(cSysfsDevices);
+    if (dir == nullptr)
+        throw std::invalid_argument(std::string("Unable to read ") + cSysfsDevices);
+
+    USBDeviceNode node;
+    while (dirent *entry = readdir(dir))
+    {
+        // Skip interfaces ("1-2:1.0") and root hubs ("usb1")
+        std::string name = entry->d_name;
+        if (name.empty() || ! std::isdigit(static_cast<unsigned char>(name[0])) || name.find(':') != std::string::npos)
+            continue;
+
+        std::string directory = std::string(cSysfsDevices) + "/" + name;
+        if (ReadSysfsNumber(directory, "busnum") == bus && ReadSysfsNumber(directory, "devnum") == address)
+        {
+            node = {UsbfsNode(bus, address), name};
+            break;
+        }
+    }
+
+    closedir(dir);
+
+    if (node.Empty())
+        throw std::invalid_argument("No USB device at " + std::to_string(bus) + ":" + std::to_string(address));
+
+    return node;
+}
+
+USBDeviceNode USBContext::FindDeviceNode(const std::string &spec)
+{
+    int bus = 0;
+    int address = 0;
+    char end;
+
+    if (spec.compare(0, 5, "/sys/") == 0)
+        return NodeFromSysfs(spec.back() == '/' ? spec.substr(0, spec.size() - 1) : spec);
+
+    if (std::sscanf(spec.c_str(), "/dev/bus/usb/%d/%d%c", &bus, &address, &end) == 2 ||
+        std::sscanf(spec.c_str(), "%d:%d%c", &bus, &address, &end) == 2)
+        return NodeFromAddress(bus, address);
+
+    throw std::invalid_argument("Unrecognised device " + spec + ", expected bus:address, a /dev/bus/usb node or sysfs path");
+}
+
+USBDeviceNode USBContext::DeviceNodeFromEnvironment()
+{
+    const char *busnum = std::getenv("BUSNUM");
+    const char *devnum = std::getenv("DEVNUM");
+    const char *devpath = std::getenv("DEVPATH");
+
+    if (busnum == nullptr || devnum == nullptr)
+        return {};
+
+    if (devpath != nullptr)
+        return NodeFromSysfs(std::string("/sys") + devpath);
+
+    return NodeFromAddress(std::atoi(busnum), std::atoi(devnum));
+}
+
+//////////////////////////////////////////////////////////////////////
+// Hotplug
+//////////////////////////////////////////////////////////////////////
+
+int USBContext::RegisterHotplug(uint16_t vendorID, uint16_t productID, HotplugCallback callback, bool enumerate)
+{
+    if (! libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        throw std::runtime_error("Hotplug support not available on this platform");
+
+    std::unique_ptr<HotplugCallback> owned(new HotplugCallback(std::move(callback)));
+
+    // Registration with enumerate invokes the callback immediately for attached devices
+    std::lock_guard<std::mutex> lock(hotplugMutex);
+
+    libusb_hotplug_callback_handle handle;
+    int err = libusb_hotplug_register_callback(context,
+                                               LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                               enumerate ? LIBUSB_HOTPLUG_ENUMERATE : LIBUSB_HOTPLUG_NO_FLAGS,
+                                               vendorID, productID, LIBUSB_HOTPLUG_MATCH_ANY,
+                                               HotplugTrampoline, owned.get(), &handle);
+    if (err)
+        throw std::runtime_error(libusb_strerror(static_cast<libusb_error>(err)));
+
+    hotplugCallbacks[handle] = std::move(owned);
+
+    return handle;
+}
+
+void USBContext::DeregisterHotplug(int handle)
+{
+    std::lock_guard<std::mutex> lock(hotplugMutex);
+
+    auto it = hotplugCallbacks.find(handle);
+    if (it == hotplugCallbacks.end())
+        return;
+
+    libusb_hotplug_deregister_callback(context, handle);
+    hotplugCallbacks.erase(it);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void USBContext::ExpectReconnect(const std::string &portPath)
+{
+    std::lock_guard<std::mutex> lock(reconnectMutex);
+    expectedReconnects[portPath] = std::chrono::steady_clock::now() + cExpectedReconnectWindow;
+}
+
+bool USBContext::ConsumeExpectedReconnect(const std::string &portPath)
+{
+    std::lock_guard<std::mutex> lock(reconnectMutex);
+
+    auto it = expectedReconnects.find(portPath);
+    if (it == expectedReconnects.end())
+        return false;
+
+    bool expected = std::chrono::steady_clock::now() < it->second;
+    expectedReconnects.erase(it);
+
+    return expected;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Arrivals
+//////////////////////////////////////////////////////////////////////
+
+uint64_t USBContext::ArrivalCount(const std::string &portPath)
+{
+    std::lock_guard<std::mutex> lock(arrivalMutex);
+    return arrivals[portPath];
+}
+
+bool USBContext::WaitForArrival(const std::string &portPath, uint64_t arrivalCount, std::chrono::steady_clock::time_point deadline)
+{
+    // Arrivals are only seen while events are handled
+    if (mode == EventMode::Polled)
+    {
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            {
+                std::lock_guard<std::mutex> lock(arrivalMutex);
+                if (hotplugArrivals && arrivals[portPath] > arrivalCount)
+                    return true;
+            }
+
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            HandleEvents(std::max(std::min(remaining, std::chrono::milliseconds(100)), std::chrono::milliseconds(0)));
+        }
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(arrivalMutex);
+
+    if (! hotplugArrivals)
+    {
+        arrivalSeen.wait_until(lock, deadline);
+        return false;
+    }
+
+    return arrivalSeen.wait_until(lock, deadline, [&]() { return arrivals[portPath] > arrivalCount; });
+}
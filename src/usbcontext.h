@@ -0,0 +1,140 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef USBCONTEXT_H
+#define USBCONTEXT_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////
+// Forwards
+//////////////////////////////////////////////////////////////////////
+
+struct libusb_context;
+struct libusb_device;
+
+//////////////////////////////////////////////////////////////////////
+// USBDeviceNode
+//////////////////////////////////////////////////////////////////////
+
+// A specific device, opened directly without enumerating the bus
+struct USBDeviceNode
+{
+    std::string path;       // usbfs node, "/dev/bus/usb/BBB/DDD"
+    std::string portPath;   // As USBContext::PortPath, used to find the device after a reconnect
+
+    bool Empty() const { return path.empty(); }
+};
+
+//////////////////////////////////////////////////////////////////////
+// USBContext
+//////////////////////////////////////////////////////////////////////
+
+// Single libusb session shared by every USBDevice opened from it. Owns
+// the event thread that completes async transfers for all devices, or in
+// polled mode leaves event handling to the owner's own poll loop.
+class USBContext
+{
+public:
+    enum class EventMode { Thread, Polled };
+
+    explicit USBContext(EventMode mode = EventMode::Thread);
+    ~USBContext();
+
+    USBContext(const USBContext&) = delete;
+    USBContext& operator=(const USBContext&) = delete;
+
+    libusb_context* Handle() const { return context; }
+
+    // Polled mode only. Completes transfers and delivers hotplug events, waiting
+    // at most timeout for one. Blocking calls on devices opened from a polled
+    // context handle events themselves while they wait.
+    bool Polled() const { return mode == EventMode::Polled; }
+    void HandleEvents(std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+    // All attached devices matching vid:pid, each ready to open directly
+    std::vector<USBDeviceNode> FindDevices(uint16_t vendorID, uint16_t productID);
+
+    static std::string PortPath(libusb_device *device);
+
+    // spec is "bus:address", a /dev/bus/usb node or a /sys/bus/usb/devices directory.
+    // Only sysfs is read. Throws std::invalid_argument if no such device.
+    static USBDeviceNode FindDeviceNode(const std::string &spec);
+
+    // The device udev passed to a RUN program in DEVPATH, BUSNUM and DEVNUM.
+    // Empty if not run by udev for a USB device.
+    static USBDeviceNode DeviceNodeFromEnvironment();
+
+    // Invoked on the event thread (within HandleEvents when polled), must not block or perform device I/O
+    using HotplugCallback = std::function<void(const std::string &portPath, bool arrived)>;
+
+    // Set enumerate to receive arrival events for already attached devices.
+    // Returns a handle for DeregisterHotplug.
+    int RegisterHotplug(uint16_t vendorID, uint16_t productID, HotplugCallback callback, bool enumerate);
+    void DeregisterHotplug(int handle);
+
+    // Reconnects we trigger ourselves (device reset, firmware upload) are noted
+    // here so hotplug listeners can tell them apart from a user plugging in.
+    void ExpectReconnect(const std::string &portPath);
+    bool ConsumeExpectedReconnect(const std::string &portPath);
+
+    // Number of device arrivals seen on portPath. Snapshot before triggering a
+    // reset and pass to WaitForArrival to wait for the re-enumerated device.
+    uint64_t ArrivalCount(const std::string &portPath);
+
+    // False on timeout. Without hotplug support this simply sleeps until the deadline.
+    bool WaitForArrival(const std::string &portPath, uint64_t arrivalCount, std::chrono::steady_clock::time_point deadline);
+
+    bool HasHotplug() const { return hotplugArrivals; }
+
+private:
+    libusb_context *context = nullptr;
+
+    bool hotplugArrivals = false;
+    int arrivalHandle = 0;
+    HotplugCallback arrivalCallback;
+    std::mutex arrivalMutex;
+    std::condition_variable arrivalSeen;
+    std::unordered_map<std::string, uint64_t> arrivals;
+
+    std::mutex hotplugMutex;
+    std::map<int, std::unique_ptr<HotplugCallback>> hotplugCallbacks;
+
+    std::mutex reconnectMutex;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> expectedReconnects;
+
+    EventMode mode;
+    std::atomic<bool> handleEvents{false};
+    std::thread eventThread;
+};
+
+#endif // USBCONTEXT_H
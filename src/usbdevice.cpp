@@ -21,162 +21,352 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "usbdevice.h"
 
-#include <cassert>
-#include <cstdint>
-#include <stdexcept>
-#include <string>
+#include <algorithm>
+#include <random>
+#include <thread>
 
-#include <libusb.h>
+#include "libusbtransport.h"
+#include "trace.h"
+#include "usbmetrics.h"
+#include "usbrecord.h"
+
+using Clock = std::chrono::steady_clock;
 
 //////////////////////////////////////////////////////////////////////
 
-USBDevice::USBDevice(uint16_t vendorID, uint16_t productID) : vendorID(vendorID), productID(productID)
+USBDevice::USBDevice(uint16_t vendorID, uint16_t productID)
+    : USBDevice(std::make_shared<USBContext>(), vendorID, productID)
+{
+}
+
+USBDevice::USBDevice(std::shared_ptr<USBContext> context, uint16_t vendorID, uint16_t productID, const std::string& portPath)
+    : transport(new LibUSBTransport(std::move(context), vendorID, productID, portPath))
+{
+}
+
+USBDevice::USBDevice(std::shared_ptr<USBContext> context, uint16_t vendorID, uint16_t productID, const USBDeviceNode &node)
+    : transport(new LibUSBTransport(std::move(context), vendorID, productID, node))
+{
+}
+
+USBDevice::USBDevice(std::unique_ptr<USBTransport> transport) : transport(std::move(transport))
 {
-    int err = libusb_init(nullptr);
-    if (err)
-        throw std::runtime_error(std::string("Failed to initialise libusb. ") + libusb_strerror(static_cast<libusb_error>(err)));
 }
 
 USBDevice::~USBDevice()
 {
-    if (deviceHandle != nullptr)
+    if (transport->IsOpen())
         Close();
-
-    libusb_exit(nullptr);
 }
 
 //////////////////////////////////////////////////////////////////////
 
 void USBDevice::Open()
 {
-    assert(deviceHandle == nullptr && "Open called on already opened device");
+    TraceSpan span("Open", "device");
+
+    auto start = Clock::now();
+    try
+    {
+        transport->Open();
+    }
+    catch (...)
+    {
+        USBMetrics::Global().RecordFailure(USBMetrics::OpOpen);
+        throw;
+    }
+    USBMetrics::Global().Record(USBMetrics::OpOpen, Clock::now() - start);
+
+    connection++;
+    writePacketSize = 0;
+    commandContinues = false;
+}
+
+void USBDevice::Close()
+{
+    transport->Close();
+}
 
-    if (deviceHandle != nullptr)
-        return;
+void USBDevice::Reconnect(std::chrono::milliseconds timeout)
+{
+    // Counted before waiting, a failed reconnect must still invalidate
+    connection++;
+    commandContinues = false;
 
-    libusb_device **list;
-    libusb_device *found = nullptr;
+    TraceSpan span("Reconnect", "device");
+    span.Arg("port", transport->PortPath());
 
+    auto start = Clock::now();
     try
     {
-        ssize_t cnt = libusb_get_device_list(nullptr, &list);
-        if (cnt < 0)
-            throw std::runtime_error(libusb_strerror(static_cast<libusb_error>(cnt)));
+        transport->Reconnect(timeout);
+    }
+    catch (...)
+    {
+        USBMetrics::Global().RecordFailure(USBMetrics::OpReconnect);
+        throw;
+    }
+    USBMetrics::Global().Record(USBMetrics::OpReconnect, Clock::now() - start);
+}
 
-        ssize_t i = 0;
-        for (i = 0; i < cnt; i++) 
-        {
-            libusb_device *device = list[i];
-            libusb_device_descriptor desc;
-            libusb_get_device_descriptor(device, &desc);
-            if (desc.idVendor == vendorID && desc.idProduct == productID)
-            {
-                found = device;
-                break;
-            }
-        }
+void USBDevice::Record(const std::string &filename)
+{
+    transport.reset(new RecordingTransport(std::move(transport), filename));
+}
 
-        if (! found)
-            throw std::runtime_error("Unable to find usb device");
-        
-        int err = libusb_open(found, &deviceHandle);
-        if (err)
-            throw std::runtime_error(libusb_strerror(static_cast<libusb_error>(err)));
+bool USBDevice::TryReconnect()
+{
+    // As Reconnect, anything read before the reset is stale from the first attempt
+    if (! reconnecting)
+    {
+        connection++;
+        commandContinues = false;
+        reconnecting = true;
+        reconnectStart = Clock::now();
     }
-    catch(const std::exception &e)
+
+    if (! transport->TryReconnect())
+        return false;
+
+    reconnecting = false;
+    USBMetrics::Global().Record(USBMetrics::OpReconnect, Clock::now() - reconnectStart);
+    return true;
+}
+
+void USBDevice::ExpectReconnect()
+{
+    transport->ExpectReconnect();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void USBDevice::ClaimInterface(int interfaceNum)
+{
+    TraceSpan span("ClaimInterface", "device");
+    span.Arg("interface", static_cast<uint64_t>(interfaceNum));
+
+    auto start = Clock::now();
+    try
+    {
+        transport->ClaimInterface(interfaceNum);
+    }
+    catch (...)
     {
-        // free and unreference devices
-        libusb_free_device_list(list, 1);
+        USBMetrics::Global().RecordFailure(USBMetrics::OpClaimInterface);
         throw;
     }
+    USBMetrics::Global().Record(USBMetrics::OpClaimInterface, Clock::now() - start);
 }
 
-void USBDevice::Close()
+void USBDevice::ReleaseInterface(int interfaceNum)
 {
-    assert(deviceHandle != nullptr && "Close called on already closed device");
+    transport->ReleaseInterface(interfaceNum);
+}
 
-    for (const auto& interfaceNum : claimedInterfaces)
-        libusb_release_interface(deviceHandle, interfaceNum);
+//////////////////////////////////////////////////////////////////////
 
-    if (deviceHandle != nullptr)
-        libusb_close(deviceHandle);
-    
-    deviceHandle = nullptr;
+void USBDevice::WriteBulkEP(const std::vector<unsigned char>& data, int endpoint)
+{
+    WriteBulkEP(data.data(), data.size(), endpoint);
+}
+
+std::vector<unsigned char> USBDevice::ReadBulkEP(size_t readSize, int endpoint)
+{
+    std::vector<unsigned char> data(readSize);
+    data.resize(ReadBulkEP(data.data(), data.size(), endpoint));
+
+    return data;
 }
 
-void USBDevice::Reconnect()
+void USBDevice::WriteBulkEP(const unsigned char *data, size_t size, int endpoint)
 {
-    auto err = libusb_reset_device(deviceHandle);
+    unsigned char opcode = CommandOpcode(data, size, endpoint);
+    ConstBuffer buffer{data, size};
 
-    if (err == 0)
-        return;
+    TraceSpan span("WriteBulkEP", "transfer");
+    span.Arg("opcode", opcode);
+    span.Arg("bytes", size);
 
-    // Device reset may fail causing deviceHandle to be invalidated and requiring re-open
-    if (err = LIBUSB_ERROR_NOT_FOUND)
+    auto start = Clock::now();
+    WithRetry(endpoint, policy.writeTimeout(opcode, size), [&](std::chrono::milliseconds timeout)
     {
-        Close();
-        Open();
+        transport->WriteBulkEP(&buffer, 1, endpoint, timeout);
+    });
+    USBMetrics::Global().RecordWrite(opcode, size, Clock::now() - start);
+}
+
+size_t USBDevice::ReadBulkEP(unsigned char *buffer, size_t size, int endpoint)
+{
+    TraceSpan span("ReadBulkEP", "transfer");
+
+    auto start = Clock::now();
+    size_t transferred = WithRetry(endpoint, policy.readTimeout, [&](std::chrono::milliseconds timeout)
+    {
+        return transport->ReadBulkEP(buffer, size, endpoint, timeout);
+    });
+    span.Arg("bytes", transferred);
+    USBMetrics::Global().RecordRead(transferred, Clock::now() - start);
+
+    return transferred;
+}
+
+void USBDevice::PipelineWriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint)
+{
+    TraceSpan span("PipelineWriteBulkEP", "transfer");
+    span.Arg("transfers", count);
+
+    // Each transfer's timeout runs from submission, so queued behind the others
+    std::chrono::milliseconds timeout{0};
+
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned char opcode = CommandOpcode(buffers[i].data, buffers[i].size, endpoint);
+        USBMetrics::Global().RecordWrite(opcode, buffers[i].size);
+        timeout += policy.writeTimeout(opcode, buffers[i].size);
     }
-    else
-        // Unhandled error
-        throw std::runtime_error(libusb_strerror(static_cast<libusb_error>(err)));
+
+    // Buffers the device has taken in full are not resent
+    size_t first = 0;
+
+    auto start = Clock::now();
+    WithRetry(endpoint, timeout, [&](std::chrono::milliseconds attemptTimeout)
+    {
+        try
+        {
+            transport->WriteBulkEP(buffers + first, count - first, endpoint, attemptTimeout);
+        }
+        catch (const USBTransferError &e)
+        {
+            size_t accepted = e.Transferred();
+            size_t next = first;
+            while (next < count && accepted >= buffers[next].size && accepted != 0)
+                accepted -= buffers[next++].size;
+
+            // Retryable from the failed buffer only if none of it was taken
+            if (next == first || accepted != 0)
+                throw;
+
+            first = next;
+            throw USBTransferError(e.what(), 0, e.Reason());
+        }
+    });
+    USBMetrics::Global().Record(USBMetrics::OpPipeline, Clock::now() - start);
 }
 
-//////////////////////////////////////////////////////////////////////
+unsigned char USBDevice::CommandOpcode(const unsigned char *data, size_t size, int endpoint)
+{
+    if (writePacketSize == 0)
+        writePacketSize = transport->MaxPacketSize(endpoint);
 
-void USBDevice::ClaimInterface(int interfaceNum)
+    if (! commandContinues && size > 0)
+        commandOpcode = data[0];
+
+    commandContinues = writePacketSize != 0 && size != 0 && size % writePacketSize == 0;
+    return commandOpcode;
+}
+
+// Between half and one and a half times backoff, so devices that failed
+// together do not retry in lockstep
+static std::chrono::milliseconds Jitter(std::chrono::milliseconds backoff)
 {
-    if( claimedInterfaces.find(interfaceNum) != claimedInterfaces.end() )
-        return;
-    
-    int err = libusb_claim_interface(deviceHandle, interfaceNum);
-    if (err)
-        throw std::runtime_error(libusb_strerror(static_cast<libusb_error>(err)));
+    static thread_local std::minstd_rand random(std::random_device{}());
+    std::uniform_int_distribution<std::chrono::milliseconds::rep> spread(backoff.count() / 2, backoff.count() * 3 / 2);
 
-    claimedInterfaces.insert(interfaceNum);
+    return std::chrono::milliseconds(spread(random));
 }
 
-void USBDevice::ReleaseInterface(int interfaceNum)
+template <typename Transfer>
+auto USBDevice::WithRetry(int endpoint, std::chrono::milliseconds timeout, Transfer transfer) -> decltype(transfer(timeout))
 {
-    if( claimedInterfaces.find(interfaceNum) == claimedInterfaces.end() )
-        return;
-    
-    libusb_release_interface(deviceHandle, interfaceNum);
+    auto deadline = Clock::now() + policy.budget;
+    auto backoff = policy.backoff;
+
+    for (unsigned int attempt = 1;; attempt++)
+    {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+        auto limit = std::max(std::min(timeout, remaining), std::chrono::milliseconds(1));
 
-    claimedInterfaces.erase(interfaceNum);
+        try
+        {
+            return transfer(limit);
+        }
+        catch (const USBTransferError &e)
+        {
+            // Anything the device took may have been acted on, resending could repeat it
+            bool retryable = (e.Reason() == USBTransferError::TimedOut || e.Reason() == USBTransferError::Stalled) &&
+                             e.Transferred() == 0;
+
+            auto delay = Jitter(backoff);
+            if (! retryable || attempt >= policy.attempts || Clock::now() + delay >= deadline)
+                throw;
+
+            TraceSpan span("retry", "transfer");
+            span.Arg("attempt", attempt);
+            USBMetrics::Global().RecordRetry();
+
+            if (e.Reason() == USBTransferError::Stalled)
+                transport->ClearHalt(endpoint);
+
+            std::this_thread::sleep_for(delay);
+            backoff *= 2;
+        }
+    }
 }
 
 //////////////////////////////////////////////////////////////////////
 
-void USBDevice::WriteBulkEP(const std::vector<unsigned char>& data, int endpoint)
+std::future<size_t> USBDevice::SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint)
 {
-    // NOTE: No attempt is made to check that correct interface has been claimed for the endpoint to write to.
-    assert( ! claimedInterfaces.empty() && "Cannot write to endpoint without claiming interface first");
-    assert( (endpoint & LIBUSB_ENDPOINT_IN) != LIBUSB_ENDPOINT_IN && "WriteBulkEP requires OUT endpoint for writing");
+    unsigned char opcode = CommandOpcode(data.data(), data.size(), endpoint);
+    USBMetrics::Global().RecordWrite(opcode, data.size());
 
-    int written = 0;
-    int err = libusb_bulk_transfer(deviceHandle, endpoint, const_cast<unsigned char*>(data.data()), data.size(), &written, 0);
-    if (err)
-        throw std::runtime_error(libusb_strerror(static_cast<libusb_error>(err)));
-    if (written != data.size())
-        throw std::runtime_error("WriteBulkEP only transferred " + std::to_string(written) + " bytes out of " + std::to_string(data.size()) );
+    auto timeout = policy.writeTimeout(opcode, data.size());
+    return transport->SubmitWriteBulkEP(std::move(data), endpoint, timeout);
 }
 
-std::vector<unsigned char> USBDevice::ReadBulkEP(size_t readSize, int endpoint)
+std::future<std::vector<unsigned char>> USBDevice::SubmitReadBulkEP(size_t readSize, int endpoint)
 {
-    // NOTE: No attempt is made to check that correct interface has been claimed for the endpoint to write to.
-    assert( ! claimedInterfaces.empty() && "Cannot write to endpoint without claiming interface first");
-    assert( (endpoint & LIBUSB_ENDPOINT_IN) == LIBUSB_ENDPOINT_IN && "ReadBulkEP requires IN endpoint for reading");
+    return transport->SubmitReadBulkEP(readSize, endpoint, policy.readTimeout);
+}
 
-    std::vector<unsigned char> data;
-    data.resize(readSize);
+std::future<size_t> USBDevice::SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint)
+{
+    return transport->SubmitReadBulkEP(buffer, size, endpoint, policy.readTimeout);
+}
 
-    int read_count = 0;
-    int err = libusb_bulk_transfer(deviceHandle, endpoint, const_cast<unsigned char*>(data.data()), data.size(), &read_count, 0);
-    if (err)
-        throw std::runtime_error(libusb_strerror(static_cast<libusb_error>(err)));
+std::future<size_t> USBDevice::SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                                 std::chrono::milliseconds timeout)
+{
+    USBMetrics::Global().RecordWrite(CommandOpcode(data, size, endpoint), size);
+    return transport->SubmitWriteBulkEP(data, size, endpoint, timeout);
+}
 
-    data.resize(read_count);
+void USBDevice::CancelTransfers()
+{
+    transport->CancelTransfers();
+}
 
-    return data;
-}
\ No newline at end of file
+//////////////////////////////////////////////////////////////////////
+
+std::vector<unsigned char> USBDevice::ReadHIDReportDescriptor(int interfaceNum)
+{
+    static const unsigned char cHIDReportDescriptor = 0x22;
+
+    // wDescriptorLength is 16 bit
+    std::vector<unsigned char> descriptor(65535);
+    descriptor.resize(transport->ReadInterfaceDescriptor(interfaceNum, cHIDReportDescriptor,
+                                                         descriptor.data(), descriptor.size()));
+
+    return descriptor;
+}
+
+void USBDevice::StartInterruptIn(int endpoint, size_t reportSize, USBTransport::ReportCallback onReport)
+{
+    TraceSpan span("StartInterruptIn", "device");
+    transport->StartInterruptIn(endpoint, reportSize, std::move(onReport));
+}
+
+void USBDevice::StopInterruptIn()
+{
+    transport->StopInterruptIn();
+}
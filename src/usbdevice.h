@@ -22,15 +22,40 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef USBDEVICE_H
 #define USBDEVICE_H
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
-#include <unordered_set>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "usbcontext.h"
+#include "usbtransport.h"
+
 //////////////////////////////////////////////////////////////////////
-// Forwards
+// TransferPolicy
 //////////////////////////////////////////////////////////////////////
 
-struct libusb_device_handle;
+// Deadlines and retries for bulk transfers. A blocking transfer that times out
+// or stalls before the device accepted any of it is retried after a jittered
+// backoff, a stall first clearing the endpoint halt.
+struct TransferPolicy
+{
+    using Timeout = std::chrono::milliseconds;
+
+    // Per attempt, by the opcode of the command being written and its size
+    std::function<Timeout(unsigned char opcode, size_t size)> writeTimeout =
+        [](unsigned char, size_t size) { return Timeout(1000 + size / 16); };
+    Timeout readTimeout{2000};
+
+    unsigned int attempts = 3;
+    Timeout backoff{20};            // Before the first retry, doubled for each after
+
+    // Whole blocking call including retries, no attempt may run past it
+    Timeout budget{15000};
+};
 
 //////////////////////////////////////////////////////////////////////
 // USBDevice
@@ -39,31 +64,122 @@ struct libusb_device_handle;
 class USBDevice
 {
 public:
+    using ConstBuffer = USBTransport::ConstBuffer;
+
     USBDevice(uint16_t vendorID, uint16_t productID);
+
+    // Empty portPath opens the first matching device
+    USBDevice(std::shared_ptr<USBContext> context, uint16_t vendorID, uint16_t productID,
+              const std::string& portPath = "");
+
+    // Opens node directly, skipping enumeration. Reconnects find it again by port path.
+    USBDevice(std::shared_ptr<USBContext> context, uint16_t vendorID, uint16_t productID,
+              const USBDeviceNode &node);
+
+    // Alternate backend, e.g SimulatedCougar
+    explicit USBDevice(std::unique_ptr<USBTransport> transport);
+
     ~USBDevice();
 
-    // TODO: Delete copy/assign etc
+    USBDevice(const USBDevice&) = delete;
+    USBDevice& operator=(const USBDevice&) = delete;
     
     void Open();
     void Close();
+    bool IsOpen() const { return transport->IsOpen(); }
+
+    // Valid once opened, identifies the physical port the device is attached to
+    const std::string& PortPath() const { return transport->PortPath(); }
+
+    // Incremented on every open and reconnect. Anything read from the device is
+    // stale once this changes.
+    uint64_t Connection() const { return connection; }
     
-    // Blocking call, may take several seconds to return
-    void Reconnect();
+    // Blocking call, returns once the re-enumerated device has been re-opened with
+    // all previously claimed interfaces. Throws if not back within timeout.
+    void Reconnect(std::chrono::milliseconds timeout = std::chrono::seconds(10));
+
+    // Non-blocking Reconnect for callers running their own event loop. Call
+    // repeatedly once the device has been told to reset, true once it is back.
+    // The caller enforces any deadline.
+    bool TryReconnect();
+
+    // Call before sending a command that causes the device to re-enumerate itself.
+    // Lets hotplug listeners on the shared context ignore the resulting arrival
+    // and ensures Reconnect cannot miss it.
+    void ExpectReconnect();
 
     void ClaimInterface(int interfaceNum);
     void ReleaseInterface(int interfaceNum);
 
+    // wMaxPacketSize of the given endpoint
+    size_t MaxPacketSize(int endpoint) { return transport->MaxPacketSize(endpoint); }
+
+    // Writes every later bulk transfer and reconnect to filename, replayable
+    // with ReplayTransport. Call before Open so the trace starts with it.
+    void Record(const std::string &filename);
+
+    // Applies to every later transfer
+    void SetTransferPolicy(const TransferPolicy &policy) { this->policy = policy; }
+    const TransferPolicy& Policy() const { return policy; }
+
     // Ensure interface claimed prior to any endpoint I/O
     void WriteBulkEP(const std::vector<unsigned char>& data, int endpoint);
     std::vector<unsigned char> ReadBulkEP(size_t readSize, int endpoint);
+
+    // Caller owned buffers. No heap allocation once the transfer pool is warm.
+    void WriteBulkEP(const unsigned char *data, size_t size, int endpoint);
+    size_t ReadBulkEP(unsigned char *buffer, size_t size, int endpoint);
+
+    // Submit all buffers back to back then wait for every one to complete,
+    // avoiding a round trip per command. Throws on the first failure.
+    void PipelineWriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint);
+
+    // Asynchronous variants. Any number of transfers may be in flight at once,
+    // those queued on the same endpoint complete in submission order.
+    std::future<size_t> SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint);
+    std::future<std::vector<unsigned char>> SubmitReadBulkEP(size_t readSize, int endpoint);
+
+    // Buffer must remain valid until the future is ready
+    std::future<size_t> SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint);
+
+    // Caller owned buffer which must remain valid until the future is ready. Fails
+    // with USBTransferError, giving the bytes accepted, if not complete within timeout.
+    // Other async transfers use the policy's timeouts and are never retried.
+    std::future<size_t> SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                          std::chrono::milliseconds timeout);
+
+    // Blocks until every in flight transfer has completed or been cancelled
+    void CancelTransfers();
+
+    // HID class report descriptor of a (not necessarily claimed) interface
+    std::vector<unsigned char> ReadHIDReportDescriptor(int interfaceNum);
+
+    // Poll an interrupt IN endpoint until stopped, calling onReport from the
+    // event thread for every report. onReport must not block.
+    void StartInterruptIn(int endpoint, size_t reportSize, USBTransport::ReportCallback onReport);
+    void StopInterruptIn();
     
 private:
-    uint16_t vendorID;
-    uint16_t productID;
-    
-    std::unordered_set<int> claimedInterfaces;
+    // Opcode of the command a write belongs to, for metrics. A transfer that is
+    // a whole number of packets continues the command in the next transfer.
+    unsigned char CommandOpcode(const unsigned char *data, size_t size, int endpoint);
+
+    // Runs transfer(timeout) until it succeeds or the policy gives up
+    template <typename Transfer>
+    auto WithRetry(int endpoint, std::chrono::milliseconds timeout, Transfer transfer) -> decltype(transfer(timeout));
+
+    TransferPolicy policy;
+
+    std::unique_ptr<USBTransport> transport;
+    uint64_t connection = 0;
+
+    bool reconnecting = false;
+    std::chrono::steady_clock::time_point reconnectStart;
 
-    libusb_device_handle *deviceHandle = nullptr;
+    size_t writePacketSize = 0;
+    bool commandContinues = false;
+    unsigned char commandOpcode = 0;
 };
 
 #endif // USBDEVICE_H
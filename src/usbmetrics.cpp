@@ -0,0 +1,282 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "usbmetrics.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include <libusb.h>
+
+static const char* cOperationNames[USBMetrics::OpCount] = {
+    "open", "claim_interface", "pipeline", "reconnect", "ready", "cold_start",
+    "input_load", "end_to_end"
+};
+
+//////////////////////////////////////////////////////////////////////
+// LatencyHistogram
+//////////////////////////////////////////////////////////////////////
+
+void LatencyHistogram::Record(std::chrono::steady_clock::duration elapsed) noexcept
+{
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    uint64_t us = micros > 0 ? static_cast<uint64_t>(micros) : 0;
+
+    // Bounds are inclusive as Prometheus' le, so 2^(i-1) < us <= 2^i
+    size_t i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (i >= cBuckets)
+        i = cBuckets - 1;
+
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sumMicros.fetch_add(us, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::QuantileMicros(double quantile) const
+{
+    uint64_t total = Count();
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = static_cast<uint64_t>(quantile * total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < cBuckets; i++)
+    {
+        seen += Bucket(i);
+        if (seen > rank)
+            return i + 1 < cBuckets ? BucketLimitMicros(i) : BucketLimitMicros(cBuckets - 2);
+    }
+
+    return BucketLimitMicros(cBuckets - 2);
+}
+
+//////////////////////////////////////////////////////////////////////
+// USBMetrics
+//////////////////////////////////////////////////////////////////////
+
+USBMetrics& USBMetrics::Global()
+{
+    static USBMetrics metrics;
+    return metrics;
+}
+
+void USBMetrics::RecordWrite(unsigned char opcode, size_t bytes) noexcept
+{
+    writes[opcode].transfers.fetch_add(1, std::memory_order_relaxed);
+    writes[opcode].bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void USBMetrics::RecordWrite(unsigned char opcode, size_t bytes, std::chrono::steady_clock::duration elapsed) noexcept
+{
+    RecordWrite(opcode, bytes);
+    writes[opcode].latency.Record(elapsed);
+}
+
+void USBMetrics::RecordRead(size_t bytes) noexcept
+{
+    reads.transfers.fetch_add(1, std::memory_order_relaxed);
+    reads.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void USBMetrics::RecordRead(size_t bytes, std::chrono::steady_clock::duration elapsed) noexcept
+{
+    RecordRead(bytes);
+    reads.latency.Record(elapsed);
+}
+
+void USBMetrics::Record(Operation operation, std::chrono::steady_clock::duration elapsed) noexcept
+{
+    operations[operation].Record(elapsed);
+}
+
+void USBMetrics::RecordFailure(Operation operation) noexcept
+{
+    failures[operation].fetch_add(1, std::memory_order_relaxed);
+}
+
+void USBMetrics::RecordError(int error) noexcept
+{
+    size_t code = error < 0 ? static_cast<size_t>(-error) : 0;
+    if (code < cErrorCodes)
+        errors[code].fetch_add(1, std::memory_order_relaxed);
+}
+
+void USBMetrics::RecordRetry() noexcept
+{
+    retries.fetch_add(1, std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+static std::string OpcodeName(size_t opcode)
+{
+    char name[8];
+    std::snprintf(name, sizeof(name), "%02zx", opcode);
+    return name;
+}
+
+static void JsonHistogram(std::ostream &out, const LatencyHistogram &histogram)
+{
+    out << "{\"count\": " << histogram.Count() << ", \"sum_us\": " << histogram.SumMicros()
+        << ", \"p50_us\": " << histogram.QuantileMicros(0.5) << ", \"p90_us\": " << histogram.QuantileMicros(0.9)
+        << ", \"p99_us\": " << histogram.QuantileMicros(0.99) << "}";
+}
+
+std::string USBMetrics::FormatJson() const
+{
+    std::ostringstream out;
+    const char *separator = "";
+
+    out << "{\n  \"writes\": {";
+    for (size_t opcode = 0; opcode < 256; opcode++)
+    {
+        const auto &stats = writes[opcode];
+        if (stats.transfers == 0)
+            continue;
+
+        out << separator << "\n    \"" << OpcodeName(opcode) << "\": {\"transfers\": " << stats.transfers
+            << ", \"bytes\": " << stats.bytes << ", \"latency\": ";
+        JsonHistogram(out, stats.latency);
+        out << "}";
+        separator = ",";
+    }
+
+    out << "\n  },\n  \"reads\": {\"transfers\": " << reads.transfers << ", \"bytes\": " << reads.bytes
+        << ", \"latency\": ";
+    JsonHistogram(out, reads.latency);
+
+    out << "},\n  \"operations\": {";
+    separator = "";
+    for (size_t op = 0; op < OpCount; op++)
+    {
+        out << separator << "\n    \"" << cOperationNames[op] << "\": {\"failures\": " << failures[op]
+            << ", \"latency\": ";
+        JsonHistogram(out, operations[op]);
+        out << "}";
+        separator = ",";
+    }
+
+    out << "\n  },\n  \"errors\": {";
+    separator = "";
+    for (size_t code = 0; code < cErrorCodes; code++)
+    {
+        if (errors[code] == 0)
+            continue;
+
+        out << separator << "\n    \"" << libusb_error_name(-static_cast<int>(code)) << "\": " << errors[code];
+        separator = ",";
+    }
+    out << "\n  },\n  \"retries\": " << retries << "\n}\n";
+
+    return out.str();
+}
+
+// Exact decimal seconds, so bucket labels never round and sums keep full precision
+static std::string MicrosToSeconds(uint64_t micros)
+{
+    std::ostringstream out;
+    out << micros / 1000000 << "." << std::setw(6) << std::setfill('0') << micros % 1000000;
+    return out.str();
+}
+
+static void PrometheusHistogram(std::ostream &out, const std::string &name, const std::string &labels,
+                                const LatencyHistogram &histogram)
+{
+    std::string prefix = labels.empty() ? "{" : "{" + labels + ",";
+    uint64_t cumulative = 0;
+
+    for (size_t i = 0; i + 1 < LatencyHistogram::cBuckets; i++)
+    {
+        cumulative += histogram.Bucket(i);
+        out << name << "_bucket" << prefix << "le=\"" << MicrosToSeconds(LatencyHistogram::BucketLimitMicros(i)) << "\"} "
+            << cumulative << "\n";
+    }
+
+    out << name << "_bucket" << prefix << "le=\"+Inf\"} " << histogram.Count() << "\n";
+    out << name << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << " " << MicrosToSeconds(histogram.SumMicros()) << "\n";
+    out << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << " " << histogram.Count() << "\n";
+}
+
+std::string USBMetrics::FormatPrometheus() const
+{
+    std::ostringstream out;
+
+    out << "# TYPE cougar_usb_write_transfers_total counter\n";
+    for (size_t opcode = 0; opcode < 256; opcode++)
+        if (writes[opcode].transfers != 0)
+            out << "cougar_usb_write_transfers_total{opcode=\"" << OpcodeName(opcode) << "\"} " << writes[opcode].transfers << "\n";
+
+    out << "# TYPE cougar_usb_write_bytes_total counter\n";
+    for (size_t opcode = 0; opcode < 256; opcode++)
+        if (writes[opcode].transfers != 0)
+            out << "cougar_usb_write_bytes_total{opcode=\"" << OpcodeName(opcode) << "\"} " << writes[opcode].bytes << "\n";
+
+    out << "# TYPE cougar_usb_write_latency_seconds histogram\n";
+    for (size_t opcode = 0; opcode < 256; opcode++)
+        if (writes[opcode].latency.Count() != 0)
+            PrometheusHistogram(out, "cougar_usb_write_latency_seconds", "opcode=\"" + OpcodeName(opcode) + "\"",
+                                writes[opcode].latency);
+
+    out << "# TYPE cougar_usb_read_transfers_total counter\n"
+        << "cougar_usb_read_transfers_total " << reads.transfers << "\n"
+        << "# TYPE cougar_usb_read_bytes_total counter\n"
+        << "cougar_usb_read_bytes_total " << reads.bytes << "\n"
+        << "# TYPE cougar_usb_read_latency_seconds histogram\n";
+    PrometheusHistogram(out, "cougar_usb_read_latency_seconds", "", reads.latency);
+
+    out << "# TYPE cougar_operation_latency_seconds histogram\n";
+    for (size_t op = 0; op < OpCount; op++)
+        PrometheusHistogram(out, "cougar_operation_latency_seconds", std::string("operation=\"") + cOperationNames[op] + "\"",
+                            operations[op]);
+
+    out << "# TYPE cougar_operation_failures_total counter\n";
+    for (size_t op = 0; op < OpCount; op++)
+        out << "cougar_operation_failures_total{operation=\"" << cOperationNames[op] << "\"} " << failures[op] << "\n";
+
+    out << "# TYPE cougar_usb_errors_total counter\n";
+    for (size_t code = 0; code < cErrorCodes; code++)
+        if (errors[code] != 0)
+            out << "cougar_usb_errors_total{error=\"" << libusb_error_name(-static_cast<int>(code)) << "\"} " << errors[code] << "\n";
+
+    out << "# TYPE cougar_usb_retries_total counter\n"
+        << "cougar_usb_retries_total " << retries << "\n";
+
+    return out.str();
+}
+
+void USBMetrics::WritePrometheusFile(const std::string &filename) const
+{
+    // Write then rename so the collector never reads a partial file
+    std::string temp_filename = filename + ".tmp";
+    {
+        std::ofstream file(temp_filename, std::ios::trunc);
+        file << FormatPrometheus();
+
+        if (! file.good())
+            throw std::runtime_error("Unable to write metrics file " + temp_filename);
+    }
+
+    if (std::rename(temp_filename.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("Unable to replace metrics file " + filename);
+}
@@ -0,0 +1,125 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef USBMETRICS_H
+#define USBMETRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//////////////////////////////////////////////////////////////////////
+// LatencyHistogram
+//////////////////////////////////////////////////////////////////////
+
+// Lock free, power of two microsecond buckets. Bucket i counts samples
+// up to and including 2^i us, the last bucket anything longer (about 16 s).
+class LatencyHistogram
+{
+public:
+    static const size_t cBuckets = 26;
+
+    void Record(std::chrono::steady_clock::duration elapsed) noexcept;
+
+    uint64_t Count() const { return count.load(std::memory_order_relaxed); }
+    uint64_t SumMicros() const { return sumMicros.load(std::memory_order_relaxed); }
+    uint64_t Bucket(size_t i) const { return buckets[i].load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket holding the given quantile, 0 if empty
+    uint64_t QuantileMicros(double quantile) const;
+
+    // Inclusive upper bound of bucket i in microseconds, 0 for the last (unbounded)
+    static uint64_t BucketLimitMicros(size_t i) { return i + 1 < cBuckets ? uint64_t(1) << i : 0; }
+
+private:
+    std::atomic<uint64_t> buckets[cBuckets] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sumMicros{0};
+};
+
+//////////////////////////////////////////////////////////////////////
+// USBMetrics
+//////////////////////////////////////////////////////////////////////
+
+// Process wide transfer and device lifecycle statistics. Recording is a
+// handful of relaxed atomic increments, safe from any thread.
+class USBMetrics
+{
+public:
+    enum Operation
+    {
+        OpOpen,
+        OpClaimInterface,
+        OpPipeline,
+        OpReconnect,
+        OpReady,        // Plug in to configured, recorded by the daemon
+        OpColdStart,    // Process start to device claimed, recorded by one shot runs
+        OpInputLoad,    // Input files loaded, validated and hashed, recorded by one shot runs
+        OpEndToEnd,     // Process start to configured, recorded by one shot runs
+        OpCount
+    };
+
+    static USBMetrics& Global();
+
+    // Writes are keyed by the opcode of the command they belong to. Latency
+    // is only recorded for blocking single transfers.
+    void RecordWrite(unsigned char opcode, size_t bytes) noexcept;
+    void RecordWrite(unsigned char opcode, size_t bytes, std::chrono::steady_clock::duration elapsed) noexcept;
+    void RecordRead(size_t bytes) noexcept;
+    void RecordRead(size_t bytes, std::chrono::steady_clock::duration elapsed) noexcept;
+
+    void Record(Operation operation, std::chrono::steady_clock::duration elapsed) noexcept;
+    void RecordFailure(Operation operation) noexcept;
+
+    // libusb_error code
+    void RecordError(int error) noexcept;
+
+    // Transfer resent under TransferPolicy
+    void RecordRetry() noexcept;
+
+    std::string FormatJson() const;
+    std::string FormatPrometheus() const;
+
+    // Atomically replaces filename, for the node exporter textfile collector
+    void WritePrometheusFile(const std::string &filename) const;
+
+private:
+    struct TransferStats
+    {
+        std::atomic<uint64_t> transfers{0};
+        std::atomic<uint64_t> bytes{0};
+        LatencyHistogram latency;
+    };
+
+    // libusb_error codes run from 0 to -99
+    static const size_t cErrorCodes = 100;
+
+    TransferStats writes[256];
+    TransferStats reads;
+    LatencyHistogram operations[OpCount];
+    std::atomic<uint64_t> failures[OpCount] = {};
+    std::atomic<uint64_t> errors[cErrorCodes] = {};
+    std::atomic<uint64_t> retries{0};
+};
+
+#endif // USBMETRICS_H
@@ -0,0 +1,606 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "usbrecord.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+//////////////////////////////////////////////////////////////////////
+
+// Run f now and hand back its result (or exception) as a ready future
+template <typename T, typename F>
+static std::future<T> Completed(F f)
+{
+    std::promise<T> promise;
+
+    try
+    {
+        promise.set_value(f());
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+
+    return promise.get_future();
+}
+
+//////////////////////////////////////////////////////////////////////
+// RecordingTransport
+//////////////////////////////////////////////////////////////////////
+
+RecordingTransport::RecordingTransport(std::unique_ptr<USBTransport> transport, const std::string &filename)
+    : transport(std::move(transport)), filename(filename)
+{
+    file = std::fopen(filename.c_str(), "wb");
+    if (! file)
+        throw std::runtime_error("Unable to create " + filename);
+
+    if (this->transport->IsOpen())
+        WriteFileHeader();
+
+    recorder = std::thread(&RecordingTransport::RecorderThread, this);
+}
+
+RecordingTransport::~RecordingTransport()
+{
+    // Anything still queued is recorded first
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queued.notify_one();
+    recorder.join();
+
+    std::fclose(file);
+}
+
+void RecordingTransport::WriteFileHeader()
+{
+    const auto &port = transport->PortPath();
+
+    USBRecordFileHeader header{};
+    std::memcpy(header.magic, cUSBRecordMagic, sizeof(header.magic));
+    header.version = cUSBRecordVersion;
+    header.portPathLength = static_cast<uint16_t>(port.size());
+    header.startTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::system_clock::now().time_since_epoch()).count();
+
+    std::fwrite(&header, sizeof(header), 1, file);
+    std::fwrite(port.data(), 1, port.size(), file);
+
+    headerWritten = true;
+    last = Clock::now();
+}
+
+void RecordingTransport::Append(uint8_t kind, int endpoint, const ConstBuffer *buffers, size_t count,
+                                size_t transferred, Clock::time_point at, const USBTransferError *error)
+{
+    USBRecordHeader record{};
+    record.deltaMicros = static_cast<uint32_t>(std::min<int64_t>(std::max<int64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(at - last).count(), 0), UINT32_MAX));
+    record.kind = kind;
+    record.endpoint = static_cast<uint8_t>(endpoint);
+    record.status = error ? static_cast<uint8_t>(error->Reason() + 1) : 0;
+    record.transferred = static_cast<uint32_t>(transferred);
+
+    for (size_t i = 0; i < count; i++)
+        record.length += static_cast<uint32_t>(buffers[i].size);
+
+    std::fwrite(&record, sizeof(record), 1, file);
+    for (size_t i = 0; i < count; i++)
+        std::fwrite(buffers[i].data, 1, buffers[i].size, file);
+
+    last = std::max(last, at);
+
+    if (std::ferror(file))
+        throw std::runtime_error("Unable to write " + filename);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void RecordingTransport::RecorderThread()
+{
+    std::unique_lock<std::mutex> lock(queueMutex);
+
+    for (;;)
+    {
+        queued.wait(lock, [this]() { return stopping || ! queue.empty(); });
+        if (queue.empty())
+            return;
+
+        auto record = std::move(queue.front());
+        queue.pop_front();
+
+        lock.unlock();
+        record();
+        lock.lock();
+    }
+}
+
+void RecordingTransport::Enqueue(std::function<void()> record)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push_back(std::move(record));
+    }
+    queued.notify_one();
+}
+
+void RecordingTransport::Ordered(std::function<void()> record)
+{
+    auto done = std::make_shared<std::promise<void>>();
+    auto recorded = done->get_future();
+
+    Enqueue([record, done]()
+    {
+        try
+        {
+            record();
+            done->set_value();
+        }
+        catch (...)
+        {
+            done->set_exception(std::current_exception());
+        }
+    });
+
+    recorded.get();
+}
+
+template <typename T>
+std::future<T> RecordingTransport::Recorded(std::future<T> inner, std::function<void(const T&, Clock::time_point)> succeeded,
+                                            std::function<void(const USBTransferError&, Clock::time_point)> failed)
+{
+    // Futures are move only, std::function copies its target
+    auto transfer = std::make_shared<std::future<T>>(std::move(inner));
+    auto promise = std::make_shared<std::promise<T>>();
+    auto future = promise->get_future();
+
+    Enqueue([transfer, promise, succeeded, failed]()
+    {
+        try
+        {
+            T result = transfer->get();
+            succeeded(result, Clock::now());
+            promise->set_value(std::move(result));
+        }
+        catch (const USBTransferError &e)
+        {
+            auto failure = std::current_exception();
+            try
+            {
+                failed(e, Clock::now());
+            }
+            catch (...)
+            {
+            }
+            promise->set_exception(failure);
+        }
+        catch (...)
+        {
+            promise->set_exception(std::current_exception());
+        }
+    });
+
+    return future;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void RecordingTransport::Open()
+{
+    transport->Open();
+
+    if (! headerWritten)
+        Ordered([this]() { WriteFileHeader(); });
+}
+
+void RecordingTransport::Close()
+{
+    transport->Close();
+    Ordered([this]() { std::fflush(file); });
+}
+
+void RecordingTransport::Reconnect(std::chrono::milliseconds timeout)
+{
+    try
+    {
+        transport->Reconnect(timeout);
+    }
+    catch (const std::exception &)
+    {
+        auto at = Clock::now();
+        Ordered([this, at]()
+        {
+            USBTransferError failed("", 0);
+            Append(USBRecordHeader::Reconnect, 0, nullptr, 0, 0, at, &failed);
+        });
+        throw;
+    }
+
+    auto at = Clock::now();
+    Ordered([this, at]() { Append(USBRecordHeader::Reconnect, 0, nullptr, 0, 0, at); });
+}
+
+bool RecordingTransport::TryReconnect()
+{
+    // Only the attempt that succeeds is recorded
+    if (! transport->TryReconnect())
+        return false;
+
+    auto at = Clock::now();
+    Ordered([this, at]() { Append(USBRecordHeader::Reconnect, 0, nullptr, 0, 0, at); });
+    return true;
+}
+
+size_t RecordingTransport::MaxPacketSize(int endpoint)
+{
+    size_t size = transport->MaxPacketSize(endpoint);
+
+    if (packetSizes.insert(endpoint).second)
+    {
+        auto at = Clock::now();
+        Ordered([&]() { Append(USBRecordHeader::PacketSize, endpoint, nullptr, 0, size, at); });
+    }
+
+    return size;
+}
+
+void RecordingTransport::CancelTransfers()
+{
+    transport->CancelTransfers();
+
+    // Cancelled transfers are recorded, and their futures ready, before returning
+    Ordered([]() {});
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void RecordingTransport::WriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint,
+                                     std::chrono::milliseconds timeout)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += buffers[i].size;
+
+    try
+    {
+        transport->WriteBulkEP(buffers, count, endpoint, timeout);
+    }
+    catch (const USBTransferError &e)
+    {
+        auto at = Clock::now();
+        Ordered([&]() { Append(USBRecordHeader::Write, endpoint, buffers, count, e.Transferred(), at, &e); });
+        throw;
+    }
+
+    auto at = Clock::now();
+    Ordered([&]() { Append(USBRecordHeader::Write, endpoint, buffers, count, total, at); });
+}
+
+size_t RecordingTransport::ReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                      std::chrono::milliseconds timeout)
+{
+    size_t read;
+
+    try
+    {
+        read = transport->ReadBulkEP(buffer, size, endpoint, timeout);
+    }
+    catch (const USBTransferError &e)
+    {
+        auto at = Clock::now();
+        ConstBuffer partial{buffer, e.Transferred()};
+        Ordered([&]() { Append(USBRecordHeader::Read, endpoint, &partial, 1, e.Transferred(), at, &e); });
+        throw;
+    }
+
+    auto at = Clock::now();
+    ConstBuffer data{buffer, read};
+    Ordered([&]() { Append(USBRecordHeader::Read, endpoint, &data, 1, read, at); });
+
+    return read;
+}
+
+// Async submits go straight to the device, each recorded once complete, in submission order
+
+std::future<size_t> RecordingTransport::SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint,
+                                                          std::chrono::milliseconds timeout)
+{
+    // Kept for the record, the device writes from it in place
+    auto payload = std::make_shared<std::vector<unsigned char>>(std::move(data));
+
+    return Recorded<size_t>(transport->SubmitWriteBulkEP(payload->data(), payload->size(), endpoint, timeout),
+        [this, payload, endpoint](const size_t &written, Clock::time_point at)
+        {
+            ConstBuffer buffer{payload->data(), payload->size()};
+            Append(USBRecordHeader::Write, endpoint, &buffer, 1, written, at);
+        },
+        [this, payload, endpoint](const USBTransferError &e, Clock::time_point at)
+        {
+            ConstBuffer buffer{payload->data(), payload->size()};
+            Append(USBRecordHeader::Write, endpoint, &buffer, 1, e.Transferred(), at, &e);
+        });
+}
+
+std::future<std::vector<unsigned char>> RecordingTransport::SubmitReadBulkEP(size_t readSize, int endpoint,
+                                                                             std::chrono::milliseconds timeout)
+{
+    return Recorded<std::vector<unsigned char>>(transport->SubmitReadBulkEP(readSize, endpoint, timeout),
+        [this, endpoint](const std::vector<unsigned char> &data, Clock::time_point at)
+        {
+            ConstBuffer buffer{data.data(), data.size()};
+            Append(USBRecordHeader::Read, endpoint, &buffer, 1, data.size(), at);
+        },
+        [this, endpoint](const USBTransferError &e, Clock::time_point at)
+        {
+            // The partial data went with the inner future's result
+            Append(USBRecordHeader::Read, endpoint, nullptr, 0, 0, at, &e);
+        });
+}
+
+std::future<size_t> RecordingTransport::SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                                         std::chrono::milliseconds timeout)
+{
+    // buffer is the caller's until the returned future is ready, after the record is written
+    return Recorded<size_t>(transport->SubmitReadBulkEP(buffer, size, endpoint, timeout),
+        [this, buffer, endpoint](const size_t &read, Clock::time_point at)
+        {
+            ConstBuffer data{buffer, read};
+            Append(USBRecordHeader::Read, endpoint, &data, 1, read, at);
+        },
+        [this, buffer, endpoint](const USBTransferError &e, Clock::time_point at)
+        {
+            ConstBuffer partial{buffer, e.Transferred()};
+            Append(USBRecordHeader::Read, endpoint, &partial, 1, e.Transferred(), at, &e);
+        });
+}
+
+std::future<size_t> RecordingTransport::SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                                          std::chrono::milliseconds timeout)
+{
+    return Recorded<size_t>(transport->SubmitWriteBulkEP(data, size, endpoint, timeout),
+        [this, data, size, endpoint](const size_t &written, Clock::time_point at)
+        {
+            ConstBuffer buffer{data, size};
+            Append(USBRecordHeader::Write, endpoint, &buffer, 1, written, at);
+        },
+        [this, data, size, endpoint](const USBTransferError &e, Clock::time_point at)
+        {
+            ConstBuffer buffer{data, size};
+            Append(USBRecordHeader::Write, endpoint, &buffer, 1, e.Transferred(), at, &e);
+        });
+}
+
+//////////////////////////////////////////////////////////////////////
+// ReplayTransport
+//////////////////////////////////////////////////////////////////////
+
+ReplayTransport::ReplayTransport(const std::string &filename, Speed speed)
+    : trace(filename), speed(speed), start(std::chrono::steady_clock::now())
+{
+    USBRecordFileHeader header;
+    if (trace.Size() < sizeof(header))
+        throw std::runtime_error(filename + " is not a USB recording");
+
+    std::memcpy(&header, trace.Data(), sizeof(header));
+    if (std::memcmp(header.magic, cUSBRecordMagic, sizeof(header.magic)) != 0)
+        throw std::runtime_error(filename + " is not a USB recording");
+    if (header.version != cUSBRecordVersion)
+        throw std::runtime_error(filename + " is USB recording version " + std::to_string(header.version) +
+                                 ", expected " + std::to_string(cUSBRecordVersion));
+
+    offset = sizeof(header) + header.portPathLength;
+    if (offset > trace.Size())
+        throw std::runtime_error(filename + " is truncated");
+
+    portPath.assign(reinterpret_cast<const char*>(trace.Data() + sizeof(header)), header.portPathLength);
+
+    // Validate every record up front, and find the packet sizes which may be asked for at any time
+    for (size_t pos = offset; pos != trace.Size(); )
+    {
+        USBRecordHeader entry;
+        if (trace.Size() - pos < sizeof(entry))
+            throw std::runtime_error(filename + " is truncated");
+
+        std::memcpy(&entry, trace.Data() + pos, sizeof(entry));
+        pos += sizeof(entry);
+
+        if (trace.Size() - pos < entry.length)
+            throw std::runtime_error(filename + " is truncated");
+        pos += entry.length;
+
+        if (entry.kind == USBRecordHeader::PacketSize)
+            packetSizes.emplace(entry.endpoint, entry.transferred);
+    }
+}
+
+[[noreturn]] void ReplayTransport::Diverged(const std::string &what)
+{
+    throw std::runtime_error("Replay diverged from " + trace.Filename() + " at record " +
+                             std::to_string(replayed) + ": " + what);
+}
+
+const USBRecordHeader& ReplayTransport::Next(uint8_t kind, int endpoint)
+{
+    static const char *cKindNames[] = {"none", "write", "read", "reconnect", "packet size"};
+
+    // Packet sizes are served from the index instead
+    do
+    {
+        if (AtEnd())
+            Diverged(std::string("no more records for ") + cKindNames[kind]);
+
+        std::memcpy(&record, trace.Data() + offset, sizeof(record));
+        payload = trace.Data() + offset + sizeof(record);
+        offset += sizeof(record) + record.length;
+
+        elapsed += std::chrono::microseconds(record.deltaMicros);
+    }
+    while (record.kind == USBRecordHeader::PacketSize);
+
+    replayed++;
+
+    if (record.kind != kind || (kind != USBRecordHeader::Reconnect && record.endpoint != static_cast<uint8_t>(endpoint)))
+    {
+        Diverged(std::string("expected ") + cKindNames[kind] + " on endpoint " + std::to_string(endpoint & 0xff) +
+                 ", recorded " + (record.kind <= USBRecordHeader::PacketSize ? cKindNames[record.kind] : "unknown") +
+                 " on endpoint " + std::to_string(record.endpoint));
+    }
+
+    if (speed == Speed::Recorded)
+        std::this_thread::sleep_until(start + elapsed);
+
+    return record;
+}
+
+void ReplayTransport::ThrowRecorded(const USBRecordHeader &recorded, const std::string &what)
+{
+    if (recorded.status == 0)
+        return;
+
+    auto cause = static_cast<USBTransferError::Cause>(recorded.status - 1);
+    throw USBTransferError("Recorded " + what + " failure", recorded.transferred, cause);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void ReplayTransport::Reconnect(std::chrono::milliseconds)
+{
+    const auto &recorded = Next(USBRecordHeader::Reconnect, 0);
+    if (recorded.status != 0)
+        throw std::runtime_error("Device did not reconnect on " + portPath + " (recorded)");
+}
+
+bool ReplayTransport::TryReconnect()
+{
+    // At recorded speed the reconnect is not due until its recorded time
+    if (speed == Speed::Recorded && ! AtEnd())
+    {
+        USBRecordHeader upcoming;
+        std::memcpy(&upcoming, trace.Data() + offset, sizeof(upcoming));
+
+        auto due = start + elapsed + std::chrono::microseconds(upcoming.deltaMicros);
+        if (std::chrono::steady_clock::now() < due)
+            return false;
+    }
+
+    Reconnect(std::chrono::milliseconds(0));
+    return true;
+}
+
+size_t ReplayTransport::MaxPacketSize(int endpoint)
+{
+    auto size = packetSizes.find(static_cast<uint8_t>(endpoint));
+    if (size == packetSizes.end())
+        Diverged("packet size of endpoint " + std::to_string(endpoint & 0xff) + " not recorded");
+
+    return size->second;
+}
+
+void ReplayTransport::WriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint,
+                                  std::chrono::milliseconds)
+{
+    const auto &recorded = Next(USBRecordHeader::Write, endpoint);
+
+    size_t pos = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (pos + buffers[i].size > recorded.length ||
+            std::memcmp(payload + pos, buffers[i].data, buffers[i].size) != 0)
+        {
+            Diverged("write differs from the recording");
+        }
+        pos += buffers[i].size;
+    }
+
+    if (pos != recorded.length)
+        Diverged("write of " + std::to_string(pos) + " bytes, recorded " + std::to_string(recorded.length));
+
+    ThrowRecorded(recorded, "write");
+}
+
+size_t ReplayTransport::ReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                   std::chrono::milliseconds)
+{
+    const auto &recorded = Next(USBRecordHeader::Read, endpoint);
+
+    if (recorded.length > size)
+        Diverged("read of " + std::to_string(size) + " bytes, recorded " + std::to_string(recorded.length));
+
+    std::memcpy(buffer, payload, recorded.length);
+    ThrowRecorded(recorded, "read");
+
+    return recorded.length;
+}
+
+std::future<size_t> ReplayTransport::SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint,
+                                                       std::chrono::milliseconds timeout)
+{
+    return Completed<size_t>([&]()
+    {
+        ConstBuffer buffer{data.data(), data.size()};
+        WriteBulkEP(&buffer, 1, endpoint, timeout);
+        return data.size();
+    });
+}
+
+std::future<std::vector<unsigned char>> ReplayTransport::SubmitReadBulkEP(size_t readSize, int endpoint,
+                                                                          std::chrono::milliseconds timeout)
+{
+    return Completed<std::vector<unsigned char>>([&]()
+    {
+        std::vector<unsigned char> data(readSize);
+        data.resize(ReadBulkEP(data.data(), data.size(), endpoint, timeout));
+        return data;
+    });
+}
+
+std::future<size_t> ReplayTransport::SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                                      std::chrono::milliseconds timeout)
+{
+    return Completed<size_t>([&]() { return ReadBulkEP(buffer, size, endpoint, timeout); });
+}
+
+std::future<size_t> ReplayTransport::SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                                       std::chrono::milliseconds timeout)
+{
+    return Completed<size_t>([&]()
+    {
+        ConstBuffer buffer{data, size};
+        WriteBulkEP(&buffer, 1, endpoint, timeout);
+        return size;
+    });
+}
+
+size_t ReplayTransport::ReadInterfaceDescriptor(int, unsigned char, unsigned char*, size_t)
+{
+    throw std::runtime_error("Descriptor reads are not recorded, " + trace.Filename() + " cannot replay them");
+}
+
+void ReplayTransport::StartInterruptIn(int, size_t, ReportCallback)
+{
+    throw std::runtime_error("Interrupt transfers are not recorded, " + trace.Filename() + " cannot replay them");
+}
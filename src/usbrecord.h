@@ -0,0 +1,256 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef USBRECORD_H
+#define USBRECORD_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "mappedfile.h"
+#include "usbtransport.h"
+
+//////////////////////////////////////////////////////////////////////
+// Trace Format
+//////////////////////////////////////////////////////////////////////
+
+// Little endian. A file header and the port path, then one record per
+// transfer each followed by its payload.
+const char cUSBRecordMagic[4] = {'C', 'G', 'R', '1'};
+const uint16_t cUSBRecordVersion = 1;
+
+struct USBRecordFileHeader
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t portPathLength;
+    uint64_t startTime;         // Unix time in ns, informational
+};
+
+struct USBRecordHeader
+{
+    enum Kind : uint8_t { Write = 1, Read, Reconnect, PacketSize };
+
+    uint32_t deltaMicros;       // Since the previous record completed
+    uint8_t kind;
+    uint8_t endpoint;
+    uint8_t status;             // 0 or USBTransferError::Cause + 1
+    uint8_t reserved;
+    uint32_t length;            // Payload bytes following
+    uint32_t transferred;       // Bytes accepted, or the wMaxPacketSize for PacketSize
+};
+
+static_assert(sizeof(USBRecordFileHeader) == 16 && sizeof(USBRecordHeader) == 16, "USB record layout changed");
+
+//////////////////////////////////////////////////////////////////////
+// RecordingTransport
+//////////////////////////////////////////////////////////////////////
+
+// Passes everything through to another transport, writing each bulk transfer
+// and reconnect to filename. Async submits stay asynchronous: a recorder
+// thread waits on each in submission order, the order the device is sent
+// them, and appends its record before the caller's future becomes ready.
+// Blocking calls are recorded in the same sequence. Interrupt and control
+// transfers are not recorded. Not for devices on a polled USBContext.
+class RecordingTransport : public USBTransport
+{
+public:
+    RecordingTransport(std::unique_ptr<USBTransport> transport, const std::string &filename);
+    ~RecordingTransport();
+
+    void Open() override;
+    void Close() override;
+    bool IsOpen() const override { return transport->IsOpen(); }
+
+    const std::string& PortPath() const override { return transport->PortPath(); }
+
+    void Reconnect(std::chrono::milliseconds timeout) override;
+    void ExpectReconnect() override { transport->ExpectReconnect(); }
+    bool TryReconnect() override;
+
+    void ClaimInterface(int interfaceNum) override { transport->ClaimInterface(interfaceNum); }
+    void ReleaseInterface(int interfaceNum) override { transport->ReleaseInterface(interfaceNum); }
+
+    size_t MaxPacketSize(int endpoint) override;
+    void ClearHalt(int endpoint) override { transport->ClearHalt(endpoint); }
+
+    void WriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint,
+                     std::chrono::milliseconds timeout) override;
+    size_t ReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                      std::chrono::milliseconds timeout) override;
+
+    std::future<size_t> SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint,
+                                          std::chrono::milliseconds timeout) override;
+    std::future<std::vector<unsigned char>> SubmitReadBulkEP(size_t readSize, int endpoint,
+                                                             std::chrono::milliseconds timeout) override;
+    std::future<size_t> SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                         std::chrono::milliseconds timeout) override;
+    std::future<size_t> SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                          std::chrono::milliseconds timeout) override;
+
+    void CancelTransfers() override;
+
+    size_t ReadInterfaceDescriptor(int interfaceNum, unsigned char type, unsigned char *buffer, size_t size) override
+    {
+        return transport->ReadInterfaceDescriptor(interfaceNum, type, buffer, size);
+    }
+
+    void StartInterruptIn(int endpoint, size_t reportSize, ReportCallback onReport) override
+    {
+        transport->StartInterruptIn(endpoint, reportSize, std::move(onReport));
+    }
+    void StopInterruptIn() override { transport->StopInterruptIn(); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Written once the port path is known
+    void WriteFileHeader();
+
+    // Payload is the concatenation of buffers, at is when the transfer completed.
+    // Recorder thread only, once started.
+    void Append(uint8_t kind, int endpoint, const ConstBuffer *buffers, size_t count, size_t transferred,
+                Clock::time_point at, const USBTransferError *error = nullptr);
+
+    void RecorderThread();
+
+    // Run record on the recorder thread after everything queued before it
+    void Enqueue(std::function<void()> record);
+
+    // Enqueue and wait, rethrowing anything record throws
+    void Ordered(std::function<void()> record);
+
+    // Future ready once inner completes and succeeded or failed has recorded it
+    template <typename T>
+    std::future<T> Recorded(std::future<T> inner, std::function<void(const T&, Clock::time_point)> succeeded,
+                            std::function<void(const USBTransferError&, Clock::time_point)> failed);
+
+    std::unique_ptr<USBTransport> transport;
+    std::string filename;
+    FILE *file;
+
+    bool headerWritten = false;
+    Clock::time_point last;
+    std::unordered_set<int> packetSizes;
+
+    std::mutex queueMutex;
+    std::condition_variable queued;
+    std::deque<std::function<void()>> queue;
+    bool stopping = false;
+    std::thread recorder;
+};
+
+//////////////////////////////////////////////////////////////////////
+// ReplayTransport
+//////////////////////////////////////////////////////////////////////
+
+// Serves a recorded trace in place of the device. Writes must match the
+// recording byte for byte, reads return the recorded data and recorded
+// failures are thrown again, so protocol code can be regression tested and
+// benchmarked offline. Anything else diverging from the trace throws.
+class ReplayTransport : public USBTransport
+{
+public:
+    enum class Speed { Maximum, Recorded };
+
+    explicit ReplayTransport(const std::string &filename, Speed speed = Speed::Maximum);
+
+    void Open() override { open = true; }
+    void Close() override { open = false; }
+    bool IsOpen() const override { return open; }
+
+    const std::string& PortPath() const override { return portPath; }
+
+    void Reconnect(std::chrono::milliseconds timeout) override;
+    void ExpectReconnect() override {}
+    bool TryReconnect() override;
+
+    void ClaimInterface(int) override {}
+    void ReleaseInterface(int) override {}
+
+    size_t MaxPacketSize(int endpoint) override;
+    void ClearHalt(int) override {}
+
+    void WriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint,
+                     std::chrono::milliseconds timeout) override;
+    size_t ReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                      std::chrono::milliseconds timeout) override;
+
+    std::future<size_t> SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint,
+                                          std::chrono::milliseconds timeout) override;
+    std::future<std::vector<unsigned char>> SubmitReadBulkEP(size_t readSize, int endpoint,
+                                                             std::chrono::milliseconds timeout) override;
+    std::future<size_t> SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                         std::chrono::milliseconds timeout) override;
+    std::future<size_t> SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                          std::chrono::milliseconds timeout) override;
+
+    void CancelTransfers() override {}
+
+    size_t ReadInterfaceDescriptor(int interfaceNum, unsigned char type, unsigned char *buffer, size_t size) override;
+
+    void StartInterruptIn(int endpoint, size_t reportSize, ReportCallback onReport) override;
+    void StopInterruptIn() override {}
+
+    // True once every recorded transfer has been replayed
+    bool AtEnd() const { return offset == trace.Size(); }
+    size_t Replayed() const { return replayed; }
+
+private:
+    // Next record, checked against what the caller is doing. Payload is left in payload.
+    const USBRecordHeader& Next(uint8_t kind, int endpoint);
+
+    // Rethrows a recorded failure
+    void ThrowRecorded(const USBRecordHeader &record, const std::string &what);
+
+    [[noreturn]] void Diverged(const std::string &what);
+
+    MappedFile trace;
+    Speed speed;
+    std::string portPath;
+
+    bool open = false;
+
+    size_t offset;
+    size_t replayed = 0;
+    USBRecordHeader record;
+    const unsigned char *payload = nullptr;
+
+    // Recorded time of the record last served, replayed relative to start
+    std::chrono::steady_clock::time_point start;
+    std::chrono::microseconds elapsed{0};
+
+    std::map<int, size_t> packetSizes;
+};
+
+#endif // USBRECORD_H
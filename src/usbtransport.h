@@ -0,0 +1,137 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef USBTRANSPORT_H
+#define USBTRANSPORT_H
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////
+// USBTransferError
+//////////////////////////////////////////////////////////////////////
+
+// Failed transfer, with the number of bytes the device accepted before failing
+class USBTransferError : public std::runtime_error
+{
+public:
+    enum Cause
+    {
+        Failed,
+        TimedOut,
+        Stalled,
+        NoDevice
+    };
+
+    USBTransferError(const std::string &what, size_t transferred, Cause cause = Failed)
+        : std::runtime_error(what), transferred(transferred), cause(cause) {}
+
+    size_t Transferred() const { return transferred; }
+    Cause Reason() const { return cause; }
+
+private:
+    size_t transferred;
+    Cause cause;
+};
+
+//////////////////////////////////////////////////////////////////////
+// USBTransport
+//////////////////////////////////////////////////////////////////////
+
+// Backend behind USBDevice. Implemented over libusb for real hardware and
+// by SimulatedCougar for benchmarking and testing without a device.
+class USBTransport
+{
+public:
+    struct ConstBuffer
+    {
+        const unsigned char *data;
+        size_t size;
+    };
+
+    virtual ~USBTransport() = default;
+
+    virtual void Open() = 0;
+    virtual void Close() = 0;
+    virtual bool IsOpen() const = 0;
+
+    virtual const std::string& PortPath() const = 0;
+
+    virtual void Reconnect(std::chrono::milliseconds timeout) = 0;
+    virtual void ExpectReconnect() = 0;
+
+    // Non-blocking Reconnect. Call repeatedly once the device has been told to
+    // re-enumerate, true once it is back with its interfaces claimed again.
+    virtual bool TryReconnect() = 0;
+
+    virtual void ClaimInterface(int interfaceNum) = 0;
+    virtual void ReleaseInterface(int interfaceNum) = 0;
+
+    virtual size_t MaxPacketSize(int endpoint) = 0;
+
+    // Clears a stall, resetting the endpoint's data toggle
+    virtual void ClearHalt(int endpoint) = 0;
+
+    // Transfers fail with USBTransferError if not complete within timeout of
+    // being submitted, zero waits forever.
+
+    // Blocking. Writes are submitted back to back and waited on together, any
+    // not yet sent are cancelled once one fails.
+    virtual void WriteBulkEP(const ConstBuffer *buffers, size_t count, int endpoint,
+                             std::chrono::milliseconds timeout) = 0;
+    virtual size_t ReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                              std::chrono::milliseconds timeout) = 0;
+
+    virtual std::future<size_t> SubmitWriteBulkEP(std::vector<unsigned char> data, int endpoint,
+                                                  std::chrono::milliseconds timeout) = 0;
+    virtual std::future<std::vector<unsigned char>> SubmitReadBulkEP(size_t readSize, int endpoint,
+                                                                     std::chrono::milliseconds timeout) = 0;
+    virtual std::future<size_t> SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                                 std::chrono::milliseconds timeout) = 0;
+
+    // Caller owned
+    virtual std::future<size_t> SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                                  std::chrono::milliseconds timeout) = 0;
+
+    // Cancel everything in flight, returns once all transfers have completed
+    virtual void CancelTransfers() = 0;
+
+    // Standard GET_DESCRIPTOR addressed to an interface, e.g the HID report descriptor
+    virtual size_t ReadInterfaceDescriptor(int interfaceNum, unsigned char type, unsigned char *buffer, size_t size) = 0;
+
+    // Called from the event thread for each report. A null report means the
+    // stream has ended due to an error, e.g the device was unplugged.
+    using ReportCallback = std::function<void(const unsigned char *report, size_t size)>;
+
+    // Continuous interrupt IN polling with several transfers kept queued so no
+    // report is missed. One stream at a time.
+    virtual void StartInterruptIn(int endpoint, size_t reportSize, ReportCallback onReport) = 0;
+
+    // Returns once the last report callback has finished
+    virtual void StopInterruptIn() = 0;
+};
+
+#endif // USBTRANSPORT_H
@@ -0,0 +1,693 @@
+/*
+Cougar-Util
+
+Copyright © 2018 Gary Preston (gary@mups.co.uk)
+
+This file is part of cougar-util.
+
+cougar-util is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Regression tests for the Cougar helpers against SimulatedCougar, no hardware required.
+// Run from the repository root via "make check".
+
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "calibration.h"
+#include "controlserver.h"
+#include "cougardevice.h"
+#include "hidreport.h"
+#include "mappedfile.h"
+#include "profilelibrary.h"
+#include "simcougar.h"
+#include "statestore.h"
+#include "telemetry.h"
+#include "telemetryfeed.h"
+#include "usbdevice.h"
+#include "usbmetrics.h"
+#include "usbrecord.h"
+
+using namespace CougarDevice;
+
+static const std::string cProfileOn = "config/rdr-cursor-on.tmc";
+static const std::string cProfileOff = "config/rdr-cursor-off.tmc";
+static const std::string cTMJBinary = "config/dunc_dx.bin";
+static const std::string cTMJReplacement = "config/dunc_dx_replacement.bin";
+
+//////////////////////////////////////////////////////////////////////
+
+struct Simulated
+{
+    SimulatedCougar *sim;
+    std::unique_ptr<USBDevice> dev;
+};
+
+static Simulated OpenSimulated(const SimulatedCougarConfig &config = SimulatedCougarConfig())
+{
+    Simulated s;
+    s.sim = new SimulatedCougar(config);
+    s.dev.reset(new USBDevice(std::unique_ptr<USBTransport>(s.sim)));
+
+    s.dev->Open();
+    s.dev->ClaimInterface(cCougarInterfaceBulkOut);
+    s.dev->ClaimInterface(cCougarInterfaceBulkIn);
+
+    return s;
+}
+
+// Fast enough that a test never waits on the simulated device
+static SimulatedCougarConfig FastConfig()
+{
+    SimulatedCougarConfig config;
+    config.latency = std::chrono::microseconds(0);
+    config.reenumerationDelay = std::chrono::milliseconds(10);
+    return config;
+}
+
+static void Check(bool condition, const std::string &message)
+{
+    if (! condition)
+        throw std::runtime_error(message);
+}
+
+static std::vector<unsigned char> FileContents(const std::string &filename)
+{
+    MappedFile file(filename);
+    return std::vector<unsigned char>(file.Data(), file.Data() + file.Size());
+}
+
+// File or directory removed once the test completes
+struct TempPath
+{
+    explicit TempPath(const std::string &name) : filename("/tmp/cougar-test-" + name + "." + std::to_string(getpid()))
+    {
+        Remove();
+    }
+    ~TempPath() { Remove(); }
+
+    void Remove() const { std::system(("rm -rf " + filename).c_str()); }
+
+    std::string filename;
+};
+
+static std::string Identity(const SimulatedCougar &sim)
+{
+    return ProfileIdentity(sim.Profile().data(), sim.Profile().size());
+}
+
+// Sends request to the control socket and returns the first reply line
+static std::string ControlRequest(const std::string &socketPath, const std::string &request)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socketPath.c_str());
+
+    // The server may still be starting
+    for (int attempt = 0; connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0; attempt++)
+    {
+        Check(attempt < 100, "unable to connect to " + socketPath);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+    std::string reply;
+    char c;
+    while (recv(fd, &c, 1, 0) == 1 && c != '\n')
+        reply += c;
+
+    close(fd);
+    return reply;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Tests
+//////////////////////////////////////////////////////////////////////
+
+// A plain upload between two -s uploads of the same TMJ must not leave the store
+// claiming the first is still in flash
+static void TestSkipAfterPlainUpload()
+{
+    TempPath state("state");
+    DeviceStateStore store(state.filename);
+    auto s = OpenSimulated(FastConfig());
+
+    CougarTransaction a(&store, true);
+    a.UploadTMJBinary(cTMJBinary);
+    Check(a.Commit(*s.dev), "first -s upload skipped");
+
+    CougarTransaction b(&store);
+    b.UploadTMJBinary(cTMJReplacement);
+    b.Commit(*s.dev);
+    Check(s.sim->TMJ() == FileContents(cTMJReplacement), "plain upload not written");
+
+    Check(a.Commit(*s.dev), "-s upload skipped after a plain upload replaced it");
+    Check(s.sim->TMJ() == FileContents(cTMJBinary), "device does not hold the -s upload");
+}
+
+// A write failing part way must drop the recorded hash rather than keep the old one
+static void TestFailedUploadForgotten()
+{
+    TempPath state("state");
+    DeviceStateStore store(state.filename);
+    std::string identity;
+
+    {
+        auto s = OpenSimulated(FastConfig());
+        identity = Identity(*s.sim);
+
+        CougarTransaction a(&store, true);
+        a.UploadTMJBinary(cTMJBinary);
+        a.Commit(*s.dev);
+    }
+
+    Check(! store.Get("sim-1", "tmj", identity).empty(), "upload not recorded");
+
+    auto config = FastConfig();
+    // The profile read's request and response succeed, the first write fails
+    config.failEveryNthTransfer = 3;
+    auto s = OpenSimulated(config);
+
+    CougarTransaction b(&store);
+    b.UploadTMJBinary(cTMJReplacement);
+    b.SetOptions(CougarOptions::Defaults);
+
+    bool failed = false;
+    try
+    {
+        b.Commit(*s.dev);
+    }
+    catch (const std::exception&)
+    {
+        failed = true;
+    }
+
+    Check(failed, "fault injection did not fail the upload");
+    Check(store.Get("sim-1", "tmj", identity).empty(), "failed upload left the previous hash recorded");
+}
+
+// Another Cougar on the same port must not be assumed to hold the first one's TMJ,
+// while a new profile on the same Cougar leaves its TMJ in place
+static void TestTMJRecordedPerDevice()
+{
+    TempPath state("state");
+    DeviceStateStore store(state.filename);
+
+    {
+        auto s = OpenSimulated(FastConfig());
+        CougarTransaction a(&store, true);
+        a.UploadProfile(cProfileOff);
+        a.UploadTMJBinary(cTMJBinary);
+        a.Commit(*s.dev);
+    }
+
+    auto s = OpenSimulated(FastConfig());
+
+    CougarTransaction tmj(&store, true);
+    tmj.UploadTMJBinary(cTMJBinary);
+    Check(tmj.Commit(*s.dev), "TMJ skipped on a different Cougar at the same port");
+    Check(s.sim->TMJ() == FileContents(cTMJBinary), "device does not hold the upload");
+
+    CougarTransaction profile(&store, true);
+    profile.UploadProfile(cProfileOff);
+    Check(profile.Commit(*s.dev), "profile not written");
+
+    CougarState session;
+    Check(! UploadTMJBinaryIfChanged(*s.dev, cTMJBinary, store, &session), "TMJ rewritten after a profile change");
+}
+
+// The store may claim a TMC that was since replaced, e.g from another host
+static void TestSwitchConfirmsProfile()
+{
+    TempPath state("state");
+    TempPath directory("library");
+    DeviceStateStore store(state.filename);
+
+    ProfileLibrary library(directory.filename);
+    library.Add("on", cProfileOn, "");
+    store.Set("sim-1", "tmc", library.Find("on").tmc, "stale");
+
+    auto s = OpenSimulated(FastConfig());
+
+    Check(SwitchProfile(*s.dev, library, "on", store), "switch trusted a stale store over the device");
+    Check(! SwitchProfile(*s.dev, library, "on", store), "switch rewrote the profile already on the device");
+}
+
+// After 09 05 the Cougar still answers for a while before re-enumerating, so
+// the reset appears to complete in place. Reconnect must wait it out.
+static void TestReconnectAfterDelayedDropOff()
+{
+    auto config = FastConfig();
+    config.dropOffDelay = std::chrono::milliseconds(50);
+    auto s = OpenSimulated(config);
+
+    // Windows axis flag differs from the simulated Cougar's, forcing a reset
+    CougarTransaction transaction;
+    transaction.UploadProfile(cProfileOff);
+    transaction.SetOptions(CougarOptions::UserProfile);
+    transaction.Commit(*s.dev);
+
+    Check(s.sim->ResetCount() == 1, "profile upload did not reset the device");
+
+    // Handle must still be usable once the device would have dropped off
+    std::this_thread::sleep_for(config.dropOffDelay + config.reenumerationDelay);
+
+    CougarState state;
+    Check(state.Options(*s.dev) == CougarOptions::UserProfile, "options written before the device re-enumerated");
+}
+
+// A device closed after a failed commit is reopened by polling, not by the caller
+static void TestAsyncCommitReopens()
+{
+    auto s = OpenSimulated(FastConfig());
+    s.dev->Close();
+
+    CougarTransaction transaction;
+    transaction.SetOptions(CougarOptions::UserProfile);
+
+    CougarState state;
+    AsyncCommit commit(*s.dev, transaction, state);
+    while (! commit.Poll())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    Check(s.dev->IsOpen(), "device not reopened");
+    Check(s.sim->Options() == 1, "options not applied after reopening");
+}
+
+// SimulatedCougar completes submits before returning. This one completes them
+// later, one at a time in submission order, as a real device would.
+class LateCougar : public SimulatedCougar
+{
+public:
+    static constexpr std::chrono::milliseconds cDelay{100};
+
+    using SimulatedCougar::SimulatedCougar;
+
+    std::future<size_t> SubmitWriteBulkEP(const unsigned char *data, size_t size, int endpoint,
+                                          std::chrono::milliseconds timeout) override
+    {
+        return Later([=]() { return SimulatedCougar::SubmitWriteBulkEP(data, size, endpoint, timeout).get(); });
+    }
+
+    std::future<size_t> SubmitReadBulkEP(unsigned char *buffer, size_t size, int endpoint,
+                                         std::chrono::milliseconds timeout) override
+    {
+        return Later([=]() { return SimulatedCougar::SubmitReadBulkEP(buffer, size, endpoint, timeout).get(); });
+    }
+
+private:
+    template <typename F>
+    std::future<size_t> Later(F transfer)
+    {
+        auto done = std::make_shared<std::promise<void>>();
+        auto before = previous;
+        previous = done->get_future().share();
+
+        return std::async(std::launch::async, [=]()
+        {
+            if (before.valid())
+                before.wait();
+            std::this_thread::sleep_for(cDelay);
+
+            try
+            {
+                size_t result = transfer();
+                done->set_value();
+                return result;
+            }
+            catch (...)
+            {
+                done->set_value();
+                throw;
+            }
+        });
+    }
+
+    std::shared_future<void> previous;
+};
+
+constexpr std::chrono::milliseconds LateCougar::cDelay;
+
+// Recording must not turn async submits into blocking calls, and the trace must
+// still replay in the order the transfers were sent
+static void TestRecordingStaysAsync()
+{
+    TempPath trace("trace");
+
+    CougarTransaction transaction;
+    transaction.UploadTMJBinary(cTMJBinary);
+    transaction.SetOptions(CougarOptions::UserProfile);
+
+    {
+        USBDevice dev{std::unique_ptr<USBTransport>(new LateCougar(FastConfig()))};
+        dev.Record(trace.filename);
+        dev.Open();
+        dev.ClaimInterface(cCougarInterfaceBulkOut);
+        dev.ClaimInterface(cCougarInterfaceBulkIn);
+
+        CougarState state;
+        AsyncCommit commit(dev, transaction, state);
+
+        auto start = std::chrono::steady_clock::now();
+        Check(! commit.Poll(), "commit completed on its first poll");
+        Check(std::chrono::steady_clock::now() - start < LateCougar::cDelay / 2, "recorded submit blocked");
+
+        while (! commit.Poll())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    auto replay = new ReplayTransport(trace.filename);
+    USBDevice dev{std::unique_ptr<USBTransport>(replay)};
+    dev.Open();
+
+    CougarState state;
+    AsyncCommit commit(dev, transaction, state);
+    while (! commit.Poll())
+        ;
+
+    Check(replay->AtEnd(), "replay did not consume the whole trace");
+}
+
+// A duration exactly on a bucket's bound is counted within it, as Prometheus' le
+static void TestHistogramBucketBounds()
+{
+    LatencyHistogram histogram;
+    histogram.Record(std::chrono::microseconds(1));
+    histogram.Record(std::chrono::microseconds(1024));
+    histogram.Record(std::chrono::microseconds(1025));
+
+    Check(histogram.Bucket(0) == 1, "1 us not within the 1 us bucket");
+    Check(LatencyHistogram::BucketLimitMicros(10) == 1024 && histogram.Bucket(10) == 1,
+          "1024 us not within the 1024 us bucket");
+    Check(histogram.Bucket(11) == 1, "1025 us not within the 2048 us bucket");
+}
+
+// Bucket bounds and sums are exact, not rounded to the stream's default precision
+static void TestPrometheusPrecision()
+{
+    USBMetrics::Global().Record(USBMetrics::OpInputLoad, std::chrono::microseconds(12345678));
+    auto text = USBMetrics::Global().FormatPrometheus();
+
+    Check(text.find("le=\"1.048576\"") != std::string::npos, "bucket bound 2^20 us rounded");
+    Check(text.find("le=\"0.000001\"") != std::string::npos, "bucket bound 1 us rounded");
+    Check(text.find("cougar_operation_latency_seconds_sum{operation=\"input_load\"} 12.345678\n") != std::string::npos,
+          "sum rounded");
+}
+
+// A bad TMJ must be rejected before anything is sent, leaving no read in flight
+static void TestInvalidTMJSendsNothing()
+{
+    auto s = OpenSimulated(FastConfig());
+
+    bool failed = false;
+    try
+    {
+        UploadTMJBinary(*s.dev, "config/missing.bin");
+    }
+    catch (const std::exception&)
+    {
+        failed = true;
+    }
+
+    Check(failed, "missing TMJ accepted");
+    Check(s.sim->CommandCount() == 0, "commands sent before the TMJ was validated");
+}
+
+// Feed built by hand, as a crashed or hostile writer could leave it
+struct FakeTelemetryFeed
+{
+    FakeTelemetryFeed() : name("/cougar-test-feed." + std::to_string(getpid()))
+    {
+        size = sizeof(TelemetryHeader) + cTelemetrySlots * sizeof(TelemetrySlot);
+
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+        Check(fd >= 0 && ftruncate(fd, size) == 0, "unable to create shared memory");
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        Check(mapping != MAP_FAILED, "unable to map shared memory");
+
+        header = new (mapping) TelemetryHeader();
+        header->magic = cTelemetryMagic;
+        header->version = cTelemetryVersion;
+        header->slotCount = cTelemetrySlots;
+        slots = reinterpret_cast<TelemetrySlot*>(static_cast<unsigned char*>(mapping) + sizeof(TelemetryHeader));
+    }
+
+    ~FakeTelemetryFeed()
+    {
+        munmap(mapping, size);
+        shm_unlink(name.c_str());
+    }
+
+    std::string name;
+    size_t size;
+    void *mapping;
+    TelemetryHeader *header;
+    TelemetrySlot *slots;
+};
+
+// Neither a corrupt header nor a writer stopped mid publish may hang or crash readers
+static void TestTelemetryReaderBounds()
+{
+    FakeTelemetryFeed feed;
+
+    feed.header->slotCount = 0;
+    bool rejected = false;
+    try
+    {
+        TelemetryReader reader(feed.name);
+    }
+    catch (const std::exception&)
+    {
+        rejected = true;
+    }
+    Check(rejected, "feed with no slots accepted");
+
+    feed.header->slotCount = cTelemetrySlots;
+    TelemetryReader reader(feed.name);
+
+    // First slot left odd, as by a writer that died part way through
+    feed.slots[0].seq.store(1);
+    feed.header->published.store(1);
+
+    TelemetryState state;
+    Check(! reader.Latest(state), "stalled slot read as valid");
+
+    uint64_t next = 0;
+    Check(reader.ReadSince(next, &state, 1) == 0 && reader.Lost() == 1, "stalled slot not counted as lost");
+}
+
+// A second writer must not take over a feed whose writer is alive, only a stale one
+static void TestTelemetryWriterTakeover()
+{
+    std::string name = "/cougar-test-writer." + std::to_string(getpid());
+
+    {
+        FakeTelemetryFeed stale;
+        stale.header->writerPid = 0;
+        TelemetryWriter replacement(stale.name);
+    }
+
+    TelemetryWriter writer(name);
+
+    bool refused = false;
+    try
+    {
+        TelemetryWriter second(name);
+    }
+    catch (const std::exception&)
+    {
+        refused = true;
+    }
+    Check(refused, "second writer took over a live feed");
+
+    writer.Setup({0x30}, 1);
+    int32_t axes[1] = {42};
+    writer.Publish(axes, 1);
+
+    TelemetryReader reader(name);
+    TelemetryState state;
+    Check(reader.Latest(state) && state.axes[0] == 42, "live feed lost to the refused writer");
+}
+
+// RunControlServer stops on SIGTERM for the rest of the process, so every
+// control socket check shares one server
+static void TestControlServer()
+{
+    TempPath state("state");
+    TempPath socket_path("socket");
+    TempPath files("files");
+    DeviceStateStore store(state.filename);
+
+    mkdir(files.filename.c_str(), 0700);
+    std::system(("cp " + cProfileOff + " " + files.filename + "/off.tmc").c_str());
+
+    char resolved[PATH_MAX];
+    std::string outside = realpath(cProfileOn.c_str(), resolved);
+    symlink(outside.c_str(), (files.filename + "/link.tmc").c_str());
+
+    auto sim = new SimulatedCougar(FastConfig());
+    USBDevice dev{std::unique_ptr<USBTransport>(sim)};
+
+    std::thread server([&]() { RunControlServer(dev, socket_path.filename, store, files.filename); });
+
+    std::string failure;
+    try
+    {
+        // Requests already parsed from a client that then overruns the limit are dropped
+        auto reply = ControlRequest(socket_path.filename, "options user\n" + std::string(8192, 'x'));
+        Check(reply == "error request too long", "over-length line answered with \"" + reply + "\"");
+        Check(sim->CommandCount() == 0, "request from an over-length client reached the device");
+
+        Check(ControlRequest(socket_path.filename, "options user\n") == "ok", "well formed request refused");
+        Check(sim->Options() == 1, "options not applied");
+
+        struct stat info;
+        Check(lstat(socket_path.filename.c_str(), &info) == 0 && (info.st_mode & 0777) == 0660,
+              "socket is not mode 0660");
+
+        // Only files inside the served directory reach the device
+        size_t commands = sim->CommandCount();
+        Check(ControlRequest(socket_path.filename, "tmc link.tmc\n").find("is outside") != std::string::npos,
+              "symlink escaped the served directory");
+        Check(ControlRequest(socket_path.filename, "tmc " + outside + "\n").find("is outside") != std::string::npos,
+              "absolute path escaped the served directory");
+        Check(sim->CommandCount() == commands, "file outside the served directory was uploaded");
+        Check(ControlRequest(socket_path.filename, "tmc off.tmc\n") == "ok", "served file refused");
+
+        // A second server must not take over a socket still being served
+        USBDevice other{std::unique_ptr<USBTransport>(new SimulatedCougar(FastConfig()))};
+        bool refused = false;
+        try
+        {
+            RunControlServer(other, socket_path.filename, store, files.filename);
+        }
+        catch (const std::runtime_error &e)
+        {
+            refused = std::string(e.what()).find("in use") != std::string::npos;
+        }
+        Check(refused, "live control socket replaced");
+        Check(ControlRequest(socket_path.filename, "state\n").compare(0, 2, "ok") == 0, "first server lost its socket");
+    }
+    catch (const std::exception &e)
+    {
+        failure = e.what();
+    }
+
+    std::raise(SIGTERM);
+    server.join();
+
+    Check(failure.empty(), failure);
+}
+
+// Captured limits must lie within, and close to, each simulated axis' sweep
+static void TestCalibrationCapture()
+{
+    auto config = FastConfig();
+    config.reportInterval = std::chrono::microseconds(20);
+    auto s = OpenSimulated(config);
+    s.dev->ClaimInterface(cCougarInterfaceHID);
+
+    HIDReportLayout layout(s.dev->ReadHIDReportDescriptor(cCougarInterfaceHID));
+    CalibrationTracker tracker(layout);
+    HIDCapture capture(*s.dev, tracker);
+
+    capture.Start();
+    tracker.SetPhase(CalibrationTracker::PhaseCentre);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    tracker.SetPhase(CalibrationTracker::PhaseRange);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    capture.Stop();
+
+    auto calibration = tracker.Result();
+    Check(calibration.size() == SimulatedCougar::cHIDAxisCount, "axis count differs from the report descriptor");
+
+    // Largest step between reports of the fastest axis
+    const int32_t cStep = 37 * SimulatedCougar::cHIDAxisCount;
+
+    for (size_t a = 0; a < calibration.size(); a++)
+    {
+        const auto &axis = calibration[a];
+        std::string name = "axis " + std::to_string(a);
+
+        Check(axis.min <= axis.centre && axis.centre <= axis.max, name + " centre outside its limits");
+        Check(axis.min >= SimulatedCougar::cHIDAxisMin[a] && axis.min < SimulatedCougar::cHIDAxisMin[a] + cStep,
+              name + " min " + std::to_string(axis.min) + " not the sweep's lower limit");
+        Check(axis.max <= SimulatedCougar::cHIDAxisMax[a] && axis.max > SimulatedCougar::cHIDAxisMax[a] - cStep,
+              name + " max " + std::to_string(axis.max) + " not the sweep's upper limit");
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+int main()
+{
+    const std::pair<const char*, std::function<void()>> tests[] = {
+        {"skip after plain upload", TestSkipAfterPlainUpload},
+        {"failed upload forgotten", TestFailedUploadForgotten},
+        {"tmj recorded per device", TestTMJRecordedPerDevice},
+        {"switch confirms profile", TestSwitchConfirmsProfile},
+        {"reconnect after delayed drop off", TestReconnectAfterDelayedDropOff},
+        {"async commit reopens", TestAsyncCommitReopens},
+        {"invalid tmj sends nothing", TestInvalidTMJSendsNothing},
+        {"calibration capture", TestCalibrationCapture},
+        {"telemetry reader bounds", TestTelemetryReaderBounds},
+        {"telemetry writer takeover", TestTelemetryWriterTakeover},
+        {"recording stays async", TestRecordingStaysAsync},
+        {"histogram bucket bounds", TestHistogramBucketBounds},
+        {"prometheus precision", TestPrometheusPrecision},
+        {"control server", TestControlServer},
+    };
+
+    size_t failed = 0;
+    for (const auto &test : tests)
+    {
+        try
+        {
+            test.second();
+            std::cout << "PASS " << test.first << "\n";
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "FAIL " << test.first << ": " << e.what() << "\n";
+            failed++;
+        }
+    }
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}